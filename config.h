@@ -3,4 +3,8 @@
 
 #define _POSIX_C_SOURCE 200809L
 
+/* Needed for the Linux-specific interfaces (pidfd, epoll) that libcommon
+ * uses when they're available. Portable fallbacks are kept for the rest. */
+#define _GNU_SOURCE
+
 #endif
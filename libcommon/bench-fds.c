@@ -0,0 +1,184 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libproc.h"
+
+/* Measures launch latency against the number of open descriptors in the
+ * parent, with RLIMIT_NOFILE raised as far as it'll go. "fork" and "spawn"
+ * are proc_launch() with those backends. "loop" is a plain fork() that calls
+ * close() on every descriptor up to the limit before exec'ing, which is what
+ * the children would have to do without close_range().
+ *
+ * Usage: bench-fds [count] [open_fds...]
+ *
+ * Build without sanitizers (make sanitize= ...) to get meaningful numbers. */
+
+static const unsigned int default_fd_counts[] = {0, 100, 1000, 10000};
+
+static char *const child_argv[] = {(char *) "/bin/true", NULL};
+
+static double elapsed_us(const struct timespec *start,
+                         const struct timespec *end)
+{
+    double result = (double)(end->tv_sec - start->tv_sec) * 1e6;
+    result += (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+    return result;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned int count, double pct)
+{
+    unsigned int index = (unsigned int)((pct / 100.0) * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static pid_t launch_loop(rlim_t limit)
+{
+    pid_t child = fork();
+
+    if (child == 0) {
+        for (rlim_t fd = STDERR_FILENO + 1; fd < limit; fd++) {
+            close((int) fd);
+        }
+
+        execv(child_argv[0], child_argv);
+        _exit(127);
+    }
+
+    return child;
+}
+
+static int run_method(const char *name, unsigned int open_fds, rlim_t limit,
+                      double *samples, unsigned int count)
+{
+    struct timespec start;
+    struct timespec end;
+    pid_t child;
+    int status;
+
+    for (unsigned int x = 0; x < count; x++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (strcmp(name, "loop") == 0) {
+            child = launch_loop(limit);
+        } else {
+            proc_set_backend(strcmp(name, "spawn") == 0 ? proc_backend_spawn :
+                                                          proc_backend_fork);
+            child = proc_launch(child_argv, STDIN_FILENO, STDOUT_FILENO,
+                                STDERR_FILENO);
+        }
+
+        if (child < 0) {
+            fprintf(stderr, "error: launch failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        /* The loop method doesn't wait for the exec, so time it through
+         * to the child's exit to keep the comparison fair. */
+
+        waitpid_nointr(child, &status, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        samples[x] = elapsed_us(&start, &end);
+    }
+
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+    printf("%-6s %8u %10ju %10.1f %10.1f %10.1f\n", name, open_fds,
+           (uintmax_t) limit, percentile(samples, count, 50),
+           percentile(samples, count, 99), samples[count - 1]);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const methods[] = {"fork", "spawn", "loop"};
+    unsigned int count = 200;
+    const unsigned int *fd_counts = default_fd_counts;
+    unsigned int nfd_counts =
+        sizeof(default_fd_counts) / sizeof(default_fd_counts[0]);
+    unsigned int custom_counts[argc];
+    unsigned int opened = 0;
+    struct rlimit limit;
+    double *samples;
+
+    if (argc > 1) {
+        count = (unsigned int) strtoul(argv[1], NULL, 10);
+    }
+
+    if (argc > 2) {
+        for (int x = 2; x < argc; x++) {
+            custom_counts[x - 2] = (unsigned int) strtoul(argv[x], NULL, 10);
+        }
+        fd_counts = custom_counts;
+        nfd_counts = (unsigned int)(argc - 2);
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [count] [open_fds...]\n", argv[0]);
+        return 1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        perror("couldn't read RLIMIT_NOFILE");
+        return 1;
+    }
+
+    limit.rlim_cur = limit.rlim_max;
+
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        perror("couldn't raise RLIMIT_NOFILE");
+        return 1;
+    }
+
+    samples = malloc(count * sizeof(*samples));
+
+    if (samples == NULL) {
+        perror("couldn't allocate sample buffer");
+        return 1;
+    }
+
+    printf("%-6s %8s %10s %10s %10s %10s\n", "method", "open_fds", "nofile",
+           "p50_us", "p99_us", "max_us");
+
+    for (unsigned int x = 0; x < nfd_counts; x++) {
+        /* The descriptors are opened without O_CLOEXEC, like the ones that
+         * would otherwise leak into services. */
+
+        while (opened < fd_counts[x]) {
+            if (open_nointr("/dev/null", O_RDONLY) < 0) {
+                perror("couldn't open ballast descriptor");
+                free(samples);
+                return 1;
+            }
+            opened++;
+        }
+
+        for (unsigned int y = 0; y < sizeof(methods) / sizeof(methods[0]);
+             y++) {
+            if (run_method(methods[y], opened, limit.rlim_cur, samples,
+                           count) != 0) {
+                free(samples);
+                return 1;
+            }
+        }
+    }
+
+    free(samples);
+    return 0;
+}
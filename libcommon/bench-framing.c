@@ -0,0 +1,253 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libsocks.h"
+
+/* Compares libsocks protocol versions 1 and 2. For each version, the client
+ * and the event-driven server are run under ptrace() to count the syscalls
+ * that each side makes per request, and then round trips are timed without
+ * tracing. Every request uses socks_client_process(), so the counts include
+ * connection setup. Usage: bench-framing [count]
+ *
+ * Build without sanitizers (make sanitize= ...) to get meaningful numbers. */
+
+static const char socket_path[] = "/tmp/bench-framing.sock";
+static const char payload[64] = "bench-framing request";
+
+static double elapsed_us(const struct timespec *start,
+                         const struct timespec *end)
+{
+    double result = (double)(end->tv_sec - start->tv_sec) * 1e6;
+    result += (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+    return result;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned int count, double pct)
+{
+    unsigned int index = (unsigned int)((pct / 100.0) * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static int echo(int fd, const char *buf, uint32_t nbyte)
+{
+    return (int) socks_respond(fd, buf, nbyte);
+}
+
+static void trace_me(void)
+{
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+}
+
+static pid_t start_server(int socket_fd, bool traced)
+{
+    struct socks_server *server;
+    pid_t child = fork();
+
+    if (child == 0) {
+        if (traced) {
+            trace_me();
+        }
+
+        server = socks_server_create(socket_fd, echo, 16);
+
+        while ((server != NULL) && (socks_server_run(server, -1) >= 0)) {
+        }
+
+        _exit(1);
+    }
+
+    return child;
+}
+
+static int run_client(unsigned int count, double *samples)
+{
+    char output[sizeof(payload)];
+    struct timespec start;
+    struct timespec end;
+    ssize_t result;
+
+    for (unsigned int x = 0; x < count; x++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = socks_client_process(socket_path, payload, sizeof(payload),
+                                      output, sizeof(output));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (result != sizeof(payload)) {
+            fprintf(stderr, "error: request failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (samples != NULL) {
+            samples[x] = elapsed_us(&start, &end);
+        }
+    }
+
+    return 0;
+}
+
+/* Runs 'count' requests with both sides traced, and stores the number of
+ * syscalls that each side made per request. Each syscall stops the tracee
+ * twice (on entry and on exit). */
+static int count_syscalls(int socket_fd, unsigned int count,
+                          double *client_calls, double *server_calls)
+{
+    unsigned long client_stops = 0;
+    unsigned long server_stops = 0;
+    pid_t server = start_server(socket_fd, true);
+    pid_t client;
+    pid_t stopped;
+    int client_status = -1;
+    int status;
+    int signum;
+
+    client = fork();
+
+    if (client == 0) {
+        trace_me();
+        _exit((run_client(count, NULL) == 0) ? 0 : 1);
+    }
+
+    while (1) {
+        stopped = waitpid_nointr(-1, &status, __WALL);
+
+        if (stopped < 0) {
+            perror("couldn't wait on tracee");
+            break;
+        }
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (stopped == client) {
+                client_status = status;
+                break;
+            }
+
+            continue;
+        }
+
+        signum = WSTOPSIG(status);
+
+        if (signum == (SIGTRAP | 0x80)) {
+            if (stopped == client) {
+                client_stops++;
+            } else {
+                server_stops++;
+            }
+
+            signum = 0;
+        } else if (signum == SIGSTOP) {
+            ptrace(PTRACE_SETOPTIONS, stopped, NULL,
+                   (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+            signum = 0;
+        }
+
+        ptrace(PTRACE_SYSCALL, stopped, NULL, (void *)(long) signum);
+    }
+
+    kill(server, SIGKILL);
+    waitpid_nointr(server, &status, __WALL);
+
+    *client_calls = (double) client_stops / 2.0 / count;
+    *server_calls = (double) server_stops / 2.0 / count;
+    if (!WIFEXITED(client_status) || (WEXITSTATUS(client_status) != 0)) {
+        fprintf(stderr, "error: traced client failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run_version(int socket_fd, unsigned int version,
+                       unsigned int count, double *samples)
+{
+    double client_calls;
+    double server_calls;
+    pid_t server;
+    int status;
+    int result;
+
+    socks_set_protocol(version);
+
+    if (count_syscalls(socket_fd, count, &client_calls, &server_calls) != 0) {
+        return -1;
+    }
+
+    server = start_server(socket_fd, false);
+    result = run_client(count, samples);
+    kill(server, SIGKILL);
+    waitpid_nointr(server, &status, 0);
+
+    if (result != 0) {
+        return -1;
+    }
+
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+    printf("v%-5u %12.1f %12.1f %10.1f %10.1f\n", version, client_calls,
+           server_calls, percentile(samples, count, 50),
+           percentile(samples, count, 99));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int count = 2000;
+    double *samples;
+    int socket_fd;
+    int result = 0;
+
+    if (argc > 1) {
+        count = (unsigned int) strtoul(argv[1], NULL, 10);
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [count]\n", argv[0]);
+        return 1;
+    }
+
+    samples = malloc(count * sizeof(*samples));
+
+    if (samples == NULL) {
+        perror("couldn't allocate sample buffer");
+        return 1;
+    }
+
+    unlink(socket_path);
+    socket_fd = socks_server_open(socket_path);
+
+    if (socket_fd < 0) {
+        perror("couldn't open server socket");
+        free(samples);
+        return 1;
+    }
+
+    printf("%-6s %12s %12s %10s %10s\n", "proto", "client_calls",
+           "server_calls", "p50_us", "p99_us");
+
+    for (unsigned int version = 1; (result == 0) && (version <= 2);
+         version++) {
+        result = run_version(socket_fd, version, count, samples);
+    }
+
+    socks_server_close(socket_fd);
+    unlink(socket_path);
+    free(samples);
+    return (result == 0) ? 0 : 1;
+}
@@ -0,0 +1,528 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libpath.h"
+#include "libproc.h"
+#include "libzygote.h"
+
+/* Records libproc timings as CSV on stdout, so that runs from different
+ * commits can be diffed or plotted against each other. Usage:
+ *
+ *     bench-proc [max_count]
+ *
+ * Each row has percentiles (in microseconds) for one metric:
+ *
+ *   launch    from calling proc_launch() to the first line of the child's
+ *             main(), for 'count' processes launched back to back.
+ *   exit      from the child's last timestamp before _exit() to the parent
+ *             hearing about it through a proc_waitset, with 'count'
+ *             processes all exiting at the same moment.
+ *   findprog  path_findprog() (and path_findprog_cached()) resolving a
+ *             program in the last of 'param' $PATH directories.
+ *
+ * Process counts run from 1 up to max_count (10000 by default) in powers of
+ * ten, for every launch backend. The children are this same binary, re-run
+ * in a child mode that reports its timestamps over a pipe.
+ *
+ * Build without sanitizers (make sanitize= ...) to get meaningful numbers. */
+
+static const unsigned int path_lengths[] = {5, 10, 20, 50};
+
+enum {
+    findprog_samples = 2000,
+    record_pipe_size = 1048576
+};
+
+static const char *const backend_names[] = {"fork", "spawn", "zygote"};
+
+struct bench_record {
+    pid_t pid;
+    uint32_t index;
+    int64_t ns;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static int64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned int count, double pct)
+{
+    unsigned int index = (unsigned int)((pct / 100.0) * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static void report(const char *metric, const char *backend,
+                   unsigned int param, double *samples, unsigned int count)
+{
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+    printf("%s,%s,%u,%u,%.1f,%.1f,%.1f,%.1f,%.1f\n", metric, backend, param,
+           count, percentile(samples, count, 50),
+           percentile(samples, count, 90), percentile(samples, count, 99),
+           percentile(samples, count, 99.9), samples[count - 1]);
+    fflush(stdout);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Child mode. "launch" children report when they started. "exit" children
+ * wait for stdin to close and then report when they're about to exit. */
+
+static int child_main(const char *mode, const char *index)
+{
+    int64_t started = now_ns();
+    struct bench_record record;
+    char byte;
+
+    record.pid = getpid();
+    record.index = (uint32_t) strtoul(index, NULL, 10);
+    record.ns = started;
+
+    if (strcmp(mode, "exit") == 0) {
+        while (read_nointr(STDIN_FILENO, &byte, 1) > 0) {
+        }
+
+        record.ns = now_ns();
+    }
+
+    write_nointr(STDOUT_FILENO, &record, sizeof(record));
+    _exit(0);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* parent_ns[x] and child_ns[x] hold the parent's and child's timestamps
+ * for the x'th child of a run. The exit benchmark collects its timestamps in
+ * notification order, in exited[] and exited_ns[], and matches them up with
+ * pids[] afterwards. */
+
+struct proc_run {
+    const char *self;
+    int record_fd;
+    int record_write_fd;
+    pid_t *pids;
+    pid_t *exited;
+    int64_t *exited_ns;
+    int64_t *parent_ns;
+    int64_t *child_ns;
+    double *samples;
+    unsigned int received;
+};
+
+/* Reads whatever records are waiting. Children block once the record pipe is
+ * full, so this has to keep up with them. */
+
+static void drain_records(struct proc_run *run, unsigned int count)
+{
+    struct bench_record record;
+
+    while (read_nointr(run->record_fd, &record, sizeof(record)) ==
+           sizeof(record)) {
+        if (record.index < count) {
+            run->child_ns[record.index] = record.ns;
+            run->received++;
+        }
+    }
+}
+
+static pid_t launch_child(struct proc_run *run, const char *mode,
+                          unsigned int index, int stdin_fd)
+{
+    char index_text[16];
+    char *argv[] = {(char *) run->self, (char *) mode, index_text, NULL};
+
+    snprintf(index_text, sizeof(index_text), "%u", index);
+    return proc_launch(argv, stdin_fd, run->record_write_fd, STDERR_FILENO);
+}
+
+static int bench_launch(struct proc_run *run, const char *backend,
+                        unsigned int count)
+{
+    int null_fd = open_nointr("/dev/null", O_RDONLY | O_CLOEXEC);
+    unsigned int launched;
+    int status;
+    int result = 0;
+
+    if (null_fd < 0) {
+        perror("couldn't open /dev/null");
+        return -1;
+    }
+
+    run->received = 0;
+
+    for (launched = 0; launched < count; launched++) {
+        run->parent_ns[launched] = now_ns();
+        run->pids[launched] = launch_child(run, "launch", launched, null_fd);
+
+        if (run->pids[launched] < 0) {
+            fprintf(stderr, "error: launch %u of %u failed: %s\n",
+                    launched + 1, count, strerror(errno));
+            result = -1;
+            break;
+        }
+
+        drain_records(run, count);
+    }
+
+    for (unsigned int x = 0; x < launched; x++) {
+        waitpid_nointr(run->pids[x], &status, 0);
+    }
+
+    drain_records(run, count);
+    close_nointr(null_fd);
+
+    if ((result == 0) && (run->received == count)) {
+        for (unsigned int x = 0; x < count; x++) {
+            run->samples[x] =
+                (double)(run->child_ns[x] - run->parent_ns[x]) / 1e3;
+        }
+
+        report("launch", backend, count, run->samples, count);
+    }
+
+    return result;
+}
+
+static int bench_exit(struct proc_run *run, const char *backend,
+                      unsigned int count)
+{
+    struct proc_waitset *set = proc_waitset_create();
+    struct proc_exit exits[64];
+    int go_pipe[2];
+    unsigned int launched = 0;
+    unsigned int notified = 0;
+    int64_t woke;
+    int result = 0;
+    int ready;
+
+    if (set == NULL) {
+        return -1;
+    }
+
+    if (pipe2(go_pipe, O_CLOEXEC) != 0) {
+        perror("couldn't create pipe");
+        proc_waitset_destroy(set);
+        return -1;
+    }
+
+    run->received = 0;
+
+    for (launched = 0; launched < count; launched++) {
+        run->pids[launched] = launch_child(run, "exit", launched, go_pipe[0]);
+
+        if (run->pids[launched] < 0) {
+            fprintf(stderr, "error: launch %u of %u failed: %s\n",
+                    launched + 1, count, strerror(errno));
+            result = -1;
+            break;
+        }
+
+        if (proc_waitset_add(set, run->pids[launched]) != 0) {
+            perror("couldn't add child to waitset");
+            launched++;
+            result = -1;
+            break;
+        }
+    }
+
+    /* Closing the pipe lets every child exit at once. */
+
+    close_nointr(go_pipe[1]);
+    close_nointr(go_pipe[0]);
+
+    while (proc_waitset_count(set) > 0) {
+        ready = proc_waitset_wait(set, exits, 64, 10);
+        woke = now_ns();
+
+        if (ready < 0) {
+            perror("couldn't wait on children");
+            result = -1;
+            break;
+        }
+
+        for (int x = 0; x < ready; x++) {
+            run->exited[notified] = exits[x].pid;
+            run->exited_ns[notified] = woke;
+            notified++;
+        }
+
+        drain_records(run, count);
+    }
+
+    proc_waitset_destroy(set);
+    drain_records(run, count);
+
+    for (unsigned int x = 0; x < notified; x++) {
+        for (unsigned int y = 0; y < launched; y++) {
+            if (run->pids[y] == run->exited[x]) {
+                run->parent_ns[y] = run->exited_ns[x];
+                break;
+            }
+        }
+    }
+
+    if ((result == 0) && (run->received == count)) {
+        for (unsigned int x = 0; x < count; x++) {
+            run->samples[x] =
+                (double)(run->parent_ns[x] - run->child_ns[x]) / 1e3;
+        }
+
+        report("exit", backend, count, run->samples, count);
+    }
+
+    return result;
+}
+
+static int bench_procs(const char *self, unsigned int max_count)
+{
+    struct proc_run run = {.self = self};
+    int record_pipe[2];
+    int result = 0;
+
+    if (pipe2(record_pipe, O_CLOEXEC) != 0) {
+        perror("couldn't create record pipe");
+        return -1;
+    }
+
+    fcntl(record_pipe[0], F_SETPIPE_SZ, record_pipe_size);
+    fcntl(record_pipe[0], F_SETFL, O_NONBLOCK);
+    run.record_fd = record_pipe[0];
+    run.record_write_fd = record_pipe[1];
+
+    run.pids = malloc(max_count * sizeof(*run.pids));
+    run.exited = malloc(max_count * sizeof(*run.exited));
+    run.exited_ns = malloc(max_count * sizeof(*run.exited_ns));
+    run.parent_ns = malloc(max_count * sizeof(*run.parent_ns));
+    run.child_ns = malloc(max_count * sizeof(*run.child_ns));
+    run.samples = malloc(max_count * sizeof(*run.samples));
+
+    if ((run.pids == NULL) || (run.exited == NULL) ||
+        (run.exited_ns == NULL) || (run.parent_ns == NULL) ||
+        (run.child_ns == NULL) || (run.samples == NULL)) {
+        perror("couldn't allocate sample buffers");
+        result = -1;
+    }
+
+    for (unsigned int x = 0;
+         (result == 0) &&
+         (x < sizeof(backend_names) / sizeof(backend_names[0])); x++) {
+        proc_set_backend((proc_backend_t) x);
+
+        for (unsigned int count = 1; count <= max_count; count *= 10) {
+            if ((bench_launch(&run, backend_names[x], count) != 0) ||
+                (bench_exit(&run, backend_names[x], count) != 0)) {
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    close_nointr(record_pipe[0]);
+    close_nointr(record_pipe[1]);
+    free(run.pids);
+    free(run.exited);
+    free(run.exited_ns);
+    free(run.parent_ns);
+    free(run.child_ns);
+    free(run.samples);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Builds a $PATH of 'length' empty directories under 'root', with an
+ * executable called 'name' in the last one. */
+
+static int make_path(const char *root, unsigned int length, const char *name,
+                     char *path, size_t maxlen)
+{
+    char dir[PATH_MAX];
+    char file[PATH_MAX];
+    size_t used = 0;
+    int fd;
+
+    path[0] = '\x00';
+
+    for (unsigned int x = 0; x < length; x++) {
+        snprintf(dir, sizeof(dir), "%s/%u-%u", root, length, x);
+
+        if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+            perror("couldn't create PATH directory");
+            return -1;
+        }
+
+        used += (size_t) snprintf(path + used, maxlen - used, "%s%s",
+                                  (x == 0) ? "" : ":", dir);
+
+        if (used >= maxlen) {
+            fprintf(stderr, "error: PATH too long\n");
+            return -1;
+        }
+    }
+
+    if (path_join(file, dir, name, sizeof(file)) != 0) {
+        return -1;
+    }
+
+    fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+
+    if (fd < 0) {
+        perror("couldn't create PATH target");
+        return -1;
+    }
+
+    close_nointr(fd);
+    return 0;
+}
+
+static int bench_findprog(void)
+{
+    char root[] = "/tmp/bench-proc.XXXXXX";
+    char path[PATH_MAX * 4];
+    char found[PATH_MAX + 1];
+    const char *name = "bench-proc-target";
+    const char *saved_path = getenv("PATH");
+    char *saved = (saved_path == NULL) ? NULL : strdup(saved_path);
+    double samples[findprog_samples];
+    int64_t start;
+    int result = 0;
+
+    if (mkdtemp(root) == NULL) {
+        perror("couldn't create PATH root");
+        free(saved);
+        return -1;
+    }
+
+    for (unsigned int x = 0;
+         (result == 0) && (x < sizeof(path_lengths) / sizeof(path_lengths[0]));
+         x++) {
+        if ((make_path(root, path_lengths[x], name, path, sizeof(path)) != 0) ||
+            (setenv("PATH", path, 1) != 0)) {
+            result = -1;
+            break;
+        }
+
+        for (unsigned int y = 0; y < findprog_samples; y++) {
+            start = now_ns();
+
+            if (path_findprog(name, found, sizeof(found)) != 0) {
+                fprintf(stderr, "error: couldn't find %s\n", name);
+                result = -1;
+                break;
+            }
+
+            samples[y] = (double)(now_ns() - start) / 1e3;
+        }
+
+        if (result != 0) {
+            break;
+        }
+
+        report("findprog", "-", path_lengths[x], samples, findprog_samples);
+
+        path_cache_flush();
+
+        for (unsigned int y = 0; y < findprog_samples; y++) {
+            start = now_ns();
+            path_findprog_cached(name, found, sizeof(found));
+            samples[y] = (double)(now_ns() - start) / 1e3;
+        }
+
+        report("findprog_cached", "-", path_lengths[x], samples,
+               findprog_samples);
+    }
+
+    if (saved != NULL) {
+        setenv("PATH", saved, 1);
+        free(saved);
+    }
+
+    path_cache_flush();
+
+    if (fork() == 0) {
+        execlp("rm", "rm", "-rf", root, (char *) NULL);
+        _exit(127);
+    }
+
+    wait(NULL);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+    char self[PATH_MAX + 1];
+    unsigned int max_count = 10000;
+    struct rlimit limit;
+    ssize_t length;
+
+    if ((argc == 3) &&
+        ((strcmp(argv[1], "launch") == 0) || (strcmp(argv[1], "exit") == 0))) {
+        return child_main(argv[1], argv[2]);
+    }
+
+    if (argc > 1) {
+        max_count = (unsigned int) strtoul(argv[1], NULL, 10);
+    }
+
+    if (max_count == 0) {
+        fprintf(stderr, "usage: %s [max_count]\n", argv[0]);
+        return 1;
+    }
+
+    length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+
+    if (length < 0) {
+        perror("couldn't find own executable");
+        return 1;
+    }
+
+    self[length] = '\x00';
+
+    /* Every child in the exit benchmark holds a pidfd in the parent. */
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (zygote_start() != 0) {
+        return 1;
+    }
+
+    printf("metric,backend,param,samples,p50_us,p90_us,p99_us,p999_us,"
+           "max_us\n");
+
+    if ((bench_procs(self, max_count) != 0) || (bench_findprog() != 0)) {
+        zygote_stop();
+        return 1;
+    }
+
+    zygote_stop();
+    return 0;
+}
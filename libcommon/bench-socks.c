@@ -0,0 +1,332 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libsocks.h"
+
+/* Load generator for libsocks. For each combination of message size and
+ * concurrency, it forks that many clients, which each send 'count' echo
+ * requests with socks_client_process() as fast as they can. It reports the
+ * overall requests per second and the p50/p99/p999 round-trip latency.
+ *
+ * The server is a socks_server_process() loop by default, or the event-driven
+ * server with -e. Usage:
+ *
+ *   bench-socks [-e] [-v version] [-n count] [-c clients,...] [-s bytes,...]
+ *
+ * Build without sanitizers (make sanitize= ...) to get meaningful numbers. */
+
+static const char socket_path[] = "/tmp/bench-socks.sock";
+
+enum {max_list = 16};
+
+static const unsigned int default_sizes[] = {16, 256, 4096, 32768};
+static const unsigned int default_clients[] = {1, 4, 16};
+
+static double elapsed_us(const struct timespec *start,
+                         const struct timespec *end)
+{
+    double result = (double)(end->tv_sec - start->tv_sec) * 1e6;
+    result += (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+    return result;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t count, double pct)
+{
+    size_t index = (size_t)((pct / 100.0) * (double)(count - 1) + 0.5);
+    return sorted[index];
+}
+
+/* Parses a comma-separated list of positive numbers into 'list'. Returns the
+ * number of entries, or 0 if the list is invalid. */
+static unsigned int parse_list(const char *text, unsigned int *list)
+{
+    unsigned int count = 0;
+    unsigned long value;
+    char *end;
+
+    while (count < max_list) {
+        value = strtoul(text, &end, 10);
+
+        if ((end == text) || (value == 0) || (value > UINT32_MAX)) {
+            return 0;
+        }
+
+        list[count++] = (unsigned int) value;
+
+        if (*end == '\x00') {
+            return count;
+        }
+
+        if (*end != ',') {
+            return 0;
+        }
+
+        text = end + 1;
+    }
+
+    return 0;
+}
+
+static int echo(int fd, const char *buf, uint32_t nbyte)
+{
+    return (int) socks_respond(fd, buf, nbyte);
+}
+
+static pid_t start_server(int socket_fd, bool event_loop)
+{
+    struct socks_server *server;
+    pid_t child = fork();
+
+    if (child != 0) {
+        return child;
+    }
+
+    if (event_loop) {
+        server = socks_server_create(socket_fd, echo, 64);
+
+        while ((server != NULL) && (socks_server_run(server, -1) >= 0)) {
+        }
+    } else {
+        while (socks_server_process(socket_fd, echo) >= 0) {
+        }
+    }
+
+    _exit(1);
+}
+
+/* Waits for the parent to close 'gate', then sends 'count' requests and
+ * stores each round-trip time in 'samples'. */
+static int run_client(int gate, unsigned int size, unsigned int count,
+                      double *samples)
+{
+    struct timespec start;
+    struct timespec end;
+    char *input = malloc(size);
+    char *output = malloc(size);
+    char dummy;
+    ssize_t result = 0;
+
+    if ((input == NULL) || (output == NULL)) {
+        return -1;
+    }
+
+    memset(input, 'x', size);
+    read_nointr(gate, &dummy, 1);
+
+    for (unsigned int x = 0; (x < count) && (result >= 0); x++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = socks_client_process(socket_path, input, size, output,
+                                      size);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (result != (ssize_t) size) {
+            fprintf(stderr, "error: request failed: %s\n", strerror(errno));
+            result = -1;
+        }
+
+        samples[x] = elapsed_us(&start, &end);
+    }
+
+    free(input);
+    free(output);
+    return (result >= 0) ? 0 : -1;
+}
+
+/* Runs one size/concurrency combination and prints a row of results.
+ * 'samples' is shared with the clients, and has room for clients * count
+ * entries. */
+static int run_case(unsigned int size, unsigned int clients,
+                    unsigned int count, double *samples)
+{
+    size_t total = (size_t) clients * count;
+    struct timespec start;
+    struct timespec end;
+    unsigned int failed = 0;
+    unsigned int started;
+    pid_t pids[256];
+    int gate[2];
+    int status;
+    double seconds;
+
+    if (pipe(gate) != 0) {
+        perror("couldn't create start pipe");
+        return -1;
+    }
+
+    for (started = 0; started < clients; started++) {
+        pids[started] = fork();
+
+        if (pids[started] < 0) {
+            perror("couldn't start client");
+            failed++;
+            break;
+        }
+
+        if (pids[started] == 0) {
+            close_nointr(gate[1]);
+            _exit(run_client(gate[0], size, count,
+                             samples + ((size_t) started * count)) ? 1 : 0);
+        }
+    }
+
+    /* Closing the write end releases every client at once. */
+
+    close_nointr(gate[0]);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    close_nointr(gate[1]);
+
+    for (unsigned int x = 0; x < started; x++) {
+        waitpid_nointr(pids[x], &status, 0);
+
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+            failed++;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (failed != 0) {
+        fprintf(stderr, "error: %u clients failed\n", failed);
+        return -1;
+    }
+
+    seconds = elapsed_us(&start, &end) / 1e6;
+    qsort(samples, total, sizeof(samples[0]), compare_double);
+    printf("%8u %8u %12.0f %10.1f %10.1f %10.1f\n", size, clients,
+           (double) total / seconds, percentile(samples, total, 50),
+           percentile(samples, total, 99), percentile(samples, total, 99.9));
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-e] [-v version] [-n count] "
+            "[-c clients,...] [-s bytes,...]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int sizes[max_list];
+    unsigned int clients[max_list];
+    unsigned int nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    unsigned int nclients = sizeof(default_clients) /
+                            sizeof(default_clients[0]);
+    unsigned int max_clients = 0;
+    unsigned int version = 2;
+    unsigned int count = 2000;
+    bool event_loop = false;
+    size_t map_size;
+    double *samples;
+    pid_t server;
+    int socket_fd;
+    int status;
+    int result = 0;
+    int option;
+
+    memcpy(sizes, default_sizes, sizeof(default_sizes));
+    memcpy(clients, default_clients, sizeof(default_clients));
+
+    while ((option = getopt(argc, argv, "ev:n:c:s:")) != -1) {
+        switch (option) {
+        case 'e':
+            event_loop = true;
+            break;
+
+        case 'v':
+            version = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+
+        case 'n':
+            count = (unsigned int) strtoul(optarg, NULL, 10);
+            break;
+
+        case 'c':
+            nclients = parse_list(optarg, clients);
+            break;
+
+        case 's':
+            nsizes = parse_list(optarg, sizes);
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (unsigned int x = 0; x < nclients; x++) {
+        max_clients = (clients[x] > max_clients) ? clients[x] : max_clients;
+    }
+
+    if ((count == 0) || (nsizes == 0) || (nclients == 0) ||
+        (max_clients > 256) || (optind != argc) ||
+        (socks_set_protocol(version) != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (unsigned int x = 0; x < nsizes; x++) {
+        if ((sizes[x] > socks_default_max_message) &&
+            (socks_set_max_message(sizes[x]) != 0)) {
+            fprintf(stderr, "error: message size %u is too big\n", sizes[x]);
+            return 1;
+        }
+    }
+
+    map_size = (size_t) max_clients * count * sizeof(*samples);
+    samples = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (samples == MAP_FAILED) {
+        perror("couldn't allocate sample buffer");
+        return 1;
+    }
+
+    unlink(socket_path);
+    socket_fd = socks_server_open(socket_path);
+
+    if (socket_fd < 0) {
+        perror("couldn't open server socket");
+        munmap(samples, map_size);
+        return 1;
+    }
+
+    server = start_server(socket_fd, event_loop);
+
+    printf("# protocol v%u, %s server, %u requests per client\n", version,
+           event_loop ? "event" : "blocking", count);
+    printf("%8s %8s %12s %10s %10s %10s\n", "bytes", "clients", "req_per_s",
+           "p50_us", "p99_us", "p999_us");
+
+    for (unsigned int x = 0; (result == 0) && (x < nsizes); x++) {
+        for (unsigned int y = 0; (result == 0) && (y < nclients); y++) {
+            result = run_case(sizes[x], clients[y], count, samples);
+        }
+    }
+
+    kill(server, SIGKILL);
+    waitpid_nointr(server, &status, 0);
+    socks_server_close(socket_fd);
+    unlink(socket_path);
+    munmap(samples, map_size);
+    return (result == 0) ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libproc.h"
+#include "libzygote.h"
+
+/* Measures proc_launch() latency against the size of the parent's resident
+ * set, for each launch backend. Usage: bench-spawn [count] [MiB...]
+ *
+ * Build without sanitizers (make sanitize= ...) to get meaningful numbers. */
+
+static const unsigned int default_sizes[] = {0, 16, 64, 256, 1024};
+
+struct backend_def {
+    proc_backend_t backend;
+    const char *name;
+};
+
+static const struct backend_def backends[] = {
+    {.backend = proc_backend_fork, .name = "fork"},
+    {.backend = proc_backend_spawn, .name = "spawn"},
+    {.backend = proc_backend_zygote, .name = "zygote"},
+};
+
+static double elapsed_us(const struct timespec *start,
+                         const struct timespec *end)
+{
+    double result = (double)(end->tv_sec - start->tv_sec) * 1e6;
+    result += (double)(end->tv_nsec - start->tv_nsec) / 1e3;
+    return result;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, unsigned int count, double pct)
+{
+    unsigned int index = (unsigned int)((pct / 100.0) * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static int run_backend(const struct backend_def *def, unsigned int size_mb,
+                       double *samples, unsigned int count)
+{
+    char *const argv[] = {(char *) "/bin/true", NULL};
+    struct timespec start;
+    struct timespec end;
+    pid_t child;
+
+    proc_set_backend(def->backend);
+
+    for (unsigned int x = 0; x < count; x++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        child = proc_launch(argv, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (child < 0) {
+            fprintf(stderr, "error: launch failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        samples[x] = elapsed_us(&start, &end);
+        proc_polled_wait(child);
+    }
+
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+    printf("%-6s %8u %10.1f %10.1f %10.1f\n", def->name, size_mb,
+           percentile(samples, count, 50), percentile(samples, count, 99),
+           samples[count - 1]);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int count = 200;
+    const unsigned int *sizes = default_sizes;
+    unsigned int nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+    unsigned int custom_sizes[argc];
+    double *samples;
+    char *ballast;
+    size_t length;
+
+    if (argc > 1) {
+        count = (unsigned int) strtoul(argv[1], NULL, 10);
+    }
+
+    if (argc > 2) {
+        for (int x = 2; x < argc; x++) {
+            custom_sizes[x - 2] = (unsigned int) strtoul(argv[x], NULL, 10);
+        }
+        sizes = custom_sizes;
+        nsizes = (unsigned int)(argc - 2);
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [count] [MiB...]\n", argv[0]);
+        return 1;
+    }
+
+    /* The zygote has to be started before the ballast is allocated, so that
+     * it stays small. */
+
+    if (zygote_start() != 0) {
+        return 1;
+    }
+
+    samples = malloc(count * sizeof(*samples));
+
+    if (samples == NULL) {
+        perror("couldn't allocate sample buffer");
+        return 1;
+    }
+
+    printf("%-6s %8s %10s %10s %10s\n", "method", "rss_mib", "p50_us",
+           "p99_us", "max_us");
+
+    for (unsigned int x = 0; x < nsizes; x++) {
+        length = (size_t) sizes[x] << 20;
+        ballast = NULL;
+
+        if (length != 0) {
+            ballast = malloc(length);
+
+            if (ballast == NULL) {
+                perror("couldn't allocate ballast");
+                free(samples);
+                return 1;
+            }
+
+            memset(ballast, 0x5A, length);
+        }
+
+        for (unsigned int y = 0; y < sizeof(backends) / sizeof(backends[0]);
+             y++) {
+            if (run_backend(&backends[y], sizes[x], samples, count) != 0) {
+                free(ballast);
+                free(samples);
+                return 1;
+            }
+        }
+
+        free(ballast);
+    }
+
+    free(samples);
+    zygote_stop();
+    return 0;
+}
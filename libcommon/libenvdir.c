@@ -0,0 +1,669 @@
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libenvdir.h"
+#include "libnointr.h"
+#include "libpath.h"
+
+extern char **environ;
+
+enum {envdir_value_max = 131072};
+
+static const uint32_t envdir_watch_mask = IN_CREATE | IN_DELETE | IN_MODIFY |
+                                          IN_CLOSE_WRITE | IN_ATTRIB |
+                                          IN_MOVED_FROM | IN_MOVED_TO |
+                                          IN_DELETE_SELF | IN_MOVE_SELF;
+
+static const uint32_t run_watch_mask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                       IN_DELETE_SELF | IN_MOVE_SELF;
+
+struct envdir_var {
+    char *name;
+    char *value;
+};
+
+/* 'argv' is a single allocation (pointers followed by strings) that never
+ * changes. 'arena' is rebuilt as a whole: it holds the envp pointers, the
+ * environment strings and the resolved filename. 'stamp' is only used when
+ * the run file or envdir couldn't be watched. */
+
+struct envdir_snapshot {
+    struct envdir_snapshot *prev;
+    struct envdir_snapshot *next;
+    char *envdir;
+    char **argv;
+    char *arena;
+    const char *filename;
+    char **envp;
+    int run_watch;
+    int dir_watch;
+    bool watched;
+    bool stale;
+    uint64_t stamp;
+};
+
+/* Every snapshot shares one inotify instance, since there can only be a few
+ * of those per user (fs.inotify.max_user_instances is 128 by default). It's
+ * opened along with the first snapshot and closed with the last one. Events
+ * are routed to snapshots by watch descriptor, and snapshots that watch the
+ * same run file share its watch, which is only removed once none of them
+ * uses it. Everything here, and every snapshot, is protected by 'lock'. */
+
+static struct {
+    pthread_mutex_t lock;
+    int inotify_fd;
+    struct envdir_snapshot *snapshots;
+} shared = {.lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1};
+
+/*----------------------------------------------------------------------------*/
+
+static char ** argv_copy(char *const argv[])
+{
+    size_t size = sizeof(char *);
+    unsigned int count = 0;
+    char **result;
+    char *cursor;
+
+    for (count = 0; argv[count] != NULL; count++) {
+        size += sizeof(char *) + strlen(argv[count]) + 1;
+    }
+
+    result = malloc(size);
+
+    if (result == NULL) {
+        return NULL;
+    }
+
+    cursor = (char *)(result + count + 1);
+
+    for (unsigned int x = 0; x < count; x++) {
+        result[x] = cursor;
+        cursor = stpcpy(cursor, argv[x]) + 1;
+    }
+
+    result[count] = NULL;
+    return result;
+}
+
+/* FNV-1a, for folding stat results into a single stamp. */
+static uint64_t stamp_add(uint64_t stamp, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t x = 0; x < length; x++) {
+        stamp = (stamp ^ bytes[x]) * 1099511628211ULL;
+    }
+
+    return stamp;
+}
+
+static uint64_t stamp_stat(uint64_t stamp, const struct stat *info)
+{
+    stamp = stamp_add(stamp, &info->st_ino, sizeof(info->st_ino));
+    stamp = stamp_add(stamp, &info->st_size, sizeof(info->st_size));
+    stamp = stamp_add(stamp, &info->st_mode, sizeof(info->st_mode));
+    return stamp_add(stamp, &info->st_mtim, sizeof(info->st_mtim));
+}
+
+/* Folds the state of the run file, the envdir and everything in it into one
+ * value. The envdir's own mtime doesn't change when a file in it is
+ * rewritten in place, so every file gets stat'ed. */
+static uint64_t snapshot_stamp(const struct envdir_snapshot *snapshot)
+{
+    uint64_t stamp = 14695981039346656037ULL;
+    struct dirent *entry;
+    struct stat info;
+    DIR *dir;
+
+    if (stat(snapshot->filename, &info) == 0) {
+        stamp = stamp_stat(stamp, &info);
+    }
+
+    if (snapshot->envdir == NULL) {
+        return stamp;
+    }
+
+    dir = opendir(snapshot->envdir);
+
+    if (dir == NULL) {
+        return stamp;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (fstatat(dirfd(dir), entry->d_name, &info, 0) == 0) {
+            stamp = stamp_add(stamp, entry->d_name, strlen(entry->d_name));
+            stamp = stamp_stat(stamp, &info);
+        }
+    }
+
+    closedir(dir);
+    return stamp;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Reads the first line of 'name' into a new string, with envdir's rules
+ * applied. Sets *value to NULL for an empty (0-byte) file. */
+static int read_value(int dir_fd, const char *name, char **value)
+{
+    char *buffer = malloc(envdir_value_max + 1);
+    size_t total = 0;
+    size_t used = 0;
+    ssize_t result;
+    char *newline;
+    char *shrunk;
+    int fd;
+
+    *value = NULL;
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        free(buffer);
+        return -1;
+    }
+
+    while (used < envdir_value_max) {
+        result = read_nointr(fd, buffer + used, envdir_value_max - used);
+
+        if (result < 0) {
+            close_nointr(fd);
+            free(buffer);
+            return -1;
+        }
+
+        if (result == 0) {
+            break;
+        }
+
+        newline = memchr(buffer + used, '\n', (size_t) result);
+        used += (size_t) result;
+        total += (size_t) result;
+
+        if (newline != NULL) {
+            used = (size_t)(newline - buffer);
+            break;
+        }
+    }
+
+    close_nointr(fd);
+
+    /* Only an empty file unsets the variable. One whose first line is empty
+     * sets it to "". */
+
+    if (total == 0) {
+        free(buffer);
+        return 0;
+    }
+
+    while ((used > 0) &&
+           ((buffer[used - 1] == ' ') || (buffer[used - 1] == '\t'))) {
+        used--;
+    }
+
+    for (size_t x = 0; x < used; x++) {
+        if (buffer[x] == '\x00') {
+            buffer[x] = '\n';
+        }
+    }
+
+    buffer[used] = '\x00';
+    shrunk = realloc(buffer, used + 1);
+    *value = (shrunk != NULL) ? shrunk : buffer;
+    return 0;
+}
+
+static int compare_var(const void *a, const void *b)
+{
+    const struct envdir_var *x = a;
+    const struct envdir_var *y = b;
+    return strcmp(x->name, y->name);
+}
+
+static void free_vars(struct envdir_var *vars, unsigned int count)
+{
+    for (unsigned int x = 0; x < count; x++) {
+        free(vars[x].name);
+        free(vars[x].value);
+    }
+
+    free(vars);
+}
+
+/* Reads every variable in 'envdir', sorted by name. */
+static int read_envdir(const char *envdir, struct envdir_var **vars,
+                       unsigned int *count)
+{
+    unsigned int capacity = 0;
+    struct envdir_var *grown;
+    struct dirent *entry;
+    DIR *dir = opendir(envdir);
+    int error;
+
+    *vars = NULL;
+    *count = 0;
+
+    if (dir == NULL) {
+        return -1;
+    }
+
+    while ((errno = 0, entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        if (strchr(entry->d_name, '=') != NULL) {
+            errno = EINVAL;
+            break;
+        }
+
+        if (*count == capacity) {
+            capacity = (capacity == 0) ? 16 : capacity * 2;
+            grown = realloc(*vars, capacity * sizeof(**vars));
+
+            if (grown == NULL) {
+                break;
+            }
+
+            *vars = grown;
+        }
+
+        (*vars)[*count].value = NULL;
+        (*vars)[*count].name = strdup(entry->d_name);
+
+        if ((*vars)[*count].name == NULL) {
+            break;
+        }
+
+        (*count)++;
+
+        if (read_value(dirfd(dir), entry->d_name,
+                       &(*vars)[*count - 1].value) != 0) {
+            break;
+        }
+    }
+
+    if (errno != 0) {
+        error = errno;
+        closedir(dir);
+        free_vars(*vars, *count);
+        *vars = NULL;
+        *count = 0;
+        errno = error;
+        return -1;
+    }
+
+    closedir(dir);
+    qsort(*vars, *count, sizeof(**vars), compare_var);
+    return 0;
+}
+
+/* Returns true if 'entry' (a NAME=value string) is overridden by one of the
+ * sorted envdir variables. */
+static bool var_overridden(const char *entry, const struct envdir_var *vars,
+                           unsigned int count)
+{
+    size_t length = strcspn(entry, "=");
+    unsigned int low = 0;
+    unsigned int high = count;
+    unsigned int middle;
+    int result;
+
+    while (low < high) {
+        middle = low + ((high - low) / 2);
+        result = strncmp(vars[middle].name, entry, length);
+
+        if ((result == 0) && (vars[middle].name[length] != '\x00')) {
+            result = 1;
+        }
+
+        if (result == 0) {
+            return true;
+        }
+
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return false;
+}
+
+/* Packs the environment and the filename into a new arena, and points
+ * *envp and *copy at them. */
+static char * arena_build(const char *filename, const struct envdir_var *vars,
+                          unsigned int nvars, char ***envp, const char **copy)
+{
+    size_t size = strlen(filename) + 1;
+    unsigned int count = 0;
+    unsigned int x;
+    char **pointers;
+    char *cursor;
+    char *arena;
+
+    for (x = 0; environ[x] != NULL; x++) {
+        if (var_overridden(environ[x], vars, nvars) == false) {
+            size += strlen(environ[x]) + 1;
+            count++;
+        }
+    }
+
+    for (x = 0; x < nvars; x++) {
+        if (vars[x].value != NULL) {
+            size += strlen(vars[x].name) + strlen(vars[x].value) + 2;
+            count++;
+        }
+    }
+
+    size += (count + 1) * sizeof(char *);
+    arena = malloc(size);
+
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    pointers = (char **) arena;
+    cursor = arena + ((count + 1) * sizeof(char *));
+    count = 0;
+
+    for (x = 0; environ[x] != NULL; x++) {
+        if (var_overridden(environ[x], vars, nvars) == false) {
+            pointers[count++] = cursor;
+            cursor = stpcpy(cursor, environ[x]) + 1;
+        }
+    }
+
+    for (x = 0; x < nvars; x++) {
+        if (vars[x].value != NULL) {
+            pointers[count++] = cursor;
+            cursor = stpcpy(cursor, vars[x].name);
+            *cursor++ = '=';
+            cursor = stpcpy(cursor, vars[x].value) + 1;
+        }
+    }
+
+    pointers[count] = NULL;
+    strcpy(cursor, filename);
+    *envp = pointers;
+    *copy = cursor;
+    return arena;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Returns true if a snapshot other than 'self' uses the watch 'wd'. */
+static bool watch_shared(const struct envdir_snapshot *self, int wd)
+{
+    const struct envdir_snapshot *snapshot;
+
+    for (snapshot = shared.snapshots; snapshot != NULL;
+         snapshot = snapshot->next) {
+        if ((snapshot != self) &&
+            ((snapshot->run_watch == wd) || (snapshot->dir_watch == wd))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void watch_release(struct envdir_snapshot *snapshot, int *wd)
+{
+    if ((*wd >= 0) && (watch_shared(snapshot, *wd) == false)) {
+        inotify_rm_watch(shared.inotify_fd, *wd);
+    }
+
+    *wd = -1;
+}
+
+/* Marks every snapshot that uses the watch 'wd' (or every snapshot, if the
+ * event queue overflowed and 'wd' is -1) as needing a rebuild. */
+static void watch_route(int wd)
+{
+    struct envdir_snapshot *snapshot;
+
+    for (snapshot = shared.snapshots; snapshot != NULL;
+         snapshot = snapshot->next) {
+        if ((wd < 0) || (snapshot->run_watch == wd) ||
+            (snapshot->dir_watch == wd)) {
+            snapshot->stale = true;
+        }
+    }
+}
+
+/* Reads every pending event from the shared descriptor and hands each one
+ * to the snapshots that it concerns. */
+static void watches_drain(void)
+{
+    _Alignas(struct inotify_event) char events[4096];
+    const struct inotify_event *event;
+    ssize_t result;
+
+    if (shared.inotify_fd < 0) {
+        return;
+    }
+
+    while ((result = read_nointr(shared.inotify_fd, events,
+                                 sizeof(events))) > 0) {
+        for (ssize_t x = 0; x < result;
+             x += (ssize_t)(sizeof(*event) + event->len)) {
+            event = (const struct inotify_event *)(events + x);
+            watch_route(event->wd);
+        }
+    }
+}
+
+/* (Re)creates the inotify watches. The run file is watched by inode, so it
+ * has to be re-added whenever it's replaced. */
+static void watches_reset(struct envdir_snapshot *snapshot,
+                          const char *filename)
+{
+    if (shared.inotify_fd < 0) {
+        snapshot->watched = false;
+        return;
+    }
+
+    /* Anything queued so far predates the rebuild that's about to happen,
+     * but might concern other snapshots too. */
+
+    watches_drain();
+    watch_release(snapshot, &snapshot->run_watch);
+    watch_release(snapshot, &snapshot->dir_watch);
+
+    snapshot->run_watch = inotify_add_watch(shared.inotify_fd, filename,
+                                            run_watch_mask);
+
+    if (snapshot->envdir != NULL) {
+        snapshot->dir_watch = inotify_add_watch(shared.inotify_fd,
+                                                snapshot->envdir,
+                                                envdir_watch_mask);
+    }
+
+    snapshot->watched = (snapshot->run_watch >= 0) &&
+                        ((snapshot->envdir == NULL) ||
+                         (snapshot->dir_watch >= 0));
+}
+
+static int snapshot_build(struct envdir_snapshot *snapshot)
+{
+    char filename[PATH_MAX + 1];
+    struct envdir_var *vars = NULL;
+    unsigned int nvars = 0;
+    const char *copy;
+    char **envp;
+    char *arena;
+
+    snapshot->stale = true;
+
+    if (path_findprog(snapshot->argv[0], filename, sizeof(filename)) != 0) {
+        return -1;
+    }
+
+    watches_reset(snapshot, filename);
+
+    if ((snapshot->envdir != NULL) &&
+        (read_envdir(snapshot->envdir, &vars, &nvars) != 0)) {
+        return -1;
+    }
+
+    arena = arena_build(filename, vars, nvars, &envp, &copy);
+    free_vars(vars, nvars);
+
+    if (arena == NULL) {
+        return -1;
+    }
+
+    free(snapshot->arena);
+    snapshot->arena = arena;
+    snapshot->envp = envp;
+    snapshot->filename = copy;
+
+    if (snapshot->watched == false) {
+        snapshot->stamp = snapshot_stamp(snapshot);
+    }
+
+    snapshot->stale = false;
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+struct envdir_snapshot * envdir_snapshot_create(char *const argv[],
+                                                const char *envdir)
+{
+    struct envdir_snapshot *snapshot;
+    int error;
+
+    if ((argv == NULL) || (argv[0] == NULL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snapshot = calloc(1, sizeof(*snapshot));
+
+    if (snapshot == NULL) {
+        return NULL;
+    }
+
+    snapshot->run_watch = -1;
+    snapshot->dir_watch = -1;
+    snapshot->argv = argv_copy(argv);
+
+    if (envdir != NULL) {
+        snapshot->envdir = strdup(envdir);
+    }
+
+    pthread_mutex_lock(&shared.lock);
+
+    if (shared.snapshots == NULL) {
+        shared.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+
+    snapshot->next = shared.snapshots;
+
+    if (shared.snapshots != NULL) {
+        shared.snapshots->prev = snapshot;
+    }
+
+    shared.snapshots = snapshot;
+
+    if ((snapshot->argv == NULL) ||
+        ((envdir != NULL) && (snapshot->envdir == NULL)) ||
+        (snapshot_build(snapshot) != 0)) {
+        error = errno;
+        pthread_mutex_unlock(&shared.lock);
+        envdir_snapshot_destroy(snapshot);
+        errno = error;
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&shared.lock);
+    return snapshot;
+}
+
+void envdir_snapshot_destroy(struct envdir_snapshot *snapshot)
+{
+    if (snapshot == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&shared.lock);
+
+    if (shared.inotify_fd >= 0) {
+        watch_release(snapshot, &snapshot->run_watch);
+        watch_release(snapshot, &snapshot->dir_watch);
+    }
+
+    if (snapshot->prev != NULL) {
+        snapshot->prev->next = snapshot->next;
+    } else {
+        shared.snapshots = snapshot->next;
+    }
+
+    if (snapshot->next != NULL) {
+        snapshot->next->prev = snapshot->prev;
+    }
+
+    if ((shared.snapshots == NULL) && (shared.inotify_fd >= 0)) {
+        close_nointr(shared.inotify_fd);
+        shared.inotify_fd = -1;
+    }
+
+    pthread_mutex_unlock(&shared.lock);
+
+    free(snapshot->arena);
+    free(snapshot->argv);
+    free(snapshot->envdir);
+    free(snapshot);
+}
+
+int envdir_snapshot_refresh(struct envdir_snapshot *snapshot)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&shared.lock);
+
+    if (snapshot->watched) {
+        watches_drain();
+    } else if (snapshot_stamp(snapshot) != snapshot->stamp) {
+        snapshot->stale = true;
+    }
+
+    if (snapshot->stale) {
+        result = (snapshot_build(snapshot) == 0) ? 1 : -1;
+    }
+
+    pthread_mutex_unlock(&shared.lock);
+    return result;
+}
+
+void envdir_snapshot_fill(const struct envdir_snapshot *snapshot,
+                          struct proc_spec *spec)
+{
+    spec->filename = snapshot->filename;
+    spec->argv = snapshot->argv;
+    spec->envp = snapshot->envp;
+}
+
+int envdir_snapshot_fd(const struct envdir_snapshot *snapshot)
+{
+    return snapshot->watched ? shared.inotify_fd : -1;
+}
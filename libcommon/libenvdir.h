@@ -0,0 +1,56 @@
+#ifndef _LIBENVDIR_H_
+#define _LIBENVDIR_H_
+
+#include "libproc.h"
+
+/* Prebuilt launch data for a service, in the style of daemontools' envdir.
+ * A snapshot holds the resolved run file, a copy of argv, and an environment
+ * made from 'environ' plus the contents of an envdir, all packed into one
+ * allocation. The snapshot is only rebuilt when the run file or the envdir
+ * changes, so restarting a service that crash-loops doesn't touch the
+ * filesystem or the heap.
+ *
+ * Each file in the envdir names a variable. An empty (0-byte) file removes
+ * the variable from the environment. Otherwise the variable is set to the
+ * first line of the file, with trailing spaces and tabs removed and NULs
+ * turned into newlines, so a file holding just a newline sets it to "".
+ * Files whose names start with '.' are ignored.
+ *
+ * Changes are picked up with one inotify instance that every snapshot in the
+ * process shares. Where inotify isn't available, every refresh stats the run
+ * file, the envdir, and each file in it instead. */
+
+struct envdir_snapshot;
+
+/* Builds a snapshot for 'argv'. argv[0] is searched for in $PATH (like
+ * proc_launch() does), and the result is watched as the run file. 'envdir'
+ * can be NULL, in which case the environment is a copy of 'environ'.
+ *
+ * Returns NULL (with errno set) in the event of an error. */
+
+struct envdir_snapshot * envdir_snapshot_create(char *const argv[],
+                                                const char *envdir);
+
+void envdir_snapshot_destroy(struct envdir_snapshot *snapshot);
+
+/* Rebuilds the snapshot if the run file or envdir changed since it was last
+ * built. Returns 0 if nothing changed, 1 if it was rebuilt, or -1 if it
+ * needed a rebuild that failed. After a failure, the previous contents stay
+ * in place, and the rebuild is retried on the next call. */
+
+int envdir_snapshot_refresh(struct envdir_snapshot *snapshot);
+
+/* Points spec->filename, spec->argv and spec->envp into the snapshot. They
+ * stay valid until the next successful refresh. */
+
+void envdir_snapshot_fill(const struct envdir_snapshot *snapshot,
+                          struct proc_spec *spec);
+
+/* Returns a descriptor that becomes readable when the snapshot might need a
+ * refresh, or -1 if changes are detected by mtime. The descriptor is the same
+ * for every snapshot: refreshing any of them reads it, and each one is only
+ * rebuilt once its own files have changed. */
+
+int envdir_snapshot_fd(const struct envdir_snapshot *snapshot);
+
+#endif
@@ -0,0 +1,671 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libevloop.h"
+#include "libnointr.h"
+#include "libproc.h"
+#include "libreap.h"
+#include "libsignal.h"
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    event_batch = 64,
+    signal_batch = 32
+};
+
+/* A signal descriptor from libsignal gets one 'watch_source' entry in epoll,
+ * however many signal watches share it. Signal watches and polled child
+ * watches have no descriptor of their own (fd is -1). While the central
+ * reaper is active, polled children are checked when its descriptor (the
+ * 'watch_reaper' entry) becomes readable, rather than on SIGCHLD. */
+
+enum watch_kind {
+    watch_fd,
+    watch_source,
+    watch_signal,
+    watch_child,
+    watch_timer,
+    watch_reaper
+};
+
+struct evloop_watch {
+    struct evloop_watch *prev;
+    struct evloop_watch *next;
+    enum watch_kind kind;
+    int fd;
+    int signum;
+    pid_t pid;
+    bool dead;
+
+    union {
+        evloop_fd_callback_t fd;
+        evloop_signal_callback_t signal;
+        evloop_child_callback_t child;
+        evloop_timer_callback_t timer;
+    } callback;
+
+    void *arg;
+};
+
+/* Removed watches stay on the list (marked dead) until the end of the
+ * current pass, so that callbacks can remove anything without leaving
+ * dangling pointers in the pass's event array or list walk. */
+
+struct evloop {
+    int epoll_fd;
+    struct evloop_watch *watches;
+    struct evloop_watch *reaper;
+    unsigned int polled;
+    bool check_children;
+    bool running;
+    bool has_dead;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static uint32_t epoll_events(unsigned int events)
+{
+    uint32_t result = 0;
+
+    result |= (events & evloop_read) ? EPOLLIN : 0;
+    result |= (events & evloop_write) ? EPOLLOUT : 0;
+    return result;
+}
+
+static unsigned int loop_events(uint32_t events)
+{
+    unsigned int result = 0;
+
+    result |= (events & EPOLLIN) ? evloop_read : 0;
+    result |= (events & EPOLLOUT) ? evloop_write : 0;
+    result |= (events & (EPOLLERR | EPOLLHUP)) ? evloop_error : 0;
+    return result;
+}
+
+static void watch_unlink(struct evloop *loop, struct evloop_watch *watch)
+{
+    if (watch->prev != NULL) {
+        watch->prev->next = watch->next;
+    } else {
+        loop->watches = watch->next;
+    }
+
+    if (watch->next != NULL) {
+        watch->next->prev = watch->prev;
+    }
+}
+
+/* Allocates a watch and puts it on the loop's list. If 'fd' isn't -1, it's
+ * also added to epoll; on a failure there, the watch is freed and NULL is
+ * returned (the descriptor is left to the caller). */
+static struct evloop_watch * watch_add(struct evloop *loop,
+                                       enum watch_kind kind, int fd,
+                                       uint32_t events)
+{
+    struct epoll_event event = {.events = events};
+    struct evloop_watch *watch = calloc(1, sizeof(*watch));
+
+    if (watch == NULL) {
+        return NULL;
+    }
+
+    watch->kind = kind;
+    watch->fd = fd;
+    watch->signum = -1;
+    watch->pid = -1;
+    event.data.ptr = watch;
+
+    if ((fd != -1) &&
+        (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)) {
+        free(watch);
+        return NULL;
+    }
+
+    watch->next = loop->watches;
+
+    if (watch->next != NULL) {
+        watch->next->prev = watch;
+    }
+
+    loop->watches = watch;
+    return watch;
+}
+
+/* Frees the watches that were removed during the last pass. */
+static void loop_sweep(struct evloop *loop)
+{
+    struct evloop_watch *watch = loop->watches;
+    struct evloop_watch *next;
+
+    while (watch != NULL) {
+        next = watch->next;
+
+        if (watch->dead) {
+            watch_unlink(loop, watch);
+            free(watch);
+        }
+
+        watch = next;
+    }
+
+    loop->has_dead = false;
+}
+
+/* Makes sure that the descriptor for 'signum' is being watched. */
+static int source_connect(struct evloop *loop, int signum)
+{
+    struct evloop_watch *watch;
+    int fd = signal_pipefd_connect(signum);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    for (watch = loop->watches; watch != NULL; watch = watch->next) {
+        if ((watch->kind == watch_source) && (watch->fd == fd)) {
+            return 0;
+        }
+    }
+
+    return (watch_add(loop, watch_source, fd, EPOLLIN) != NULL) ? 0 : -1;
+}
+
+/* Makes sure that the reaper's descriptor is being watched, unless it's
+ * already there as a signal descriptor (it's the SIGCHLD one). */
+static int reaper_connect(struct evloop *loop)
+{
+    struct evloop_watch *watch;
+    int fd = reap_fd();
+
+    for (watch = loop->watches; watch != NULL; watch = watch->next) {
+        if (((watch->kind == watch_source) || (watch->kind == watch_reaper)) &&
+            (watch->fd == fd) && (watch->dead == false)) {
+            return 0;
+        }
+    }
+
+    loop->reaper = watch_add(loop, watch_reaper, fd, EPOLLIN);
+    return (loop->reaper != NULL) ? 0 : -1;
+}
+
+/* Checks whether a watched child has exited (reaping it, or taking its
+ * record if the central reaper owns it). Returns 1 if it has, 0 if not, or
+ * -1 in the event of an error. */
+static int child_exited(pid_t pid, int *code, int *status)
+{
+    struct reap_status exited;
+    siginfo_t info = {0};
+    int result;
+
+    if (reap_fd() >= 0) {
+        result = reap_take(pid, WNOHANG, &exited);
+
+        if (result <= 0) {
+            return result;
+        }
+
+        *code = exited.code;
+        *status = exited.status;
+        return 1;
+    }
+
+    if (waitid_nointr(P_PID, (id_t) pid, &info, WEXITED | WNOHANG) != 0) {
+        return -1;
+    }
+
+    if (info.si_pid == 0) {
+        return 0;
+    }
+
+    *code = info.si_code;
+    *status = info.si_status;
+    return 1;
+}
+
+static int child_dispatch(struct evloop *loop, struct evloop_watch *watch)
+{
+    int code;
+    int status;
+    int result = child_exited(watch->pid, &code, &status);
+
+    if (result <= 0) {
+        return result;
+    }
+
+    watch->callback.child(loop, watch->pid, code, status, watch->arg);
+    evloop_remove(loop, watch);
+    return 1;
+}
+
+/* Checks every child that's watched without a pidfd. */
+static int children_poll(struct evloop *loop)
+{
+    struct evloop_watch *watch;
+    int ran = 0;
+
+    loop->check_children = false;
+
+    for (watch = loop->watches; watch != NULL; watch = watch->next) {
+        if ((watch->kind == watch_child) && (watch->fd == -1) &&
+            (watch->dead == false) && (child_dispatch(loop, watch) > 0)) {
+            ran++;
+        }
+    }
+
+    return ran;
+}
+
+/* Collects every pending signal and hands each delivery to the watches for
+ * its signal. */
+static int signals_dispatch(struct evloop *loop)
+{
+    struct signal_info info[signal_batch];
+    struct evloop_watch *watch;
+    bool sigchld = false;
+    int count;
+    int ran = 0;
+
+    do {
+        count = signal_pipefd_read(info, signal_batch);
+
+        if (count < 0) {
+            return -1;
+        }
+
+        for (int x = 0; x < count; x++) {
+            sigchld = sigchld || (info[x].signum == SIGCHLD);
+
+            for (watch = loop->watches; watch != NULL; watch = watch->next) {
+                if ((watch->kind == watch_signal) && (watch->dead == false) &&
+                    (watch->signum == info[x].signum)) {
+                    watch->callback.signal(loop, &info[x], watch->arg);
+                    ran++;
+                }
+            }
+        }
+    } while (count == signal_batch);
+
+    /* Reading the loop's signals also takes the reaper's SIGCHLD wakeups
+     * with them, so the exits have to be collected here instead. */
+
+    if (sigchld && (reap_fd() >= 0) && (reap_collect() < 0)) {
+        return -1;
+    }
+
+    if (sigchld && (loop->polled != 0)) {
+        ran += children_poll(loop);
+    }
+
+    return ran;
+}
+
+static int timer_dispatch(struct evloop *loop, struct evloop_watch *watch)
+{
+    struct itimerspec setting;
+    uint64_t expirations;
+
+    if (read_nointr(watch->fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+
+    watch->callback.timer(loop, expirations, watch->arg);
+
+    if ((watch->dead == false) &&
+        (timerfd_gettime(watch->fd, &setting) == 0) &&
+        (setting.it_interval.tv_sec == 0) &&
+        (setting.it_interval.tv_nsec == 0)) {
+        evloop_remove(loop, watch);
+    }
+
+    return 1;
+}
+
+static int watch_dispatch(struct evloop *loop, struct evloop_watch *watch,
+                          uint32_t events)
+{
+    switch (watch->kind) {
+        case watch_fd:
+            watch->callback.fd(loop, watch->fd, loop_events(events),
+                               watch->arg);
+            return 1;
+
+        case watch_source:
+            return signals_dispatch(loop);
+
+        case watch_child:
+            return child_dispatch(loop, watch);
+
+        case watch_timer:
+            return timer_dispatch(loop, watch);
+
+        case watch_reaper:
+            return (reap_collect() < 0) ? -1 : children_poll(loop);
+
+        default:
+            return 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+struct evloop * evloop_create(void)
+{
+    struct evloop *loop = calloc(1, sizeof(*loop));
+
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->epoll_fd < 0) {
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void evloop_destroy(struct evloop *loop)
+{
+    struct evloop_watch *watch;
+
+    if (loop == NULL) {
+        return;
+    }
+
+    loop->running = true;
+
+    for (watch = loop->watches; watch != NULL; watch = watch->next) {
+        evloop_remove(loop, watch);
+    }
+
+    loop_sweep(loop);
+    close_nointr(loop->epoll_fd);
+    free(loop);
+}
+
+int evloop_fd(const struct evloop *loop)
+{
+    return loop->epoll_fd;
+}
+
+int evloop_run(struct evloop *loop, int timeout_ms)
+{
+    struct epoll_event events[event_batch];
+    struct evloop_watch *watch;
+    int ready;
+    int result;
+    int ran = 0;
+
+    if (loop->running) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* Children watched without a pidfd might have exited before SIGCHLD
+     * was connected, so they get checked once without waiting for it. */
+
+    ready = epoll_wait_nointr(loop->epoll_fd, events, event_batch,
+                              loop->check_children ? 0 : timeout_ms);
+
+    if (ready < 0) {
+        return -1;
+    }
+
+    loop->running = true;
+
+    for (int x = 0; x < ready; x++) {
+        watch = events[x].data.ptr;
+
+        if (watch->dead) {
+            continue;
+        }
+
+        result = watch_dispatch(loop, watch, events[x].events);
+
+        if (result < 0) {
+            ran = -1;
+            break;
+        }
+
+        ran += result;
+    }
+
+    if ((ran >= 0) && loop->check_children) {
+        ran += children_poll(loop);
+    }
+
+    loop->running = false;
+
+    if (loop->has_dead) {
+        loop_sweep(loop);
+    }
+
+    return ran;
+}
+
+/*----------------------------------------------------------------------------*/
+
+struct evloop_watch * evloop_add_fd(struct evloop *loop, int fd,
+                                    unsigned int events,
+                                    evloop_fd_callback_t callback, void *arg)
+{
+    struct evloop_watch *watch;
+
+    if ((fd < 0) || (callback == NULL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    watch = watch_add(loop, watch_fd, fd, epoll_events(events));
+
+    if (watch != NULL) {
+        watch->callback.fd = callback;
+        watch->arg = arg;
+    }
+
+    return watch;
+}
+
+int evloop_set_events(struct evloop *loop, struct evloop_watch *watch,
+                      unsigned int events)
+{
+    struct epoll_event event = {.events = epoll_events(events)};
+
+    if ((watch->kind != watch_fd) || watch->dead) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    event.data.ptr = watch;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &event);
+}
+
+struct evloop_watch * evloop_add_signal(struct evloop *loop, int signum,
+                                        evloop_signal_callback_t callback,
+                                        void *arg)
+{
+    struct evloop_watch *watch;
+
+    if (callback == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((signum == SIGCHLD) && (reap_fd() >= 0)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    if (source_connect(loop, signum) != 0) {
+        return NULL;
+    }
+
+    watch = watch_add(loop, watch_signal, -1, 0);
+
+    if (watch != NULL) {
+        watch->signum = signum;
+        watch->callback.signal = callback;
+        watch->arg = arg;
+    }
+
+    return watch;
+}
+
+struct evloop_watch * evloop_add_child(struct evloop *loop, pid_t pid,
+                                       evloop_child_callback_t callback,
+                                       void *arg)
+{
+    struct evloop_watch *watch;
+    bool collected;
+    int fd;
+
+    if ((pid <= 0) || (callback == NULL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fd = proc_pidfd_open(pid);
+
+    /* If the reaper has already collected the child, there's nothing left to
+     * open a pidfd for, but its exit is in the table. Watching it like a
+     * child without a pidfd delivers that exit on the next pass. */
+
+    collected = (fd < 0) && (errno == ESRCH) &&
+                (reap_lookup(pid, NULL) == 1);
+
+    if ((fd < 0) && (errno != ENOSYS) && (collected == false)) {
+        return NULL;
+    }
+
+    if ((fd < 0) && (reap_fd() >= 0) && (reaper_connect(loop) != 0)) {
+        return NULL;
+    }
+
+    if ((fd < 0) && (reap_fd() < 0) && (source_connect(loop, SIGCHLD) != 0)) {
+        return NULL;
+    }
+
+    watch = watch_add(loop, watch_child, fd, EPOLLIN);
+
+    if (watch == NULL) {
+        if (fd >= 0) {
+            close_nointr(fd);
+        }
+
+        return NULL;
+    }
+
+    watch->pid = pid;
+    watch->callback.child = callback;
+    watch->arg = arg;
+
+    if (fd < 0) {
+        loop->polled++;
+        loop->check_children = true;
+    }
+
+    return watch;
+}
+
+struct evloop_watch * evloop_add_timer(struct evloop *loop,
+                                       unsigned int timeout_ms,
+                                       unsigned int interval_ms,
+                                       evloop_timer_callback_t callback,
+                                       void *arg)
+{
+    struct itimerspec setting = {0};
+    struct evloop_watch *watch;
+    int fd;
+
+    if (callback == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* An all-zero it_value would disarm the timer instead of firing it
+     * right away. */
+
+    setting.it_value.tv_sec = timeout_ms / 1000;
+    setting.it_value.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    setting.it_value.tv_nsec += (timeout_ms == 0) ? 1 : 0;
+    setting.it_interval.tv_sec = interval_ms / 1000;
+    setting.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    watch = watch_add(loop, watch_timer, fd, EPOLLIN);
+
+    if ((watch == NULL) || (timerfd_settime(fd, 0, &setting, NULL) != 0)) {
+        if (watch != NULL) {
+            evloop_remove(loop, watch);
+        } else {
+            close_nointr(fd);
+        }
+
+        return NULL;
+    }
+
+    watch->callback.timer = callback;
+    watch->arg = arg;
+    return watch;
+}
+
+void evloop_remove(struct evloop *loop, struct evloop_watch *watch)
+{
+    if ((watch == NULL) || watch->dead) {
+        return;
+    }
+
+    watch->dead = true;
+
+    if ((watch->kind == watch_child) && (watch->fd == -1)) {
+        loop->polled--;
+
+        if ((loop->polled == 0) && (loop->reaper != NULL)) {
+            evloop_remove(loop, loop->reaper);
+        }
+    }
+
+    if (watch == loop->reaper) {
+        loop->reaper = NULL;
+    }
+
+    /* The descriptors of fd watches belong to the caller, and signal
+     * descriptors to libsignal. Pidfds and timerfds are the loop's own. */
+
+    if (watch->fd != -1) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+        if ((watch->kind == watch_child) || (watch->kind == watch_timer)) {
+            close_nointr(watch->fd);
+        }
+
+        watch->fd = -1;
+    }
+
+    if (loop->running) {
+        loop->has_dead = true;
+    } else {
+        watch_unlink(loop, watch);
+        free(watch);
+    }
+}
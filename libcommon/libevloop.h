@@ -0,0 +1,124 @@
+#ifndef _LIBEVLOOP_H_
+#define _LIBEVLOOP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libsignal.h"
+
+/* A single-threaded event loop built on epoll. Callbacks can be registered
+ * for readable/writable descriptors, signals, child exits and timers, and
+ * evloop_run() dispatches whatever is ready. Each watch is one epoll entry
+ * (a descriptor, a libsignal descriptor, a pidfd or a timerfd), so the cost
+ * of a pass depends on the number of ready events rather than on how many
+ * are being watched, and there's no FD_SETSIZE limit.
+ *
+ * Watches can be added and removed from inside callbacks. */
+
+struct evloop;
+struct evloop_watch;
+
+enum {
+    evloop_read = 1,
+    evloop_write = 2,
+    evloop_error = 4
+};
+
+typedef void (*evloop_fd_callback_t)(struct evloop *loop, int fd,
+                                     unsigned int events, void *arg);
+
+typedef void (*evloop_signal_callback_t)(struct evloop *loop,
+                                         const struct signal_info *info,
+                                         void *arg);
+
+typedef void (*evloop_child_callback_t)(struct evloop *loop, pid_t pid,
+                                        int code, int status, void *arg);
+
+typedef void (*evloop_timer_callback_t)(struct evloop *loop,
+                                        uint64_t expirations, void *arg);
+
+/*----------------------------------------------------------------------------*/
+
+/* Returns NULL in the event of an error. */
+
+struct evloop * evloop_create(void);
+
+/* Removes every watch and frees the loop. Descriptors passed to
+ * evloop_add_fd() are left open; everything the loop opened itself is
+ * closed. Connected signals stay connected. */
+
+void evloop_destroy(struct evloop *loop);
+
+/* Returns the epoll descriptor, which becomes readable when evloop_run()
+ * has work to do, for nesting the loop inside another one. */
+
+int evloop_fd(const struct evloop *loop);
+
+/* Waits up to 'timeout_ms' milliseconds (-1 waits forever, 0 doesn't block)
+ * for events, and runs the callbacks for everything that's ready. Returns
+ * the number of callbacks that ran, or -1 in the event of an error. */
+
+int evloop_run(struct evloop *loop, int timeout_ms);
+
+/*----------------------------------------------------------------------------*/
+
+/* Calls 'callback' whenever 'fd' is ready for any of 'events' (a mask of
+ * evloop_read and evloop_write). evloop_error is always reported, and also
+ * covers hangups. Returns the watch, or NULL in the event of an error. */
+
+struct evloop_watch * evloop_add_fd(struct evloop *loop, int fd,
+                                    unsigned int events,
+                                    evloop_fd_callback_t callback, void *arg);
+
+/* Changes the events that an fd watch is waiting for. Returns 0 on a
+ * success, or -1 in the event of an error. */
+
+int evloop_set_events(struct evloop *loop, struct evloop_watch *watch,
+                      unsigned int events);
+
+/* Connects 'signum' with signal_pipefd_connect() (using whichever libsignal
+ * backend is selected) and calls 'callback' for each delivery. The loop
+ * reads pending deliveries with signal_pipefd_read(), which collects every
+ * connected signal, so signals that the program waits for outside the loop
+ * shouldn't be connected while it's in use. The exception is the reaper's
+ * SIGCHLD: when the loop reads it, it calls reap_collect(), so exits still
+ * end up in the reaper's table. SIGCHLD itself can't be watched while
+ * reap_init() is active (errno is set to EBUSY). Returns the watch, or NULL
+ * in the event of an error. */
+
+struct evloop_watch * evloop_add_signal(struct evloop *loop, int signum,
+                                        evloop_signal_callback_t callback,
+                                        void *arg);
+
+/* Reaps child 'pid' when it exits, and calls 'callback' with the waitid()
+ * si_code and si_status. If reap_init() is active, the exit is taken from
+ * its table instead. The watch is removed once the callback has run.
+ *
+ * Uses a pidfd when the kernel has them. Otherwise, the watched children are
+ * checked each time SIGCHLD arrives, or, while the reaper is active, each
+ * time reap_fd() becomes readable, without connecting SIGCHLD separately.
+ * A child whose exit the reaper has already collected is reported on the next
+ * evloop_run(). Returns the watch, or NULL in the event of an error. */
+
+struct evloop_watch * evloop_add_child(struct evloop *loop, pid_t pid,
+                                       evloop_child_callback_t callback,
+                                       void *arg);
+
+/* Calls 'callback' after 'timeout_ms' milliseconds, and then every
+ * 'interval_ms' milliseconds if that isn't 0. 'expirations' counts the
+ * intervals that have passed since the last call. One-shot timers are
+ * removed once their callback has run. Returns the watch, or NULL in the
+ * event of an error. */
+
+struct evloop_watch * evloop_add_timer(struct evloop *loop,
+                                       unsigned int timeout_ms,
+                                       unsigned int interval_ms,
+                                       evloop_timer_callback_t callback,
+                                       void *arg);
+
+/* Stops and frees a watch. It's safe to remove the watch whose callback is
+ * running, or one whose event is already pending in the current pass. */
+
+void evloop_remove(struct evloop *loop, struct evloop_watch *watch);
+
+#endif
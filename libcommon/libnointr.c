@@ -2,8 +2,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pwd.h>
 #include <stdio.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -29,6 +31,37 @@ int select_nointr(int nfds, fd_set *restrict readfds, fd_set *restrict writefds,
     }
 }
 
+int poll_nointr(struct pollfd fds[], nfds_t nfds, int timeout)
+{
+    int result;
+
+    while (1) {
+        result = poll(fds, nfds, timeout);
+
+        if ((result < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        return result;
+    }
+}
+
+int epoll_wait_nointr(int epfd, struct epoll_event *events, int maxevents,
+                      int timeout)
+{
+    int result;
+
+    while (1) {
+        result = epoll_wait(epfd, events, maxevents, timeout);
+
+        if ((result < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        return result;
+    }
+}
+
 ssize_t read_nointr(int fd, void *buf, size_t nbytes)
 {
     ssize_t result;
@@ -134,6 +167,21 @@ pid_t waitpid_nointr(pid_t pid, int *stat_loc, int options)
     }
 }
 
+int waitid_nointr(idtype_t idtype, id_t id, siginfo_t *infop, int options)
+{
+    int result;
+
+    while (1) {
+        result = waitid(idtype, id, infop, options);
+
+        if ((result < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        return result;
+    }
+}
+
 int accept_nointr(int socket, struct sockaddr *restrict address,
                   socklen_t *restrict address_len)
 {
@@ -166,6 +214,36 @@ int connect_nointr(int socket, const struct sockaddr *address,
     }
 }
 
+ssize_t sendmsg_nointr(int socket, const struct msghdr *message, int flags)
+{
+    ssize_t result;
+
+    while (1) {
+        result = sendmsg(socket, message, flags);
+
+        if ((result < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        return result;
+    }
+}
+
+ssize_t recvmsg_nointr(int socket, struct msghdr *message, int flags)
+{
+    ssize_t result;
+
+    while (1) {
+        result = recvmsg(socket, message, flags);
+
+        if ((result < 0) && (errno == EINTR)) {
+            continue;
+        }
+
+        return result;
+    }
+}
+
 int dup2_nointr(int fildes, int fildes2)
 {
     int result;
@@ -1,18 +1,26 @@
 #ifndef _LIBNOINTR_H_
 #define _LIBNOINTR_H_
 
+#include <poll.h>
 #include <pwd.h>
 #include <stdio.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 int select_nointr(int nfds, fd_set *restrict readfds, fd_set *restrict writefds,
                   fd_set *restrict errorfds, struct timeval *restrict timeout);
 
+int poll_nointr(struct pollfd fds[], nfds_t nfds, int timeout);
+
+int epoll_wait_nointr(int epfd, struct epoll_event *events, int maxevents,
+                      int timeout);
+
 ssize_t read_nointr(int fd, void *buf, size_t nbytes);
 ssize_t write_nointr(int fd, const void *buf, size_t nbytes);
 
@@ -23,6 +31,7 @@ FILE * fopen_nointr(const char *restrict pathname, const char *restrict mode);
 int fclose_nointr(FILE *stream);
 
 pid_t waitpid_nointr(pid_t pid, int *stat_loc, int options);
+int waitid_nointr(idtype_t idtype, id_t id, siginfo_t *infop, int options);
 
 int accept_nointr(int socket, struct sockaddr *restrict address,
                   socklen_t *restrict address_len);
@@ -30,6 +39,9 @@ int accept_nointr(int socket, struct sockaddr *restrict address,
 int connect_nointr(int socket, const struct sockaddr *address,
                    socklen_t address_len);
 
+ssize_t sendmsg_nointr(int socket, const struct msghdr *message, int flags);
+ssize_t recvmsg_nointr(int socket, struct msghdr *message, int flags);
+
 int dup2_nointr(int fildes, int fildes2);
 
 int nanosleep_nointr(const struct timespec *rqtp, struct timespec *rmtp);
@@ -2,9 +2,13 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -12,8 +16,58 @@
 #include "libpath.h"
 
 static const char mkdirs_errstring[] = "%s: cannot create directory ‘%s’: ";
+static const char default_path[] = "/usr/bin:/bin";
 static const char *progname;
 
+enum {
+    cache_buckets = 256,
+    cache_max_entries = 4096,
+    cache_max_dirs = 128
+};
+
+static const uint32_t cache_watch_mask = IN_CREATE | IN_DELETE | IN_ATTRIB |
+                                         IN_MOVED_FROM | IN_MOVED_TO |
+                                         IN_DELETE_SELF | IN_MOVE_SELF;
+
+/* Events that mean a watch no longer follows the directory at its name. */
+static const uint32_t cache_lost_mask = IN_DELETE_SELF | IN_MOVE_SELF |
+                                        IN_IGNORED;
+
+struct cache_entry {
+    struct cache_entry *next;
+    uint32_t hash;
+    int result;
+    char *resolved;
+    char name[];
+};
+
+struct cache_dir {
+    const char *name;
+    int wd;
+    bool watched;
+    bool exists;
+    struct timespec mtime;
+};
+
+/* Resolution cache for path_findprog_cached(). Entries are only valid for
+ * the $PATH string in 'path' and for the working directory that was current
+ * when they were stored. Everything in it is protected by 'lock'. */
+
+static struct {
+    pthread_mutex_t lock;
+    char *path;
+    char *dirbuf;
+    bool usable;
+    int inotify_fd;
+    dev_t cwd_dev;
+    ino_t cwd_ino;
+    unsigned int count;
+    unsigned int ndirs;
+    struct cache_dir dirs[cache_max_dirs];
+    struct cache_entry *buckets[cache_buckets];
+    struct path_cache_stats stats;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .inotify_fd = -1};
+
 static int mkdirs_lowlevel(char *path, mode_t mode)
 {
     unsigned int x;
@@ -84,15 +138,16 @@ static int check_exec(const char *restrict dir, size_t dirlen,
         return -1;
     }
 
-    memcpy(buffer, dir, dirlen);
-    buffer += dirlen;
+    if (dirlen != 0) {
+        memcpy(buffer, dir, dirlen);
+    }
 
     if (termdir) {
-        *(buffer++) = '/';
+        buffer[dirlen] = '/';
     }
 
-    memcpy(buffer, file, filelen);
-    buffer[filelen] = '\x00';
+    memcpy(buffer + dirlen + termdir, file, filelen);
+    buffer[dirlen + termdir + filelen] = '\x00';
     result = access(buffer, R_OK | X_OK);
 
     if (result != 0) {
@@ -102,6 +157,23 @@ static int check_exec(const char *restrict dir, size_t dirlen,
     return result;
 }
 
+static const char * search_path(void)
+{
+    const char *path = getenv("PATH");
+
+    if (path != NULL) {
+        if (path[0] == '\x00') {
+            path = NULL;
+        }
+    }
+
+    if (path == NULL) {
+        path = default_path;
+    }
+
+    return path;
+}
+
 int path_findprog(const char *restrict name, char *restrict dest,
                   size_t maxlen)
 {
@@ -120,18 +192,7 @@ int path_findprog(const char *restrict name, char *restrict dest,
         return -1;
     }
 
-    path = getenv("PATH");
-
-    if (path != NULL) {
-        if (path[0] == '\x00') {
-            path = NULL;
-        }
-    }
-
-    if (path == NULL) {
-        path = "/usr/bin:/bin";
-    }
-
+    path = search_path();
     dir = path;
     path += 1;
 
@@ -152,6 +213,370 @@ int path_findprog(const char *restrict name, char *restrict dest,
     return check_exec(".", 1, name, namelen, dest, maxlen);
 }
 
+/*----------------------------------------------------------------------------*/
+
+static uint32_t cache_hash(const char *name)
+{
+    uint32_t result = 2166136261U;
+
+    for (unsigned int x = 0; name[x] != '\x00'; x++) {
+        result ^= (unsigned char) name[x];
+        result *= 16777619U;
+    }
+
+    return result;
+}
+
+static void cache_clear_entries(void)
+{
+    struct cache_entry *entry;
+
+    for (unsigned int x = 0; x < cache_buckets; x++) {
+        while (cache.buckets[x] != NULL) {
+            entry = cache.buckets[x];
+            cache.buckets[x] = entry->next;
+            free(entry);
+        }
+    }
+
+    cache.count = 0;
+}
+
+static void cache_stat_dir(struct cache_dir *dir, bool *changed)
+{
+    struct stat info;
+    bool exists = (stat(dir->name, &info) == 0);
+
+    if (exists != dir->exists) {
+        *changed = true;
+    } else if (exists && ((info.st_mtim.tv_sec != dir->mtime.tv_sec) ||
+                          (info.st_mtim.tv_nsec != dir->mtime.tv_nsec))) {
+        *changed = true;
+    }
+
+    dir->exists = exists;
+
+    if (exists) {
+        dir->mtime = info.st_mtim;
+    }
+}
+
+/* Starts watching 'dir' with inotify if possible, and otherwise records its
+ * mtime for cache_stat_dir() to compare against. */
+static void cache_watch_dir(struct cache_dir *dir)
+{
+    bool dummy;
+
+    dir->wd = -1;
+    dir->watched = false;
+
+    if (cache.inotify_fd >= 0) {
+        dir->wd = inotify_add_watch(cache.inotify_fd, dir->name,
+                                    cache_watch_mask);
+        dir->watched = (dir->wd >= 0);
+    }
+
+    if (dir->watched == false) {
+        cache_stat_dir(dir, &dummy);
+    }
+}
+
+/* Handles an event that says the watch 'wd' has stopped following its
+ * directory (it was deleted or renamed, or the watch was dropped). Every
+ * directory using that watch goes back to being checked by mtime until it
+ * can be watched again. */
+static void cache_lose_watch(int wd, uint32_t mask)
+{
+    for (unsigned int x = 0; x < cache.ndirs; x++) {
+        if (cache.dirs[x].watched && (cache.dirs[x].wd == wd)) {
+            cache.dirs[x].watched = false;
+            cache.dirs[x].wd = -1;
+            cache.dirs[x].exists = false;
+        }
+    }
+
+    /* A renamed directory is still being watched under its new name. */
+
+    if ((mask & IN_MOVE_SELF) != 0) {
+        inotify_rm_watch(cache.inotify_fd, wd);
+    }
+}
+
+/* Drops everything and starts over for a new $PATH (or a new working
+ * directory). Each directory in $PATH (plus ".") gets an inotify watch.
+ * Directories that can't be watched are checked by mtime instead. */
+static int cache_reset(const char *path)
+{
+    struct cache_dir *entry;
+    struct stat info;
+    char *saveptr;
+    char *dir;
+
+    cache_clear_entries();
+    free(cache.path);
+    free(cache.dirbuf);
+    cache.dirbuf = NULL;
+    cache.usable = false;
+    cache.ndirs = 0;
+
+    if (cache.inotify_fd >= 0) {
+        close_nointr(cache.inotify_fd);
+    }
+
+    cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    cache.path = strdup(path);
+
+    if (cache.path == NULL) {
+        return -1;
+    }
+
+    if (stat(".", &info) != 0) {
+        return -1;
+    }
+
+    cache.cwd_dev = info.st_dev;
+    cache.cwd_ino = info.st_ino;
+
+    /* Room for the $PATH entries, plus a trailing "." */
+    cache.dirbuf = malloc(strlen(path) + 3);
+
+    if (cache.dirbuf == NULL) {
+        return -1;
+    }
+
+    memcpy(cache.dirbuf, path, strlen(path));
+    memcpy(cache.dirbuf + strlen(path), ":.", 3);
+
+    for (dir = strtok_r(cache.dirbuf, ":", &saveptr); dir != NULL;
+         dir = strtok_r(NULL, ":", &saveptr)) {
+        if (cache.ndirs == cache_max_dirs) {
+            return -1;
+        }
+
+        entry = &cache.dirs[cache.ndirs++];
+        entry->name = dir;
+        entry->exists = false;
+        cache_watch_dir(entry);
+    }
+
+    cache.usable = true;
+    return 0;
+}
+
+static bool cache_dirs_changed(void)
+{
+    _Alignas(struct inotify_event) char events[4096];
+    const struct inotify_event *event;
+    struct cache_dir *dir;
+    bool changed = false;
+    ssize_t result;
+
+    if (cache.inotify_fd >= 0) {
+        while (1) {
+            result = read_nointr(cache.inotify_fd, events, sizeof(events));
+
+            if (result <= 0) {
+                break;
+            }
+
+            changed = true;
+
+            for (ssize_t x = 0; x < result;
+                 x += (ssize_t)(sizeof(*event) + event->len)) {
+                event = (const struct inotify_event *)(events + x);
+
+                if ((event->mask & cache_lost_mask) != 0) {
+                    cache_lose_watch(event->wd, event->mask);
+                }
+            }
+        }
+    }
+
+    /* Directories without a watch are compared by mtime. Once one exists
+     * again (because it was recreated, or something else was renamed into
+     * its place), it gets a new watch. */
+
+    for (unsigned int x = 0; x < cache.ndirs; x++) {
+        dir = &cache.dirs[x];
+
+        if (dir->watched == false) {
+            cache_stat_dir(dir, &changed);
+
+            if (dir->exists && (cache.inotify_fd >= 0)) {
+                cache_watch_dir(dir);
+            }
+        }
+    }
+
+    return changed;
+}
+
+/* Returns 0 if the cache can be used for the current $PATH, and -1 if
+ * lookups should bypass it. */
+static int cache_validate(void)
+{
+    const char *path = search_path();
+    struct stat info;
+
+    if ((cache.path == NULL) || (strcmp(cache.path, path) != 0)) {
+        cache_reset(path);
+        return cache.usable ? 0 : -1;
+    }
+
+    if (cache.usable == false) {
+        return -1;
+    }
+
+    if (stat(".", &info) != 0) {
+        return -1;
+    }
+
+    if ((info.st_dev != cache.cwd_dev) || (info.st_ino != cache.cwd_ino)) {
+        cache.stats.invalidations++;
+        cache_reset(path);
+        return cache.usable ? 0 : -1;
+    }
+
+    if (cache_dirs_changed()) {
+        cache.stats.invalidations++;
+        cache_clear_entries();
+    }
+
+    return 0;
+}
+
+static struct cache_entry * cache_lookup(const char *name, uint32_t hash)
+{
+    struct cache_entry *entry = cache.buckets[hash % cache_buckets];
+
+    for (; entry != NULL; entry = entry->next) {
+        if ((entry->hash == hash) && (strcmp(entry->name, name) == 0)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void cache_insert(const char *name, uint32_t hash, int result,
+                         const char *resolved)
+{
+    size_t namelen = strlen(name) + 1;
+    size_t reslen = (result == 0) ? strlen(resolved) + 1 : 0;
+    struct cache_entry *entry;
+
+    if (cache.count >= cache_max_entries) {
+        cache_clear_entries();
+    }
+
+    entry = malloc(sizeof(*entry) + namelen + reslen);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    memcpy(entry->name, name, namelen);
+    entry->hash = hash;
+    entry->result = result;
+    entry->resolved = NULL;
+
+    if (result == 0) {
+        entry->resolved = entry->name + namelen;
+        memcpy(entry->resolved, resolved, reslen);
+    }
+
+    entry->next = cache.buckets[hash % cache_buckets];
+    cache.buckets[hash % cache_buckets] = entry;
+    cache.count++;
+}
+
+static int findprog_cached(const char *restrict name, char *restrict dest,
+                           size_t maxlen)
+{
+    char buffer[PATH_MAX + 1];
+    struct cache_entry *entry;
+    uint32_t hash;
+    int result;
+    int error;
+
+    if (cache_validate() != 0) {
+        return path_findprog(name, dest, maxlen);
+    }
+
+    hash = cache_hash(name);
+    entry = cache_lookup(name, hash);
+
+    if (entry != NULL) {
+        if (entry->result != 0) {
+            cache.stats.negative_hits++;
+
+            if (maxlen != 0) {
+                dest[0] = '\x00';
+            }
+
+            errno = ENOENT;
+            return -1;
+        }
+
+        cache.stats.hits++;
+        return path_strncpy(dest, entry->resolved, maxlen);
+    }
+
+    cache.stats.misses++;
+    result = path_findprog(name, buffer, sizeof(buffer));
+    error = errno;
+
+    if ((result == 0) || (error == ENOENT) || (error == EACCES)) {
+        cache_insert(name, hash, result, buffer);
+    }
+
+    if (result != 0) {
+        if (maxlen != 0) {
+            dest[0] = '\x00';
+        }
+
+        errno = error;
+        return result;
+    }
+
+    return path_strncpy(dest, buffer, maxlen);
+}
+
+int path_findprog_cached(const char *restrict name, char *restrict dest,
+                         size_t maxlen)
+{
+    int result;
+    int error;
+
+    if (strchr(name, '/') != NULL) {
+        return path_findprog(name, dest, maxlen);
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    result = findprog_cached(name, dest, maxlen);
+    error = errno;
+    pthread_mutex_unlock(&cache.lock);
+
+    errno = error;
+    return result;
+}
+
+void path_cache_get_stats(struct path_cache_stats *stats)
+{
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void path_cache_flush(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    cache_clear_entries();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/*----------------------------------------------------------------------------*/
+
 int path_readable(const char *name)
 {
     if (name == NULL) {
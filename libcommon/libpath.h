@@ -9,6 +9,31 @@ int path_mkdirs(const char *path, mode_t mode);
 int path_findprog(const char *restrict name, char *restrict dest,
                   size_t maxlen);
 
+/* Same as path_findprog(), but remembers each result (including programs
+ * that couldn't be found) for the current $PATH. Cached results are dropped
+ * when $PATH or the working directory changes, or when an entry is added,
+ * removed or chmod'ed in any $PATH directory. Directories are watched with
+ * inotify, or checked by mtime where inotify isn't available (or while a
+ * directory that was deleted or renamed away is missing). The cache is
+ * shared by every thread, and lookups through it are serialized by a
+ * lock. */
+
+int path_findprog_cached(const char *restrict name, char *restrict dest,
+                         size_t maxlen);
+
+struct path_cache_stats {
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+    unsigned long invalidations;
+};
+
+void path_cache_get_stats(struct path_cache_stats *stats);
+
+/* Drops every cached result. The counters are left alone. */
+
+void path_cache_flush(void);
+
 int path_readable(const char *name);
 
 const char * path_homedir(void);
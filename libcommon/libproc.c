@@ -1,13 +1,20 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/signal.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -16,103 +23,744 @@
 #include "libnointr.h"
 #include "libpath.h"
 #include "libproc.h"
+#include "libreap.h"
+#include "libsignal.h"
+#include "libzygote.h"
 
 extern char **environ;
 
-static int sleep_ms(unsigned int count)
+/*----------------------------------------------------------------------------*/
+
+enum {waitset_batch = 64};
+
+struct waitset_entry {
+    pid_t pid;
+    int fd;
+};
+
+struct proc_waitset {
+    int epoll_fd;
+    int sigchld_fd;
+    struct waitset_entry *entries;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+/* -1 until probed, then 0 or 1. */
+static int pidfd_support = -1;
+
+static proc_backend_t launch_backend = proc_backend_fork;
+
+/*----------------------------------------------------------------------------*/
+
+static bool pidfd_supported(void)
 {
-    unsigned int seconds = (count / 1000);
-    unsigned int msec = count - (seconds * 1000);
-    long int nsec = msec * 1000000L;
+    int fd;
+
+    if (pidfd_support < 0) {
+        fd = proc_pidfd_open(getpid());
+        pidfd_support = (fd >= 0);
 
-    struct timespec duration = {
-        .tv_sec = seconds,
-        .tv_nsec = nsec
+        if (fd >= 0) {
+            close_nointr(fd);
+        }
+    }
+
+    return (pidfd_support == 1);
+}
+
+static int8_t status_errcode(int status)
+{
+    if (WIFEXITED(status)) {
+        return (int8_t) WEXITSTATUS(status);
+    }
+
+    return -1;
+}
+
+/* Rebuilds a waitpid() status from a libreap record. */
+static int reaped_status(const struct reap_status *exited)
+{
+    switch (exited->code) {
+        case CLD_EXITED:
+            return W_EXITCODE(exited->status, 0);
+
+        case CLD_DUMPED:
+            return W_EXITCODE(0, exited->status) | WCOREFLAG;
+
+        default:
+            return W_EXITCODE(0, exited->status);
+    }
+}
+
+static void deadline_set(struct timespec *deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+
+    if (timeout_ms > 0) {
+        deadline->tv_sec += timeout_ms / 1000;
+        deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+        if (deadline->tv_nsec >= 1000000000L) {
+            deadline->tv_sec += 1;
+            deadline->tv_nsec -= 1000000000L;
+        }
+    }
+}
+
+/* Returns the number of milliseconds left until 'deadline' (rounded up), or
+ * -1 if 'timeout_ms' says to wait forever. */
+static int deadline_remaining(const struct timespec *deadline, int timeout_ms)
+{
+    struct timespec now;
+    long long remaining;
+
+    if (timeout_ms < 0) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining = (deadline->tv_sec - now.tv_sec) * 1000LL;
+    remaining += (deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+
+    if (remaining < 0) {
+        return 0;
+    }
+
+    return (remaining > INT_MAX) ? INT_MAX : (int) remaining;
+}
+
+/* returns -1 in an error, 0 on a timeout, and 1 if the fd is ready for
+ * reading. */
+static int wait_readable(int fd, int timeout_ms)
+{
+    struct pollfd target = {
+        .fd = fd,
+        .events = POLLIN
     };
 
-    return nanosleep_nointr(&duration, NULL);
+    int result = poll_nointr(&target, 1, timeout_ms);
+
+    if (result < 0) {
+        return result;
+    }
+
+    return (result == 0) ? 0 : 1;
 }
 
-pid_t proc_launch(char *const argv[], int stdin_fd, int stdout_fd,
-                  int stderr_fd)
+/* returns -1 in an error, 0 if the process is still running, and 1 if it
+ * was reaped. While the libreap reaper is active, it owns every exit, so
+ * the exit is taken from its table instead of from waitpid(). */
+static int reap(pid_t process, int options, int *status, int8_t *errcode)
 {
-    pid_t child;
-    char filename[PATH_MAX + 1];
+    struct reap_status exited;
+    pid_t result;
+
+    if (reap_fd() >= 0) {
+        result = reap_take(process, options, &exited);
+
+        if (result <= 0) {
+            return result;
+        }
+
+        *status = reaped_status(&exited);
+        *errcode = status_errcode(*status);
+        return 1;
+    }
+
+    result = waitpid_nointr(process, status, options);
+
+    if (result < 0) {
+        return -1;
+    }
+
+    if (result == 0) {
+        return 0;
+    }
+
+    *errcode = status_errcode(*status);
+    return 1;
+}
+
+static int sigchld_wait(pid_t process, int timeout_ms, int8_t *errcode)
+{
+    struct timespec deadline;
+    int status;
     int result;
+    int fd = signal_pipefd_connect(SIGCHLD);
 
-    if (argv == NULL) {
+    if (fd < 0) {
         return -1;
     }
 
-    if (argv[0] == NULL) {
+    deadline_set(&deadline, timeout_ms);
+
+    while (1) {
+        result = reap(process, WNOHANG, &status, errcode);
+
+        if (result != 0) {
+            return result;
+        }
+
+        result = wait_readable(fd, deadline_remaining(&deadline, timeout_ms));
+
+        if (result <= 0) {
+            return result;
+        }
+
+        signal_pipefd_drain(SIGCHLD);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static char *const * spec_envp(const struct proc_spec *spec)
+{
+    return (spec->envp != NULL) ? spec->envp : environ;
+}
+
+static bool fd_kept(int fd, const int keep_fds[], unsigned int keep_count)
+{
+    for (unsigned int x = 0; x < keep_count; x++) {
+        if (keep_fds[x] == fd) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+struct dirent64_header {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Sets FD_CLOEXEC on every open descriptor above stderr by listing
+ * /proc/self/fd. This runs between fork() and exec, so the directory is read
+ * with getdents64 instead of readdir() (which allocates). */
+
+static int cloexec_listed(void)
+{
+    uint64_t buffer[512];
+    const struct dirent64_header *entry;
+    long length;
+    int dir_fd;
+    int fd;
+
+    dir_fd = open_nointr("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir_fd < 0) {
         return -1;
     }
 
-    result = path_findprog(argv[0], filename, sizeof(filename));
+    while ((length = syscall(SYS_getdents64, dir_fd, buffer,
+                             sizeof(buffer))) > 0) {
+        for (long offset = 0; offset < length; offset += entry->d_reclen) {
+            entry = (const void *)((const char *) buffer + offset);
+
+            if ((entry->d_name[0] < '0') || (entry->d_name[0] > '9')) {
+                continue;
+            }
+
+            fd = 0;
+
+            for (const char *c = entry->d_name; *c != '\x00'; c++) {
+                fd = (fd * 10) + (*c - '0');
+            }
+
+            if ((fd > STDERR_FILENO) && (fd != dir_fd)) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+    }
+
+    close_nointr(dir_fd);
+    return (length < 0) ? -1 : 0;
+}
+
+/* Marks every descriptor above stderr as close-on-exec, then clears the flag
+ * on the ones in 'keep_fds'. close_range() (Linux 5.11 and later) does the
+ * first part in one call no matter how high RLIMIT_NOFILE is. Older kernels
+ * fall back to listing /proc/self/fd, and then to trying every descriptor
+ * below the limit. */
+
+static int sanitize_fds(const int keep_fds[], unsigned int keep_count)
+{
+    struct rlimit limit;
+    int result = -1;
+
+#ifdef SYS_close_range
+    result = (int) syscall(SYS_close_range, STDERR_FILENO + 1, ~0U,
+                           CLOSE_RANGE_CLOEXEC);
+#endif
 
     if (result != 0) {
-        fprintf(stderr, "error: couldn't launch [%s]: %s.\n", argv[0],
-                strerror(errno));
-        return result;
+        result = cloexec_listed();
+    }
+
+    if ((result != 0) && (getrlimit(RLIMIT_NOFILE, &limit) == 0)) {
+        for (rlim_t fd = STDERR_FILENO + 1; fd < limit.rlim_cur; fd++) {
+            fcntl((int) fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    for (unsigned int x = 0; x < keep_count; x++) {
+        if ((keep_fds[x] > STDERR_FILENO) &&
+            (fcntl(keep_fds[x], F_SETFD, 0) != 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static pid_t launch_fork(const char *filename, const struct proc_spec *spec)
+{
+    const int fds[3] = {spec->stdin_fd, spec->stdout_fd, spec->stderr_fd};
+    int error_pipe[2];
+    pid_t child;
+
+    if (pipe2(error_pipe, O_CLOEXEC) != 0) {
+        return -1;
     }
 
     child = fork();
 
     if (child < 0) {
+        close_nointr(error_pipe[0]);
+        close_nointr(error_pipe[1]);
         return -1;
     }
 
     if (child == 0) {
-        dup2_nointr(stdin_fd, STDIN_FILENO);
-        dup2_nointr(stdout_fd, STDOUT_FILENO);
-        dup2_nointr(stderr_fd, STDERR_FILENO);
+        close_nointr(error_pipe[0]);
+        proc_child_exec(filename, spec->argv, spec_envp(spec), fds,
+                        spec->keep_fds, spec->keep_count, error_pipe[1]);
+    }
 
-        result = execve(filename, argv, environ);
-        _exit(result);
+    close_nointr(error_pipe[1]);
+    return proc_await_exec(child, error_pipe[0]);
+}
+
+/* Adds the file actions that close everything above stderr except for the
+ * descriptors in 'keep_fds'. Kept descriptors are dup'd onto themselves,
+ * which clears their FD_CLOEXEC flag. Below the highest kept descriptor,
+ * only descriptors that are currently open get their own close action; the
+ * rest are covered by one closefrom action. */
+
+static int spawn_close_fds(posix_spawn_file_actions_t *actions,
+                           const int keep_fds[], unsigned int keep_count)
+{
+    int highest = STDERR_FILENO;
+    int result;
+
+    for (unsigned int x = 0; x < keep_count; x++) {
+        if (keep_fds[x] <= STDERR_FILENO) {
+            continue;
+        }
+
+        result = posix_spawn_file_actions_adddup2(actions, keep_fds[x],
+                                                  keep_fds[x]);
+
+        if (result != 0) {
+            return result;
+        }
+
+        if (keep_fds[x] > highest) {
+            highest = keep_fds[x];
+        }
+    }
+
+    for (int fd = STDERR_FILENO + 1; fd < highest; fd++) {
+        if (fd_kept(fd, keep_fds, keep_count) || (fcntl(fd, F_GETFD) < 0)) {
+            continue;
+        }
+
+        result = posix_spawn_file_actions_addclose(actions, fd);
+
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    return posix_spawn_file_actions_addclosefrom_np(actions, highest + 1);
+}
+
+static pid_t launch_spawn(const char *filename, const struct proc_spec *spec)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawnattr_t *attrp = NULL;
+    sigset_t mask;
+    pid_t child;
+    int result;
+
+    result = posix_spawn_file_actions_init(&actions);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    /* Signals blocked for the signalfd backend mustn't stay blocked in the
+     * new program. */
+
+    if ((signal_pipefd_child_mask(&mask) > 0) &&
+        (posix_spawnattr_init(&attr) == 0)) {
+        attrp = &attr;
+        posix_spawnattr_setsigmask(attrp, &mask);
+        posix_spawnattr_setflags(attrp, POSIX_SPAWN_SETSIGMASK);
+    }
+
+    result = posix_spawn_file_actions_adddup2(&actions, spec->stdin_fd,
+                                              STDIN_FILENO);
+
+    if (result == 0) {
+        result = posix_spawn_file_actions_adddup2(&actions, spec->stdout_fd,
+                                                  STDOUT_FILENO);
+    }
+
+    if (result == 0) {
+        result = posix_spawn_file_actions_adddup2(&actions, spec->stderr_fd,
+                                                  STDERR_FILENO);
+    }
+
+    if (result == 0) {
+        result = spawn_close_fds(&actions, spec->keep_fds, spec->keep_count);
+    }
+
+    /* posix_spawn() already reports exec failures through its return value,
+     * and reaps the failed child itself. */
+
+    if (result == 0) {
+        result = posix_spawn(&child, filename, &actions, attrp, spec->argv,
+                             spec_envp(spec));
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (attrp != NULL) {
+        posix_spawnattr_destroy(attrp);
+    }
+
+    if (result != 0) {
+        errno = result;
+        return -1;
     }
 
     return child;
 }
 
-int8_t proc_polled_wait(pid_t process)
+/*----------------------------------------------------------------------------*/
+
+int proc_set_backend(proc_backend_t backend)
 {
-    int status;
-    pid_t result;
-    int options = WUNTRACED | WCONTINUED;
+    switch (backend) {
+        case proc_backend_fork:
+        case proc_backend_spawn:
+            launch_backend = backend;
+            return 0;
 
-    while (1) {
-        if (kill(process, 0) != 0) {
-            fprintf(stderr, "error: couldn't talk to PID [%jd]: %s.\n",
-                    (intmax_t) process, strerror(errno));
+        case proc_backend_zygote:
+            if (zygote_running() == false) {
+                fprintf(stderr, "error: zygote isn't running.\n");
+                return -1;
+            }
+
+            launch_backend = backend;
+            return 0;
+
+        default:
+            fprintf(stderr, "error: unknown launch backend [%d].\n",
+                    (int) backend);
             return -1;
+    }
+}
+
+proc_backend_t proc_get_backend(void)
+{
+    return launch_backend;
+}
+
+/*----------------------------------------------------------------------------*/
+
+_Noreturn void proc_child_exec(const char *filename, char *const argv[],
+                               char *const envp[], const int fds[3],
+                               const int keep_fds[], unsigned int keep_count,
+                               int error_fd)
+{
+    sigset_t mask;
+    int error;
+
+    if (signal_pipefd_child_mask(&mask) > 0) {
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+    }
+
+    if ((dup2_nointr(fds[0], STDIN_FILENO) < 0) ||
+        (dup2_nointr(fds[1], STDOUT_FILENO) < 0) ||
+        (dup2_nointr(fds[2], STDERR_FILENO) < 0) ||
+        (sanitize_fds(keep_fds, keep_count) != 0)) {
+        error = errno;
+    } else {
+        execve(filename, argv, envp);
+        error = errno;
+    }
+
+    write_nointr(error_fd, &error, sizeof(error));
+    _exit(127);
+}
+
+int proc_exec_status(int error_fd)
+{
+    int error;
+    ssize_t result = read_nointr(error_fd, &error, sizeof(error));
+
+    close_nointr(error_fd);
+
+    if (result == 0) {
+        return 0;
+    }
+
+    if (result != sizeof(error)) {
+        return (result < 0) ? errno : EPROTO;
+    }
+
+    return error;
+}
+
+pid_t proc_await_exec(pid_t child, int error_fd)
+{
+    int error = proc_exec_status(error_fd);
+    int8_t errcode;
+    int status;
+
+    if (error == 0) {
+        return child;
+    }
+
+    reap(child, 0, &status, &errcode);
+    errno = error;
+    return -1;
+}
+
+/* zygote_launch() records its own children with the reaper. */
+static pid_t launch_resolved(const char *filename,
+                             const struct proc_spec *spec)
+{
+    pid_t child;
+
+    switch (launch_backend) {
+        case proc_backend_spawn:
+            child = launch_spawn(filename, spec);
+            break;
+
+        case proc_backend_zygote:
+            return zygote_launch(filename, spec, spec_envp(spec));
+
+        default:
+            child = launch_fork(filename, spec);
+            break;
+    }
+
+    if (child > 0) {
+        reap_expect(child);
+    }
+
+    return child;
+}
+
+pid_t proc_launch(char *const argv[], int stdin_fd, int stdout_fd,
+                  int stderr_fd)
+{
+    const struct proc_spec spec = {
+        .argv = argv,
+        .stdin_fd = stdin_fd,
+        .stdout_fd = stdout_fd,
+        .stderr_fd = stderr_fd
+    };
+
+    return proc_launch_spec(&spec);
+}
+
+pid_t proc_launch_spec(const struct proc_spec *spec)
+{
+    char filename[PATH_MAX + 1];
+    int result;
+
+    if (spec->argv == NULL) {
+        return -1;
+    }
+
+    if (spec->argv[0] == NULL) {
+        return -1;
+    }
+
+    if (spec->filename != NULL) {
+        return launch_resolved(spec->filename, spec);
+    }
+
+    result = path_findprog_cached(spec->argv[0], filename, sizeof(filename));
+
+    if (result != 0) {
+        fprintf(stderr, "error: couldn't launch [%s]: %s.\n", spec->argv[0],
+                strerror(errno));
+        return result;
+    }
+
+    return launch_resolved(filename, spec);
+}
+
+/* Resolves every executable in 'specs' into one growing buffer of
+ * NUL-terminated filenames. offsets[x] is set to SIZE_MAX (and
+ * results[x].error is set) for each entry that couldn't be resolved. */
+static char * resolve_many(const struct proc_spec specs[],
+                           struct proc_result results[], size_t offsets[],
+                           unsigned int count)
+{
+    char filename[PATH_MAX + 1];
+    const char *source;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t length;
+    char *names = NULL;
+    char *grown;
+
+    for (unsigned int x = 0; x < count; x++) {
+        offsets[x] = SIZE_MAX;
+        results[x].pid = -1;
+        results[x].error = EINVAL;
+
+        if ((specs[x].argv == NULL) || (specs[x].argv[0] == NULL)) {
+            continue;
         }
 
-        result = waitpid_nointr(process, &status, options);
+        if (specs[x].filename != NULL) {
+            source = specs[x].filename;
+        } else if (path_findprog_cached(specs[x].argv[0], filename,
+                                        sizeof(filename)) == 0) {
+            source = filename;
+        } else {
+            results[x].error = (errno != 0) ? errno : ENOENT;
+            continue;
+        }
 
-        if (result < 0) {
-            return result;
+        length = strlen(source) + 1;
+
+        if ((used + length) > capacity) {
+            capacity = (capacity + length) * 2;
+            grown = realloc(names, capacity);
+
+            if (grown == NULL) {
+                results[x].error = ENOMEM;
+                continue;
+            }
+
+            names = grown;
         }
 
-        if (WIFEXITED(status)) {
-            return WEXITSTATUS(status);
+        memcpy(names + used, source, length);
+        offsets[x] = used;
+        used += length;
+        results[x].error = 0;
+    }
+
+    return names;
+}
+
+unsigned int proc_launch_many(const struct proc_spec specs[],
+                              struct proc_result results[],
+                              unsigned int count)
+{
+    unsigned int failures = 0;
+    size_t *offsets;
+    char *names;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    offsets = malloc(count * sizeof(*offsets));
+
+    if (offsets == NULL) {
+        for (unsigned int x = 0; x < count; x++) {
+            results[x].pid = -1;
+            results[x].error = ENOMEM;
         }
+        return count;
+    }
+
+    names = resolve_many(specs, results, offsets, count);
 
-        kill(process, SIGCONT);
-        sleep_ms(1);
+    for (unsigned int x = 0; x < count; x++) {
+        if (offsets[x] == SIZE_MAX) {
+            failures++;
+            continue;
+        }
+
+        results[x].pid = launch_resolved(names + offsets[x], &specs[x]);
+
+        if (results[x].pid < 0) {
+            results[x].error = errno;
+            failures++;
+        }
     }
-    return -1;
+
+    free(names);
+    free(offsets);
+    return failures;
+}
+
+int8_t proc_polled_wait(pid_t process)
+{
+    int8_t errcode;
+
+    if (proc_wait(process, -1, &errcode) < 0) {
+        fprintf(stderr, "error: couldn't wait on PID [%jd]: %s.\n",
+                (intmax_t) process, strerror(errno));
+        return -1;
+    }
+
+    return errcode;
 }
 
 bool proc_running(pid_t process, int8_t *errcode)
 {
+    struct reap_status exited;
     int status;
     int options = WNOHANG;
+    int result;
+    int error;
+
+    if (reap_fd() >= 0) {
+        result = reap_running(process);
+
+        if (result < 0) {
+            error = errno;
+            perror(NULL);
+            *errcode = -1;
+            errno = error;
+            return false;
+        }
+
+        if (result > 0) {
+            return true;
+        }
 
-    int result = waitpid_nointr(process, &status, options);
+        reap_lookup(process, &exited);
+        *errcode = status_errcode(reaped_status(&exited));
+        return false;
+    }
+
+    result = waitpid_nointr(process, &status, options);
 
     if (result == -1) {
+        error = errno;
         perror(NULL);
         *errcode = -1;
+        errno = error;
         return false;
     }
 
@@ -120,6 +768,309 @@ bool proc_running(pid_t process, int8_t *errcode)
         return true;
     }
 
-    *errcode = (int8_t) (WEXITSTATUS(status));
-    return !(WIFEXITED(status));
+    *errcode = status_errcode(status);
+    return false;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int proc_pidfd_open(pid_t process)
+{
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, process, 0);
+#else
+    (void) process;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int proc_wait(pid_t process, int timeout_ms, int8_t *errcode)
+{
+    int status;
+    int result;
+    int fd;
+
+    if (pidfd_supported() == false) {
+        return sigchld_wait(process, timeout_ms, errcode);
+    }
+
+    fd = proc_pidfd_open(process);
+
+    /* The reaper might already have collected the process. */
+
+    if ((fd < 0) && (errno == ESRCH) && (reap_fd() >= 0)) {
+        return reap(process, WNOHANG, &status, errcode);
+    }
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    result = wait_readable(fd, timeout_ms);
+    close_nointr(fd);
+
+    if (result <= 0) {
+        return result;
+    }
+
+    return reap(process, 0, &status, errcode);
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int waitset_watch(struct proc_waitset *set, unsigned int slot, int op)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u32 = slot
+    };
+
+    return epoll_ctl(set->epoll_fd, op, set->entries[slot].fd, &event);
+}
+
+static void waitset_remove(struct proc_waitset *set, unsigned int slot)
+{
+    unsigned int last = set->count - 1;
+
+    /* The pidfd is removed explicitly, because a forked child that hasn't
+     * exec'd yet can still hold a reference to it. */
+
+    if (set->entries[slot].fd >= 0) {
+        epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, set->entries[slot].fd, NULL);
+        close_nointr(set->entries[slot].fd);
+    }
+
+    set->entries[slot] = set->entries[last];
+    set->count--;
+
+    if ((slot != last) && (set->entries[slot].fd >= 0)) {
+        waitset_watch(set, slot, EPOLL_CTL_MOD);
+    }
+}
+
+static int waitset_grow(struct proc_waitset *set)
+{
+    unsigned int capacity = (set->capacity == 0) ? 16 : set->capacity * 2;
+    struct waitset_entry *entries;
+
+    entries = realloc(set->entries, capacity * sizeof(*entries));
+
+    if (entries == NULL) {
+        return -1;
+    }
+
+    set->entries = entries;
+    set->capacity = capacity;
+    return 0;
+}
+
+/* Fallback for kernels without pidfds: checks every member with WNOHANG.
+ * Walks the set backwards so that waitset_remove() only ever moves entries
+ * that have already been checked. */
+static unsigned int waitset_scan(struct proc_waitset *set,
+                                 struct proc_exit exits[],
+                                 unsigned int maxexits)
+{
+    unsigned int stored = 0;
+    struct proc_exit *target;
+
+    for (unsigned int x = set->count; (x > 0) && (stored < maxexits); x--) {
+        target = &exits[stored];
+
+        if (reap(set->entries[x - 1].pid, WNOHANG, &target->status,
+                 &target->errcode) == 1) {
+            target->pid = set->entries[x - 1].pid;
+            waitset_remove(set, x - 1);
+            stored++;
+        }
+    }
+
+    return stored;
+}
+
+static int waitset_wait_sigchld(struct proc_waitset *set,
+                                struct proc_exit exits[],
+                                unsigned int maxexits, int timeout_ms)
+{
+    struct timespec deadline;
+    int result;
+
+    deadline_set(&deadline, timeout_ms);
+
+    while (1) {
+        result = (int) waitset_scan(set, exits, maxexits);
+
+        if (result != 0) {
+            return result;
+        }
+
+        result = wait_readable(set->sigchld_fd,
+                               deadline_remaining(&deadline, timeout_ms));
+
+        if (result <= 0) {
+            return result;
+        }
+
+        signal_pipefd_drain(SIGCHLD);
+    }
+}
+
+static int waitset_wait_pidfd(struct proc_waitset *set,
+                              struct proc_exit exits[], unsigned int maxexits,
+                              int timeout_ms)
+{
+    struct epoll_event events[waitset_batch];
+    unsigned int slots[waitset_batch];
+    unsigned int slot;
+    int y;
+    int count = (maxexits > waitset_batch) ? waitset_batch : (int) maxexits;
+    int result;
+
+    result = epoll_wait_nointr(set->epoll_fd, events, count, timeout_ms);
+
+    if (result <= 0) {
+        return result;
+    }
+
+    /* Entries are removed in descending index order, so that each removal
+     * only moves an entry that isn't part of this batch. */
+
+    for (int x = 0; x < result; x++) {
+        slot = events[x].data.u32;
+
+        for (y = x; (y > 0) && (slots[y - 1] < slot); y--) {
+            slots[y] = slots[y - 1];
+        }
+        slots[y] = slot;
+    }
+
+    for (int x = 0; x < result; x++) {
+        slot = slots[x];
+        exits[x].pid = set->entries[slot].pid;
+
+        if (reap(exits[x].pid, 0, &exits[x].status, &exits[x].errcode) < 0) {
+            exits[x].status = 0;
+            exits[x].errcode = -1;
+        }
+
+        waitset_remove(set, slot);
+    }
+
+    return result;
+}
+
+struct proc_waitset * proc_waitset_create(void)
+{
+    struct epoll_event event = {.events = EPOLLIN};
+    struct proc_waitset *set = calloc(1, sizeof(*set));
+
+    if (set == NULL) {
+        return NULL;
+    }
+
+    set->sigchld_fd = -1;
+    set->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (set->epoll_fd < 0) {
+        free(set);
+        return NULL;
+    }
+
+    if (pidfd_supported() == false) {
+        set->sigchld_fd = signal_pipefd_connect(SIGCHLD);
+
+        if ((set->sigchld_fd < 0) ||
+            (epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, set->sigchld_fd,
+                       &event) != 0)) {
+            close_nointr(set->epoll_fd);
+            free(set);
+            return NULL;
+        }
+    }
+
+    return set;
+}
+
+void proc_waitset_destroy(struct proc_waitset *set)
+{
+    if (set == NULL) {
+        return;
+    }
+
+    for (unsigned int x = 0; x < set->count; x++) {
+        if (set->entries[x].fd >= 0) {
+            close_nointr(set->entries[x].fd);
+        }
+    }
+
+    close_nointr(set->epoll_fd);
+    free(set->entries);
+    free(set);
+}
+
+int proc_waitset_add(struct proc_waitset *set, pid_t process)
+{
+    struct waitset_entry *entry;
+    int fd = -1;
+
+    if (set->count == set->capacity) {
+        if (waitset_grow(set) != 0) {
+            return -1;
+        }
+    }
+
+    if (set->sigchld_fd < 0) {
+        fd = proc_pidfd_open(process);
+
+        /* If the reaper has already collected the process, there's nothing
+         * left to open a pidfd for. An eventfd that's always readable
+         * stands in for it, so that the exit is still reported through the
+         * epoll set. */
+
+        if ((fd < 0) && (errno == ESRCH) &&
+            (reap_lookup(process, NULL) == 1)) {
+            fd = eventfd(1, EFD_CLOEXEC);
+        }
+
+        if (fd < 0) {
+            return -1;
+        }
+    }
+
+    entry = &set->entries[set->count];
+    entry->pid = process;
+    entry->fd = fd;
+
+    if ((fd >= 0) && (waitset_watch(set, set->count, EPOLL_CTL_ADD) != 0)) {
+        close_nointr(fd);
+        return -1;
+    }
+
+    set->count++;
+    return 0;
+}
+
+unsigned int proc_waitset_count(const struct proc_waitset *set)
+{
+    return set->count;
+}
+
+int proc_waitset_fd(const struct proc_waitset *set)
+{
+    return set->epoll_fd;
+}
+
+int proc_waitset_wait(struct proc_waitset *set, struct proc_exit exits[],
+                      unsigned int maxexits, int timeout_ms)
+{
+    if (maxexits == 0) {
+        return 0;
+    }
+
+    if (set->sigchld_fd >= 0) {
+        return waitset_wait_sigchld(set, exits, maxexits, timeout_ms);
+    }
+
+    return waitset_wait_pidfd(set, exits, maxexits, timeout_ms);
 }
@@ -5,11 +5,172 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+/* Backends for proc_launch(). proc_backend_fork runs fork() and execve().
+ * proc_backend_spawn uses posix_spawn(), which doesn't copy the caller's
+ * page tables, so its cost doesn't grow with the size of the caller.
+ * proc_backend_zygote hands launches to the helper process started by
+ * zygote_start() (see libzygote.h). */
+
+typedef enum proc_backend_t {
+    proc_backend_fork = 0,
+    proc_backend_spawn = 1,
+    proc_backend_zygote = 2
+} proc_backend_t;
+
+/* Selects the backend used by later calls to proc_launch(). Returns 0 on a
+ * success, or -1 if the backend isn't recognized (or if the zygote backend
+ * is selected before zygote_start()). */
+
+int proc_set_backend(proc_backend_t backend);
+proc_backend_t proc_get_backend(void);
+
+/* Launches argv[0] (searched for in $PATH) with the given descriptors as its
+ * stdin/stdout/stderr. Returns once the new program has been exec'd, with
+ * its PID. If it can't be exec'd, the child is reaped and -1 is returned
+ * with errno set to the reason, so that a bad executable can't be mistaken
+ * for a program that crashed.
+ *
+ * Every other descriptor is closed in the new program, whether or not it was
+ * opened with O_CLOEXEC. */
+
 pid_t proc_launch(char *const argv[], int stdin_fd, int stdout_fd,
                   int stderr_fd);
 
+/* A launch request. The 'keep_count' descriptors listed in 'keep_fds' are
+ * inherited by the new program under the same numbers, in addition to
+ * stdin/stdout/stderr. Entries of 2 or less are ignored.
+ *
+ * If 'filename' is set, it's exec'd as-is instead of searching $PATH for
+ * argv[0]. If 'envp' is set, it's used instead of 'environ'. */
+
+struct proc_spec {
+    char *const *argv;
+    int stdin_fd;
+    int stdout_fd;
+    int stderr_fd;
+    const int *keep_fds;
+    unsigned int keep_count;
+    const char *filename;
+    char *const *envp;
+};
+
+/* Same as proc_launch(), but takes a proc_spec. */
+
+pid_t proc_launch_spec(const struct proc_spec *spec);
+
+struct proc_result {
+    pid_t pid;
+    int error;
+};
+
+/* Launches 'count' processes in one go. Every executable is resolved before
+ * anything is started, then the processes are launched back to back. Nothing
+ * is printed: each entry in 'results' gets either the new PID (with 'error'
+ * set to 0), or a PID of -1 and the errno value that caused the failure.
+ *
+ * Returns the number of entries that failed to launch. */
+
+unsigned int proc_launch_many(const struct proc_spec specs[],
+                              struct proc_result results[],
+                              unsigned int count);
+
+/*----------------------------------------------------------------------------*/
+
+/* Helpers for launch backends. proc_child_exec() runs in a freshly-forked
+ * child: it connects fds[0..2] to stdin/stdout/stderr, marks every other
+ * descriptor except the 'keep_count' entries in 'keep_fds' as close-on-exec,
+ * and execs 'filename'. If that fails, the errno value is written to
+ * 'error_fd' (which should be the write end of an O_CLOEXEC pipe) and the
+ * child exits.
+ *
+ * proc_exec_status() reads the other end of that pipe (and closes it). It
+ * returns 0 once the exec succeeds, or the errno value that the child sent.
+ * proc_await_exec() does the same, and also reaps the child on a failure.
+ * It returns the child's PID, or -1 with errno set. */
+
+_Noreturn void proc_child_exec(const char *filename, char *const argv[],
+                               char *const envp[], const int fds[3],
+                               const int keep_fds[], unsigned int keep_count,
+                               int error_fd);
+
+int proc_exec_status(int error_fd);
+pid_t proc_await_exec(pid_t child, int error_fd);
+
+/*----------------------------------------------------------------------------*/
+
+/* Blocks until 'process' exits, and returns its exit code. Returns -1 if the
+ * process couldn't be waited on, or if it was killed by a signal. */
+
 int8_t proc_polled_wait(pid_t process);
 
+/* Returns true while 'process' is still running. Once it has exited, returns
+ * false and stores its exit code in *errcode (-1 if it was killed by a
+ * signal). If the libreap reaper is active, the answer comes from its table
+ * without any syscalls, so 'process' has to be one that proc_launch_spec() or
+ * zygote_launch() started (or that was passed to reap_expect()); use
+ * reap_forget() once the exit is handled. Also returns false (with *errcode
+ * set to -1 and errno set to ECHILD) if 'process' isn't a child of this
+ * process. */
+
 bool proc_running(pid_t process, int8_t *errcode);
 
+/*----------------------------------------------------------------------------*/
+
+/* Opens a pidfd for 'process'. The descriptor becomes readable when the
+ * process exits. Returns -1 with errno set to ENOSYS if the running kernel
+ * doesn't support pidfds (Linux < 5.3). */
+
+int proc_pidfd_open(pid_t process);
+
+/* Blocks until 'process' exits or until 'timeout_ms' milliseconds have passed
+ * (-1 waits forever). Uses a pidfd when available, and falls back to the
+ * libsignal SIGCHLD pipe otherwise. If the libreap reaper is active, the exit
+ * is taken from (and removed from) its table. The waitset below works the
+ * same way.
+ *
+ * Returns 1 if the process exited (and stores its exit code in *errcode, or
+ * -1 if it was killed by a signal), 0 on a timeout, or -1 on an error. */
+
+int proc_wait(pid_t process, int timeout_ms, int8_t *errcode);
+
+/*----------------------------------------------------------------------------*/
+
+/* A proc_waitset lets one thread wait on any number of child processes at
+ * once. Each exit costs one wakeup; nothing is polled while waiting. */
+
+struct proc_waitset;
+
+struct proc_exit {
+    pid_t pid;
+    int status;
+    int8_t errcode;
+};
+
+struct proc_waitset * proc_waitset_create(void);
+void proc_waitset_destroy(struct proc_waitset *set);
+
+/* Adds a child process to the set. Returns 0 on a success, -1 otherwise. */
+
+int proc_waitset_add(struct proc_waitset *set, pid_t process);
+
+/* Returns the number of processes in the set that haven't been reported as
+ * exited yet. */
+
+unsigned int proc_waitset_count(const struct proc_waitset *set);
+
+/* Returns a descriptor that becomes readable when proc_waitset_wait() has
+ * something to report, for use with poll() or an outer event loop. */
+
+int proc_waitset_fd(const struct proc_waitset *set);
+
+/* Reaps up to 'maxexits' exited processes from the set into 'exits', waiting
+ * up to 'timeout_ms' milliseconds for the first one (-1 waits forever, 0
+ * doesn't block). Reported processes are removed from the set.
+ *
+ * Returns the number of entries stored in 'exits' (0 on a timeout), or -1 in
+ * the event of an error. */
+
+int proc_waitset_wait(struct proc_waitset *set, struct proc_exit exits[],
+                      unsigned int maxexits, int timeout_ms);
+
 #endif
@@ -0,0 +1,329 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libnointr.h"
+#include "libreap.h"
+#include "libsignal.h"
+
+/*----------------------------------------------------------------------------*/
+
+/* Exit records live in an open-addressed table with linear probing. A PID
+ * of 0 marks an empty slot. The table is kept at most half full, and removals
+ * shift later entries back instead of leaving tombstones. Children that have
+ * been launched but haven't exited yet have a record with a 'code' of
+ * reap_code_running (0, which waitid() never reports as an si_code). */
+
+enum {reap_min_capacity = 64};
+enum {reap_code_running = 0};
+
+static struct reap_status *table = NULL;
+static size_t capacity = 0;
+static size_t used = 0;
+static int sigchld_fd = -1;
+
+/*----------------------------------------------------------------------------*/
+
+static size_t slot_hash(pid_t pid, size_t size)
+{
+    uint32_t result = (uint32_t) pid * 2654435761U;
+    return result & (size - 1);
+}
+
+static size_t slot_find(pid_t pid)
+{
+    size_t x = slot_hash(pid, capacity);
+
+    while ((table[x].pid != 0) && (table[x].pid != pid)) {
+        x = (x + 1) & (capacity - 1);
+    }
+
+    return x;
+}
+
+static int table_resize(size_t size)
+{
+    struct reap_status *old_table = table;
+    size_t old_capacity = capacity;
+    size_t x;
+
+    table = calloc(size, sizeof(*table));
+
+    if (table == NULL) {
+        table = old_table;
+        return -1;
+    }
+
+    capacity = size;
+
+    for (size_t y = 0; y < old_capacity; y++) {
+        if (old_table[y].pid != 0) {
+            x = slot_find(old_table[y].pid);
+            table[x] = old_table[y];
+        }
+    }
+
+    free(old_table);
+    return 0;
+}
+
+static int table_insert(const struct reap_status *entry)
+{
+    size_t x;
+
+    if (((used + 1) * 2) > capacity) {
+        if (table_resize(capacity * 2) != 0) {
+            return -1;
+        }
+    }
+
+    x = slot_find(entry->pid);
+
+    if (table[x].pid == 0) {
+        used++;
+    }
+
+    table[x] = *entry;
+    return 0;
+}
+
+static void table_remove(size_t x)
+{
+    size_t mask = capacity - 1;
+    size_t y = x;
+    size_t home;
+
+    while (1) {
+        y = (y + 1) & mask;
+
+        if (table[y].pid == 0) {
+            break;
+        }
+
+        /* The entry at 'y' can stay put if its home slot lies cyclically
+         * within (x, y]. Otherwise it moves back into the hole at 'x'. */
+
+        home = slot_hash(table[y].pid, capacity);
+
+        if ((x < y) ? ((x < home) && (home <= y)) :
+                      ((x < home) || (home <= y))) {
+            continue;
+        }
+
+        table[x] = table[y];
+        x = y;
+    }
+
+    table[x].pid = 0;
+    used--;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int reap_init(void)
+{
+    if (sigchld_fd >= 0) {
+        return sigchld_fd;
+    }
+
+    if (table_resize(reap_min_capacity) != 0) {
+        perror("couldn't allocate reaper table");
+        return -1;
+    }
+
+    sigchld_fd = signal_pipefd_connect(SIGCHLD);
+
+    if (sigchld_fd < 0) {
+        reap_cleanup();
+        return -1;
+    }
+
+    /* Children that exited before SIGCHLD was connected didn't leave
+     * anything in the pipe, so collect them now. */
+
+    if (reap_collect() < 0) {
+        reap_cleanup();
+        return -1;
+    }
+
+    return sigchld_fd;
+}
+
+int reap_fd(void)
+{
+    return sigchld_fd;
+}
+
+int reap_collect(void)
+{
+    struct reap_status entry;
+    siginfo_t info;
+    int count = 0;
+
+    if (sigchld_fd < 0) {
+        return -1;
+    }
+
+    if (signal_pipefd_drain(SIGCHLD) < 0) {
+        return -1;
+    }
+
+    while (1) {
+        memset(&info, 0, sizeof(info));
+
+        if (waitid_nointr(P_ALL, 0, &info, WEXITED | WNOHANG) != 0) {
+            if (errno == ECHILD) {
+                break;
+            }
+
+            perror("waitid failed");
+            return -1;
+        }
+
+        if (info.si_pid == 0) {
+            break;
+        }
+
+        entry.pid = info.si_pid;
+        entry.code = info.si_code;
+        entry.status = info.si_status;
+
+        if (table_insert(&entry) != 0) {
+            perror("couldn't grow reaper table");
+            return -1;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+int reap_expect(pid_t process)
+{
+    struct reap_status entry = {.pid = process, .code = reap_code_running};
+
+    if ((table == NULL) || (process <= 0)) {
+        return 0;
+    }
+
+    /* Nothing collects exits between the launch and this call, so a record
+     * that's already there belongs to an earlier process with the same PID
+     * that nobody took. */
+
+    if (table_insert(&entry) != 0) {
+        perror("couldn't grow reaper table");
+        return -1;
+    }
+
+    return 0;
+}
+
+int reap_lookup(pid_t process, struct reap_status *result)
+{
+    size_t x;
+
+    if ((table == NULL) || (process <= 0)) {
+        return 0;
+    }
+
+    x = slot_find(process);
+
+    if ((table[x].pid == 0) || (table[x].code == reap_code_running)) {
+        return 0;
+    }
+
+    if (result != NULL) {
+        *result = table[x];
+    }
+
+    return 1;
+}
+
+int reap_take(pid_t process, int options, struct reap_status *result)
+{
+    siginfo_t info;
+
+    if (sigchld_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (1) {
+        if (reap_collect() < 0) {
+            return -1;
+        }
+
+        if (reap_lookup(process, result) == 1) {
+            reap_forget(process);
+            return 1;
+        }
+
+        /* WNOWAIT leaves the child for reap_collect(), and fails with
+         * ECHILD if 'process' isn't a child at all. */
+
+        memset(&info, 0, sizeof(info));
+
+        if (waitid_nointr(P_PID, (id_t) process, &info,
+                          WEXITED | WNOWAIT | options) != 0) {
+            return -1;
+        }
+
+        if (info.si_pid == 0) {
+            return 0;
+        }
+    }
+}
+
+int reap_running(pid_t process)
+{
+    size_t x;
+
+    if ((table == NULL) || (process <= 0)) {
+        errno = ECHILD;
+        return -1;
+    }
+
+    x = slot_find(process);
+
+    if (table[x].pid == 0) {
+        errno = ECHILD;
+        return -1;
+    }
+
+    return (table[x].code == reap_code_running) ? 1 : 0;
+}
+
+int reap_forget(pid_t process)
+{
+    size_t x;
+
+    if ((table == NULL) || (process <= 0)) {
+        return -1;
+    }
+
+    x = slot_find(process);
+
+    if (table[x].pid == 0) {
+        return -1;
+    }
+
+    table_remove(x);
+    return 0;
+}
+
+void reap_cleanup(void)
+{
+    free(table);
+    table = NULL;
+    capacity = 0;
+    used = 0;
+    sigchld_fd = -1;
+}
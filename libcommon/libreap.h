@@ -0,0 +1,80 @@
+#ifndef _LIBREAP_H_
+#define _LIBREAP_H_
+
+#include <sys/types.h>
+
+/* Central child reaper, built on the libsignal SIGCHLD pipe. Each call to
+ * reap_collect() reaps every child that has exited since the last call (with
+ * one waitid(P_ALL) loop) and records the results in a pid-indexed table.
+ * reap_lookup() then answers from that table in O(1), without any syscalls.
+ *
+ * The reaper collects *every* child of the process, so children mustn't also
+ * be waited on with waitpid() while it's active. The libproc, libzygote and
+ * libevloop wait functions check for the reaper and take their exits from
+ * its table instead (with reap_take()). */
+
+struct reap_status {
+    pid_t pid;
+    int code;
+    int status;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Connects SIGCHLD and starts recording exits. Returns the descriptor that
+ * becomes readable when there's something to collect (see reap_fd()), or -1
+ * in the event of an error. */
+
+int reap_init(void);
+
+/* Returns the descriptor to watch for pending exits, or -1 if the reaper
+ * isn't initialized. */
+
+int reap_fd(void);
+
+/* Reaps every exited child and records it. Returns the number of children
+ * reaped, or -1 in the event of an error. */
+
+int reap_collect(void);
+
+/* Records 'process' as a running child, so that reap_running() knows about
+ * it. proc_launch_spec() and zygote_launch() call this for every process they
+ * start while the reaper is active; children started any other way (or before
+ * reap_init()) need it called by hand. Returns 0 on success (or if the reaper
+ * isn't active), or -1 in the event of an error. */
+
+int reap_expect(pid_t process);
+
+/* Looks up the recorded exit for 'process'. Returns 1 (and fills in *result
+ * if it isn't NULL) if the process has exited, or 0 if no exit has been
+ * recorded. 'code' is the waitid() si_code (CLD_EXITED, CLD_KILLED or
+ * CLD_DUMPED), and 'status' is the exit status or signal number. */
+
+int reap_lookup(pid_t process, struct reap_status *result);
+
+/* Collects pending exits and takes the one for 'process', removing its
+ * record. With WNOHANG in 'options', returns 0 right away if the process is
+ * still running; otherwise waits for it to exit. Returns 1 (and fills in
+ * *result if it isn't NULL) once it has exited, or -1 in the event of an
+ * error (errno is ECHILD if 'process' isn't a child of this process). */
+
+int reap_take(pid_t process, int options, struct reap_status *result);
+
+/* Returns 1 if 'process' was recorded with reap_expect() and hasn't been
+ * collected yet, 0 if its exit is in the table, or -1 (with errno set to
+ * ECHILD) if the table doesn't know it. Like reap_lookup(), this answers from
+ * the table alone, without any syscalls. */
+
+int reap_running(pid_t process);
+
+/* Removes the record for 'process', whether it's an exit or a running
+ * child. Returns 0 if there was one to remove, or -1 otherwise. */
+
+int reap_forget(pid_t process);
+
+/* Drops every record and stops reaping. SIGCHLD stays connected to its
+ * pipe. */
+
+void reap_cleanup(void);
+
+#endif
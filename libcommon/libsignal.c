@@ -2,10 +2,15 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libnointr.h"
@@ -13,22 +18,111 @@
 
 /*----------------------------------------------------------------------------*/
 
-enum {max_signum = 31};
+/* Signal numbers are used as array indexes, so 'max_signum' has to be a
+ * constant. SIGRTMIN and SIGRTMAX are run-time values (the C library keeps
+ * the first few real-time signals for itself), so they're checked again in
+ * signum_valid(). */
+
+enum {
+    max_standard_signum = 31,
+    max_signum = NSIG - 1,
+    read_batch = 16,
+    ring_size = 256
+};
 
 static int pipe_set[max_signum + 1][2];
 static bool initialized = false;
+static signal_backend_t backend = signal_backend_pipe;
+
+/* State for the pipe backend. The handler counts each delivery in
+ * 'delivered' and the consumer counts what it has taken in 'consumed', so
+ * the difference is what's pending. The handler only writes to a signal's
+ * pipe when that signal goes from nothing pending to something pending, so
+ * a burst of deliveries costs one wakeup, and the pipe can't fill up and
+ * lose signals.
+ *
+ * The handler also puts each delivery's siginfo in 'ring', a lock-free
+ * bounded queue (shared by all signals) in which each slot's sequence number
+ * says whether it's free or filled. When the ring is full, the record is
+ * dropped (and counted in 'dropped'), but the delivery is still counted.
+ * 'seq' is the delivery's position in its signal's count, which tells the
+ * consumer whether a record has already been accounted for. */
+
+struct ring_record {
+    int signum;
+    int code;
+    pid_t pid;
+    uid_t uid;
+    int status;
+    int value;
+    unsigned int seq;
+};
+
+struct ring_slot {
+    atomic_uint sequence;
+    struct ring_record record;
+};
+
+static atomic_uint delivered[max_signum + 1];
+static atomic_uint consumed[max_signum + 1];
+static atomic_uint dropped[max_signum + 1];
+static struct ring_slot ring[ring_size];
+static atomic_uint ring_head;
+static unsigned int ring_tail;
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2,
+               "the signal handler needs lock-free atomics");
+
+_Static_assert((ring_size & (ring_size - 1)) == 0,
+               "ring_size must be a power of two");
+
+/* State for the signalfd backend. 'connected' holds every signal that's been
+ * connected, and 'blocked' the ones among them that weren't already blocked
+ * by the caller (so cleanup knows which ones to unblock). */
+
+static int signal_fd = -1;
+static sigset_t connected;
+static sigset_t blocked;
 
 /*----------------------------------------------------------------------------*/
 
-typedef void (*handler_t)(int signum);
+/* Accepts the standard signals and SIGRTMIN through SIGRTMAX. */
+static bool signum_valid(int signum)
+{
+    if ((signum < 1) || (signum > max_signum) || (signum > SIGRTMAX)) {
+        return false;
+    }
+
+    return (signum <= max_standard_signum) || (signum >= SIGRTMIN);
+}
+
+static bool check_signum(int signum)
+{
+    if (signum_valid(signum) == false) {
+        fprintf(stderr, "Requested signal [%d] is out of range!\n", signum);
+        return false;
+    }
+
+    return true;
+}
+
+/* sigqueue(), POSIX timers and message queues all attach a value to the
+ * signal. For other senders si_value overlaps unrelated fields. */
+static int payload_value(int code, int value)
+{
+    return ((code == SI_QUEUE) || (code == SI_TIMER) || (code == SI_MESGQ)) ?
+           value : 0;
+}
+
+typedef void (*handler_t)(int signum, siginfo_t *info, void *context);
 
 static int register_handler(handler_t handler, int signum, bool block_others)
 {
     int result;
 
     struct sigaction action = {
-        .sa_handler = handler,
-        .sa_flags = SA_RESTART
+        .sa_sigaction = handler,
+        .sa_flags = SA_RESTART | SA_SIGINFO
     };
 
     if (block_others) {
@@ -36,7 +130,7 @@ static int register_handler(handler_t handler, int signum, bool block_others)
     } else {
         sigemptyset(&action.sa_mask);
     }
-    action.sa_flags = SA_RESTART;
+
     result = sigaction(signum, &action, NULL);
 
     if (result != 0) {
@@ -79,33 +173,41 @@ static int fd_set_fdflags(int fd, int flags)
  * ready for reading. */
 static int fd_check_ready(int fd)
 {
-    fd_set read_fds;
-    fd_set error_fds;
-    struct timeval timeout = {0};
-
-    FD_ZERO(&read_fds);
-    FD_ZERO(&error_fds);
-    FD_SET(fd, &read_fds);
-    FD_SET(fd, &error_fds);
+    struct pollfd target = {
+        .fd = fd,
+        .events = POLLIN
+    };
 
-    int result = select_nointr(fd + 1, &read_fds, NULL, &error_fds, &timeout);
+    int result = poll_nointr(&target, 1, 0);
 
     if (result < 0) {
-        perror("select call failed");
+        perror("poll call failed");
         return result;
     }
 
-    /* We might normally use FD_ISSET here, but this isn't necessary
-     * because we're only listening for one item (the socket). */
-
     return (result == 0) ? 0 : 1;
 }
 
 static void pipe_set_init(void)
 {
     initialized = true;
+    sigemptyset(&connected);
+    sigemptyset(&blocked);
+
+    for (unsigned int x = 0; x <= max_signum; x++) {
+        atomic_store(&delivered[x], 0);
+        atomic_store(&consumed[x], 0);
+        atomic_store(&dropped[x], 0);
+    }
 
-    for (unsigned int x = 0; x < max_signum; x++) {
+    for (unsigned int x = 0; x < ring_size; x++) {
+        atomic_store(&ring[x].sequence, x);
+    }
+
+    atomic_store(&ring_head, 0);
+    ring_tail = 0;
+
+    for (unsigned int x = 0; x <= max_signum; x++) {
         pipe_set[x][0] = -1;
         pipe_set[x][1] = -1;
     }
@@ -113,23 +215,534 @@ static void pipe_set_init(void)
 
 /*----------------------------------------------------------------------------*/
 
-static void pipefd_handler(int signum)
+/* Called from the signal handler, possibly on several threads at once. */
+static void ring_push(int signum, const siginfo_t *info, unsigned int seq)
+{
+    unsigned int pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    struct ring_slot *slot;
+    int diff;
+
+    while (1) {
+        slot = &ring[pos % ring_size];
+        diff = (int)(atomic_load_explicit(&slot->sequence,
+                                          memory_order_acquire) - pos);
+
+        if (diff < 0) {
+            atomic_fetch_add(&dropped[signum], 1);
+            return;
+        }
+
+        if ((diff == 0) &&
+            atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+
+        if (diff > 0) {
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+
+    slot->record.signum = signum;
+    slot->record.code = info->si_code;
+    slot->record.pid = info->si_pid;
+    slot->record.uid = info->si_uid;
+    slot->record.status = (signum == SIGCHLD) ? info->si_status : 0;
+    slot->record.value = payload_value(info->si_code,
+                                       info->si_value.sival_int);
+    slot->record.seq = seq;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+/* Returns the oldest record in the ring, or NULL if it's empty. Only the
+ * consumer calls this (and ring_pop()). */
+static struct ring_record * ring_peek(void)
+{
+    struct ring_slot *slot = &ring[ring_tail % ring_size];
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) !=
+        (ring_tail + 1)) {
+        return NULL;
+    }
+
+    return &slot->record;
+}
+
+static void ring_pop(void)
+{
+    struct ring_slot *slot = &ring[ring_tail % ring_size];
+
+    atomic_store_explicit(&slot->sequence, ring_tail + ring_size,
+                          memory_order_release);
+    ring_tail++;
+}
+
+/* Returns true if the record's delivery has already been taken. */
+static bool ring_stale(const struct ring_record *record)
+{
+    return (int)(record->seq - atomic_load(&consumed[record->signum])) < 0;
+}
+
+/* Throws away the records of deliveries that have already been taken,
+ * wherever they are in the ring, so that a signal that's only ever drained
+ * or cleared (SIGCHLD, with libreap) can't fill the ring up and cost the
+ * other signals their siginfo. The records that are left keep their order
+ * and move to the back of the filled part of the ring, which only the
+ * consumer touches, and the slots that are freed at the front are popped. */
+static void ring_discard_stale(void)
+{
+    unsigned int end = ring_tail;
+    unsigned int keep;
+    struct ring_record *record;
+
+    while (atomic_load_explicit(&ring[end % ring_size].sequence,
+                                memory_order_acquire) == (end + 1)) {
+        end++;
+    }
+
+    keep = end;
+
+    for (unsigned int pos = end; pos != ring_tail; pos--) {
+        record = &ring[(pos - 1) % ring_size].record;
+
+        if (ring_stale(record)) {
+            continue;
+        }
+
+        keep--;
+
+        if (keep != (pos - 1)) {
+            ring[keep % ring_size].record = *record;
+        }
+    }
+
+    while (ring_tail != keep) {
+        ring_pop();
+    }
+}
+
+static void pipefd_handler(int signum, siginfo_t *info, void *context)
+{
+    int saved_errno = errno;
+    unsigned int seq = atomic_fetch_add(&delivered[signum], 1);
+
+    (void) context;
+    ring_push(signum, info, seq);
+
+    if (seq == atomic_load(&consumed[signum])) {
+        write_nointr(pipe_set[signum][1], "\x00", 1);
+    }
+
+    errno = saved_errno;
+}
+
+static unsigned int pipefd_pending(int signum)
+{
+    return atomic_load(&delivered[signum]) - atomic_load(&consumed[signum]);
+}
+
+/* Empties a signal's pipe without blocking. */
+static int pipefd_empty(int signum)
+{
+    char buffer[64];
+    ssize_t result;
+
+    while ((result = fd_check_ready(pipe_set[signum][0])) > 0) {
+        result = read_nointr(pipe_set[signum][0], buffer, sizeof(buffer));
+
+        if (result < 0) {
+            perror("read from pipe failed");
+            return -1;
+        }
+    }
+
+    return (int) result;
+}
+
+/* Marks 'count' more deliveries as taken. The pipe should be emptied first.
+ * If anything is still pending afterwards (including deliveries that raced
+ * with this), a byte is put back so that the descriptor stays readable. */
+static void pipefd_consume(int signum, unsigned int count)
+{
+    unsigned int taken = atomic_load(&consumed[signum]) + count;
+
+    atomic_store(&consumed[signum], taken);
+
+    if (atomic_load(&delivered[signum]) != taken) {
+        write_nointr(pipe_set[signum][1], "\x00", 1);
+    }
+}
+
+static int pipefd_clear(int signum)
+{
+    if (pipefd_empty(signum) < 0) {
+        return -1;
+    }
+
+    if (pipefd_pending(signum) == 0) {
+        fprintf(stderr, "warning: tried to clear empty signal\n");
+        return -1;
+    }
+
+    pipefd_consume(signum, 1);
+    ring_discard_stale();
+    return 0;
+}
+
+static int pipefd_drain(int signum)
+{
+    unsigned int count;
+
+    if (pipefd_empty(signum) < 0) {
+        return -1;
+    }
+
+    count = pipefd_pending(signum);
+    pipefd_consume(signum, count);
+    ring_discard_stale();
+    return (int) count;
+}
+
+static int pipefd_wait(int signum)
+{
+    char dummy_buffer;
+    ssize_t result;
+
+    while (pipefd_pending(signum) == 0) {
+        result = read_nointr(pipe_set[signum][0], &dummy_buffer, 1);
+
+        if (result < 0) {
+            perror("read from pipe failed");
+            return -1;
+        }
+
+        if (result == 0) {
+            fprintf(stderr, "warning: read from pipefd was empty\n");
+            return -1;
+        }
+    }
+
+    return pipefd_clear(signum);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* The signalfd backend. Connected signals are blocked, and one signalfd
+ * watches all of them. The signalfd is only used to wait for (and to batch
+ * up) deliveries; the functions that deal with a single signal take it
+ * straight out of the pending set with sigtimedwait(), so that other
+ * signals sharing the descriptor are left alone. */
+
+static int sigfd_connect(int signum)
+{
+    sigset_t one;
+    sigset_t previous;
+    int fd;
+
+    if (sigismember(&connected, signum) == 1) {
+        return signal_fd;
+    }
+
+    sigemptyset(&one);
+    sigaddset(&one, signum);
+
+    if (pthread_sigmask(SIG_BLOCK, &one, &previous) != 0) {
+        perror("Couldn't block signal");
+        return -1;
+    }
+
+    if (sigismember(&previous, signum) == 0) {
+        sigaddset(&blocked, signum);
+    }
+
+    sigaddset(&connected, signum);
+    fd = signalfd(signal_fd, &connected, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (fd < 0) {
+        perror("Couldn't update signalfd");
+        sigdelset(&connected, signum);
+        return -1;
+    }
+
+    signal_fd = fd;
+    return signal_fd;
+}
+
+static int sigfd_take(int signum)
+{
+    struct timespec no_wait = {0};
+    sigset_t one;
+    int result;
+
+    sigemptyset(&one);
+    sigaddset(&one, signum);
+
+    do {
+        result = sigtimedwait(&one, NULL, &no_wait);
+    } while ((result < 0) && (errno == EINTR));
+
+    if ((result < 0) && (errno == EAGAIN)) {
+        return 0;
+    }
+
+    return (result < 0) ? -1 : 1;
+}
+
+static int sigfd_check(int signum)
+{
+    sigset_t pending;
+
+    if (sigpending(&pending) != 0) {
+        perror("sigpending call failed");
+        return -1;
+    }
+
+    return (sigismember(&pending, signum) == 1) ? 1 : 0;
+}
+
+static int sigfd_clear(int signum)
+{
+    int result = sigfd_take(signum);
+
+    if (result < 0) {
+        perror("sigtimedwait call failed");
+        return -1;
+    }
+
+    if (result == 0) {
+        fprintf(stderr, "warning: tried to clear empty signal\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int sigfd_drain(int signum)
 {
-    if (write_nointr(pipe_set[signum][1], "\x00", 1) < 0) {
-        if (errno != EAGAIN) {
-            perror("Couldn't write to notification pipe");
+    int count = 0;
+    int result;
+
+    while ((result = sigfd_take(signum)) > 0) {
+        count++;
+    }
+
+    return (result < 0) ? -1 : count;
+}
+
+static int sigfd_wait(int signum)
+{
+    sigset_t one;
+    int result;
+
+    sigemptyset(&one);
+    sigaddset(&one, signum);
+
+    do {
+        result = sigwaitinfo(&one, NULL);
+    } while ((result < 0) && (errno == EINTR));
+
+    if (result < 0) {
+        perror("sigwaitinfo call failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int sigfd_read(struct signal_info info[], unsigned int max)
+{
+    struct signalfd_siginfo records[read_batch];
+    unsigned int want;
+    unsigned int got;
+    unsigned int count = 0;
+    ssize_t result;
+
+    while (count < max) {
+        want = ((max - count) < read_batch) ? (max - count) : read_batch;
+        result = read_nointr(signal_fd, records, want * sizeof(records[0]));
+
+        if ((result < 0) && (errno == EAGAIN)) {
+            break;
+        }
+
+        if (result < 0) {
+            perror("read from signalfd failed");
+            return -1;
+        }
+
+        got = (unsigned int)((size_t) result / sizeof(records[0]));
+
+        for (unsigned int x = 0; x < got; x++) {
+            info[count].signum = (int) records[x].ssi_signo;
+            info[count].code = records[x].ssi_code;
+            info[count].pid = (pid_t) records[x].ssi_pid;
+            info[count].uid = (uid_t) records[x].ssi_uid;
+            info[count].status = records[x].ssi_status;
+            info[count].value = payload_value(records[x].ssi_code,
+                                              records[x].ssi_int);
+            count++;
+        }
+
+        if (got < want) {
+            break;
+        }
+    }
+
+    return (int) count;
+}
+
+/* Throws away anything still pending (so that unblocking doesn't run the
+ * default actions), then puts the caller's signal mask back. */
+static int sigfd_cleanup(void)
+{
+    for (int signum = 1; signum <= max_signum; signum++) {
+        if (sigismember(&blocked, signum) == 1) {
+            sigfd_drain(signum);
+        }
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &blocked, NULL);
+    sigemptyset(&connected);
+    sigemptyset(&blocked);
+
+    if ((signal_fd != -1) && (close_nointr(signal_fd) != 0)) {
+        perror("couldn't close signalfd");
+        return -1;
+    }
+
+    signal_fd = -1;
+    return 0;
+}
+
+/* The pipe backend's version of signal_pipefd_read(). Records come out of
+ * the ring in delivery order. A record for a delivery that was already
+ * taken (by signal_pipefd_clear(), for instance) is thrown away, and one for
+ * a delivery that arrived after the pending counts were taken is left for
+ * the next call (along with everything behind it). Once the ring is empty,
+ * deliveries whose records were dropped are reported with just their signal
+ * number. Other deliveries without a record are left pending, since their
+ * handler is still running on another thread. */
+static int pipefd_read(struct signal_info info[], unsigned int max)
+{
+    unsigned int pending[max_signum + 1] = {0};
+    unsigned int taken[max_signum + 1] = {0};
+    struct ring_record *record = NULL;
+    unsigned int count = 0;
+    unsigned int offset;
+    int signum;
+
+    for (signum = 1; signum <= max_signum; signum++) {
+        if (pipe_set[signum][0] != -1) {
+            if (pipefd_empty(signum) < 0) {
+                return -1;
+            }
+
+            pending[signum] = pipefd_pending(signum);
+        }
+    }
+
+    while ((count < max) && ((record = ring_peek()) != NULL)) {
+        signum = record->signum;
+        offset = record->seq - atomic_load(&consumed[signum]);
+
+        if ((offset >= pending[signum]) && ((int) offset >= 0)) {
+            break;
+        }
+
+        if (((int) offset >= 0) && (taken[signum] < pending[signum])) {
+            info[count].signum = signum;
+            info[count].code = record->code;
+            info[count].pid = record->pid;
+            info[count].uid = record->uid;
+            info[count].status = record->status;
+            info[count].value = record->value;
+            taken[signum]++;
+            count++;
+        }
+
+        ring_pop();
+    }
+
+    for (signum = 1; signum <= max_signum; signum++) {
+        while ((record == NULL) && (count < max) &&
+               (taken[signum] < pending[signum]) &&
+               (atomic_load(&dropped[signum]) != 0)) {
+            atomic_fetch_sub(&dropped[signum], 1);
+            info[count] = (struct signal_info) {.signum = signum};
+            taken[signum]++;
+            count++;
+        }
+
+        if (taken[signum] != 0) {
+            pipefd_consume(signum, taken[signum]);
         }
     }
+
+    return (int) count;
 }
 
 /*----------------------------------------------------------------------------*/
 
+int signal_pipefd_set_backend(signal_backend_t new_backend)
+{
+    if ((new_backend != signal_backend_pipe) &&
+        (new_backend != signal_backend_signalfd)) {
+        fprintf(stderr, "error: unknown signal backend [%d].\n",
+                (int) new_backend);
+        return -1;
+    }
+
+    if (initialized && (new_backend != backend)) {
+        fprintf(stderr, "error: can't change signal backend while signals "
+                "are connected.\n");
+        return -1;
+    }
+
+    backend = new_backend;
+    return 0;
+}
+
+signal_backend_t signal_pipefd_get_backend(void)
+{
+    return backend;
+}
+
+int signal_pipefd_read(struct signal_info info[], unsigned int max)
+{
+    if (initialized == false) {
+        return 0;
+    }
+
+    if (backend == signal_backend_signalfd) {
+        return (signal_fd == -1) ? 0 : sigfd_read(info, max);
+    }
+
+    return pipefd_read(info, max);
+}
+
+int signal_pipefd_child_mask(sigset_t *mask)
+{
+    pthread_sigmask(SIG_BLOCK, NULL, mask);
+
+    if ((initialized == false) || sigisemptyset(&blocked)) {
+        return 0;
+    }
+
+    for (int signum = 1; signum <= max_signum; signum++) {
+        if (sigismember(&blocked, signum) == 1) {
+            sigdelset(mask, signum);
+        }
+    }
+
+    return 1;
+}
+
 int signal_pipefd_connect(int signum)
 {
     int result;
 
-    if (signum > max_signum) {
-        fprintf(stderr, "Requested signal too big!\n");
+    if (check_signum(signum) == false) {
         return -1;
     }
 
@@ -137,6 +750,10 @@ int signal_pipefd_connect(int signum)
         pipe_set_init();
     }
 
+    if (backend == signal_backend_signalfd) {
+        return sigfd_connect(signum);
+    }
+
     if (pipe_set[signum][0] != -1) {
         return pipe_set[signum][0];
     }
@@ -169,8 +786,7 @@ int signal_pipefd_connect(int signum)
 
 int signal_pipefd_get(int signum)
 {
-    if (signum > max_signum) {
-        fprintf(stderr, "Requested signal too big!\n");
+    if (check_signum(signum) == false) {
         return -1;
     }
 
@@ -178,16 +794,16 @@ int signal_pipefd_get(int signum)
         pipe_set_init();
     }
 
+    if (backend == signal_backend_signalfd) {
+        return (sigismember(&connected, signum) == 1) ? signal_fd : -1;
+    }
+
     return pipe_set[signum][0];
 }
 
 int signal_pipefd_clear(int signum)
 {
-    int result;
-    char dummy_buffer;
-
-    if (signum > max_signum) {
-        fprintf(stderr, "Requested signal too big!\n");
+    if (check_signum(signum) == false) {
         return -1;
     }
 
@@ -195,36 +811,43 @@ int signal_pipefd_clear(int signum)
         pipe_set_init();
     }
 
-    result = fd_check_ready(pipe_set[signum][0]);
-
-    if (result < 0) {
-        return result;
+    if (backend == signal_backend_signalfd) {
+        return sigfd_clear(signum);
     }
 
-    if (result == 1) {
-        result = read_nointr(pipe_set[signum][0], &dummy_buffer, 1);
+    return pipefd_clear(signum);
+}
 
-        if (result < 0) {
-            perror("read from pipe failed");
-            return result;
-        }
+int signal_pipefd_drain(int signum)
+{
+    if (check_signum(signum) == false) {
+        return -1;
+    }
 
-        if (result == 0) {
-            fprintf(stderr, "warning: read from pipefd was empty\n");
+    if (initialized == false) {
+        pipe_set_init();
+    }
+
+    if (backend == signal_backend_signalfd) {
+        if (sigismember(&connected, signum) != 1) {
+            fprintf(stderr, "warning: tried to drain unconnected signal\n");
             return -1;
         }
 
-        return 0;
+        return sigfd_drain(signum);
     }
 
-    fprintf(stderr, "warning: tried to clear empty signal\n");
-    return -1;
+    if (pipe_set[signum][0] == -1) {
+        fprintf(stderr, "warning: tried to drain unconnected signal\n");
+        return -1;
+    }
+
+    return pipefd_drain(signum);
 }
 
 int signal_pipefd_check(int signum)
 {
-    if (signum > max_signum) {
-        fprintf(stderr, "Requested signal too big!\n");
+    if (check_signum(signum) == false) {
         return -1;
     }
 
@@ -232,16 +855,16 @@ int signal_pipefd_check(int signum)
         pipe_set_init();
     }
 
-    return fd_check_ready(pipe_set[signum][0]);
+    if (backend == signal_backend_signalfd) {
+        return sigfd_check(signum);
+    }
+
+    return (pipefd_pending(signum) != 0) ? 1 : 0;
 }
 
 int signal_pipefd_wait(int signum)
 {
-    int result;
-    char dummy_buffer;
-
-    if (signum > max_signum) {
-        fprintf(stderr, "Requested signal too big!\n");
+    if (check_signum(signum) == false) {
         return -1;
     }
 
@@ -249,19 +872,11 @@ int signal_pipefd_wait(int signum)
         pipe_set_init();
     }
 
-    result = read_nointr(pipe_set[signum][0], &dummy_buffer, 1);
-
-    if (result < 0) {
-        perror("read from pipe failed");
-        return result;
-    }
-
-    if (result == 0) {
-        fprintf(stderr, "warning: read from pipefd was empty\n");
-        return -1;
+    if (backend == signal_backend_signalfd) {
+        return sigfd_wait(signum);
     }
 
-    return 0;
+    return pipefd_wait(signum);
 }
 
 int signal_pipefd_cleanup(void)
@@ -272,7 +887,13 @@ int signal_pipefd_cleanup(void)
         return 0;
     }
 
-    for (unsigned int signum = 0; signum < max_signum; signum++) {
+    if (backend == signal_backend_signalfd) {
+        result = sigfd_cleanup();
+        initialized = (result != 0);
+        return result;
+    }
+
+    for (unsigned int signum = 1; signum <= max_signum; signum++) {
         if (pipe_set[signum][0] != -1) {
             signal((int) signum, SIG_DFL);
         }
@@ -1,6 +1,9 @@
 #ifndef _LIBSIGNAL_H_
 #define _LIBSIGNAL_H_
 
+#include <signal.h>
+#include <sys/types.h>
+
 /* Portable, POSIX-compliant implementation of a signal handler that queues
  * signals into pipes for later retrieval. This is a functionally similar to
  * the Linux-specific signalfd() interface, and also to the so-called
@@ -8,8 +11,84 @@
 
 /*----------------------------------------------------------------------------*/
 
-/* Connects a signal to a pipe so that it can be monitored with select()
- * or handled inside of a program's event loop.
+/* Backends for the signal_pipefd_*() functions. signal_backend_pipe (the
+ * default) installs a handler that counts each delivery, saves its siginfo
+ * in a fixed-size ring, and writes to a separate pipe for each signal, which
+ * costs two descriptors per signal. The pipe only gets a byte when the
+ * signal goes from having nothing pending to having something pending, so a
+ * burst of deliveries (a batch of SIGCHLDs, say) costs one wakeup, and the
+ * pipe can never fill up. signal_backend_signalfd blocks the connected
+ * signals instead, and watches all of them with one signalfd(), so
+ * signal_pipefd_connect() and signal_pipefd_get() return the same
+ * descriptor for every signal.
+ *
+ * With the signalfd backend, a readable descriptor means that one of the
+ * connected signals is pending, not necessarily the one being waited for, so
+ * event loops should handle all of them (signal_pipefd_read() does that in
+ * one call). Signals are only blocked on the calling thread, so connect them
+ * before starting other threads (or block them there too). Launches from
+ * libproc unblock them again in the new program. */
+
+typedef enum signal_backend_t {
+    signal_backend_pipe = 0,
+    signal_backend_signalfd = 1
+} signal_backend_t;
+
+/* Selects the backend. It can only be changed while no signals are
+ * connected. Returns 0 on a success, or -1 otherwise. */
+
+int signal_pipefd_set_backend(signal_backend_t backend);
+signal_backend_t signal_pipefd_get_backend(void);
+
+/* One delivery of a signal, taken from its siginfo: the sender's PID and
+ * UID, si_code, (for SIGCHLD) the exit status or signal number, and the
+ * integer payload of a signal sent with sigqueue() (or by a POSIX timer or
+ * message queue). If the pipe backend's ring overflowed because deliveries
+ * weren't being read, the ones that didn't fit are still counted, but only
+ * 'signum' is known and the other fields are 0. */
+
+struct signal_info {
+    int signum;
+    int code;
+    pid_t pid;
+    uid_t uid;
+    int status;
+    int value;
+};
+
+/* Collects up to 'max' pending deliveries of any connected signals, without
+ * blocking. With the signalfd backend, each read() returns a batch of
+ * records, and with the pipe backend they're copied out of the ring in the
+ * order that they arrived.
+ *
+ * Real-time signals are queued rather than merged, so every sigqueue() to a
+ * connected SIGRTMIN+n shows up as its own entry, and the entries for any
+ * one signal come out in the order that they were sent.
+ *
+ * The pipe backend's ring is shared by every connected signal, and holds
+ * the siginfo of a fixed number of deliveries that haven't been read yet
+ * (deliveries taken with signal_pipefd_clear() or signal_pipefd_drain()
+ * don't count). A delivery that arrives while the ring is full, whichever
+ * signals filled it, loses its siginfo, including its sigqueue() payload,
+ * and is reported with just its signal number. Returns the number of
+ * entries filled in (0 if nothing was pending), or -1 in the event of an
+ * error. */
+
+int signal_pipefd_read(struct signal_info info[], unsigned int max);
+
+/* Fills in the signal mask that a newly launched program should start with:
+ * the caller's mask, minus the signals that the signalfd backend blocked.
+ * Returns 1 if that differs from the caller's mask, or 0 if not. This is
+ * safe to call between fork() and exec. */
+
+int signal_pipefd_child_mask(sigset_t *mask);
+
+/*----------------------------------------------------------------------------*/
+
+/* Connects a signal to a pipe so that it can be monitored with poll()
+ * or handled inside of a program's event loop (see libevloop.h). Any
+ * standard signal or SIGRTMIN through SIGRTMAX can be connected. The
+ * real-time signals below SIGRTMIN belong to the C library.
  *
  * Returns the file-descriptor for the read-end of the pipe (this can also
  * be retrieved later with signal_pipefd_get(). */
@@ -17,11 +96,13 @@
 int signal_pipefd_connect(int signum);
 
 /* Returns the file descriptor for the read-end of the target signal's pipe,
- * for use with select()/select_nointr() and friends. Signal-handler must be
+ * for use with poll()/poll_nointr() and friends. Signal-handler must be
  * initialized with signal_pipefd_connect() first.
  *
  * Note that when using the signal descriptor directly, be sure to clear the
- * received signal with read/read_nointr(fd, 1) or with signal_pipefd_clear(). */
+ * received signal with signal_pipefd_clear(), signal_pipefd_drain() or
+ * signal_pipefd_read(). Reading the pipe itself doesn't consume anything,
+ * since one byte can stand for many deliveries. */
 
 int signal_pipefd_get(int signum);
 
@@ -36,6 +117,12 @@ int signal_pipefd_check(int signum);
 
 int signal_pipefd_clear(int signum);
 
+/* Clears every pending delivery of a signal without blocking. Returns the
+ * number of deliveries that were cleared (0 if none were pending), or -1 in
+ * the event of an error. */
+
+int signal_pipefd_drain(int signum);
+
 /* Blocks and waits for a signal to occur. Returns 0 on a success, -1 in the
  * event of an error. Automatically clears the signal. */
 
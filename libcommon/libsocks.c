@@ -3,21 +3,28 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
-
+#include <time.h>
 #include <unistd.h>
 
 #include "libnointr.h"
 #include "libsocks.h"
 
-static const char path_toolong[] = "%s: error: pathname too long\n";
+static const char path_toolong[] = "error: socket pathname too long\n";
 
 /*----------------------------------------------------------------------------*/
 
@@ -33,10 +40,10 @@ static uint32_t deserialize_uint32(const char *input)
 {
     uint32_t result = 0;
 
-    result += (uint32_t)(input[0]) << 0;
-    result += (uint32_t)(input[1]) << 8;
-    result += (uint32_t)(input[2]) << 16;
-    result += (uint32_t)(input[3]) << 24;
+    result += (uint32_t)((unsigned char) input[0]) << 0;
+    result += (uint32_t)((unsigned char) input[1]) << 8;
+    result += (uint32_t)((unsigned char) input[2]) << 16;
+    result += (uint32_t)((unsigned char) input[3]) << 24;
 
     return result;
 }
@@ -47,12 +54,17 @@ static ssize_t read_count(int filedes, char *buf, size_t nbyte)
     size_t total = 0;
 
     while (total != nbyte) {
-        result = read_nointr(filedes, buf, (nbyte - total));
+        result = read_nointr(filedes, buf + total, (nbyte - total));
 
         if (result < 0) {
             return result;
         }
 
+        if (result == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
         total += (size_t) result;
     }
 
@@ -80,25 +92,162 @@ static ssize_t write_count(int filedes, const char *buf, size_t nbyte)
 
 /*----------------------------------------------------------------------------*/
 
-static int fd_socket_setflag(int filedes)
+/* Protocol v1 sends each message as two records: a 4-byte header holding
+ * the body size, then the body (left out when it's empty). Protocol v2 sends
+ * the header and body as a single record, and sets socks_v2_flag in the
+ * header so that the two can be told apart from the first message on.
+ * Servers answer each request in the version that it arrived in. Clients
+ * send v1 unless socks_set_protocol() says otherwise, since a server built
+ * before v2 takes the flagged size word for a body length.
+ *
+ * A v2 header can also set socks_tag_flag, in which case a 4-byte request id
+ * follows the size. Responses to tagged requests carry the same id, which
+ * lets sessions keep several requests in flight on one connection.
+ *
+ * socks_batch_flag marks a v2 message whose body is a batch envelope: a
+ * 4-byte item count, then each item as a 4-byte size and its bytes. The
+ * response to a batch is also flagged, and holds the item count, then each
+ * item's callback result (4 bytes, signed), response size and response. */
+
+enum {
+    socks_header_size = 4,
+    socks_tagged_header_size = 8
+};
+
+static const uint32_t socks_v2_flag = 0x80000000U;
+static const uint32_t socks_tag_flag = 0x40000000U;
+static const uint32_t socks_batch_flag = 0x20000000U;
+static const uint32_t socks_flag_mask = 0xE0000000U;
+
+static unsigned int client_version = 1;
+
+/* Requests bigger than this are refused with EMSGSIZE as soon as their
+ * header has been seen, before any memory is set aside for the body. */
+
+static uint32_t max_message = socks_default_max_message;
+
+struct socks_frame {
+    unsigned int version;
+    bool tagged;
+    bool batch;
+    uint32_t id;
+};
+
+/* Collects the responses to the items of a batch while its callbacks run. */
+
+struct batch_output {
+    char *data;
+    size_t used;
+    size_t size;
+};
+
+static const struct socks_frame frame_v1 = {.version = 1};
+
+/* The connection whose callback is running, and the framing that its
+ * request used. 'pending' stays set until the callback responds. This used
+ * to be flagged with F_SETOWN on the socket itself, but Linux reads an owner
+ * of -1 back as 0, so the flag was never seen. 'conn' is set when the
+ * request came in through a socks_server, whose responses go through the
+ * connection's output queue instead of being written synchronously. */
+
+struct socks_conn;
+
+static _Thread_local struct {
+    int fd;
+    struct socks_frame frame;
+    bool pending;
+    struct batch_output *batch;
+    struct socks_conn *conn;
+} current = {.fd = -1, .frame = {.version = 1}, .pending = false};
+
+static ssize_t conn_send(struct socks_conn *conn, const void *buf,
+                         uint32_t nbyte, const struct socks_frame *frame,
+                         const int *fds, unsigned int nfds);
+
+/*----------------------------------------------------------------------------*/
+
+/* Receive buffers. Request bodies are read into buffers from a shared pool
+ * rather than into fresh memory, so a server that's warmed up doesn't
+ * allocate. Buffers come in power-of-two size classes from 256 bytes up, and
+ * up to buffer_pool_depth free buffers are kept for each class. A free
+ * buffer's first bytes hold the link to the next one. The pool is locked
+ * since buffers can be returned from other threads than the one that took
+ * them. */
+
+enum {
+    buffer_min_shift = 8,
+    buffer_classes = 23,
+    buffer_pool_depth = 8
+};
+
+struct free_buffer {
+    struct free_buffer *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct free_buffer *free[buffer_classes];
+    unsigned int count[buffer_classes];
+} buffer_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static unsigned int buffer_class(size_t size)
 {
-    return fcntl(filedes, F_SETOWN, -1);
+    unsigned int class = 0;
+
+    while ((class < (buffer_classes - 1)) &&
+           (((size_t) 1 << (class + buffer_min_shift)) < size)) {
+        class++;
+    }
+
+    return class;
 }
 
-static int fd_socket_clearflag(int filedes)
+/* Returns a buffer that can hold 'size' bytes, or NULL if none could be
+ * allocated. */
+static char * buffer_get(size_t size)
 {
-    return fcntl(filedes, F_SETOWN, 0);
+    unsigned int class = buffer_class(size);
+    struct free_buffer *result;
+
+    pthread_mutex_lock(&buffer_pool.lock);
+    result = buffer_pool.free[class];
+
+    if (result != NULL) {
+        buffer_pool.free[class] = result->next;
+        buffer_pool.count[class]--;
+    }
+
+    pthread_mutex_unlock(&buffer_pool.lock);
+
+    if (result != NULL) {
+        return (char *) result;
+    }
+
+    return malloc((size_t) 1 << (class + buffer_min_shift));
 }
 
-static int fd_socket_checkflag(int filedes)
+/* Returns a buffer from buffer_get() to the pool. 'size' must be the size
+ * that it was requested with. */
+static void buffer_put(char *buffer, size_t size)
 {
-    pid_t result = fcntl(filedes, F_GETOWN, 0);
+    unsigned int class = buffer_class(size);
+    struct free_buffer *entry = (struct free_buffer *)(void *) buffer;
 
-    if (errno == 0) {
-        return (result == -1);
+    if (buffer == NULL) {
+        return;
     }
 
-    return -1;
+    pthread_mutex_lock(&buffer_pool.lock);
+
+    if (buffer_pool.count[class] < buffer_pool_depth) {
+        entry->next = buffer_pool.free[class];
+        buffer_pool.free[class] = entry;
+        buffer_pool.count[class]++;
+        entry = NULL;
+    }
+
+    pthread_mutex_unlock(&buffer_pool.lock);
+    free(entry);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -110,12 +259,57 @@ enum {
     address_maxlen = (sun_path_size > PATH_MAX) ? sun_path_size : PATH_MAX
 };
 
+static int listen_backlog = SOMAXCONN;
+
+/* A connect() that's refused (because the server is restarting, or its
+ * listen queue is full) is retried after a randomized, doubling delay until
+ * 'connect_deadline_ms' has passed. The jitter keeps a crowd of clients that
+ * were refused together from all coming back at the same moment. */
+
+enum {
+    connect_backoff_min_us = 1000,
+    connect_backoff_max_us = 100000
+};
+
+static unsigned int connect_deadline_ms = socks_default_connect_deadline;
+static atomic_ulong connects_refused;
+static atomic_ulong connects_retried;
+
+static size_t frame_header_size(const struct socks_frame *frame)
+{
+    return frame->tagged ? socks_tagged_header_size : socks_header_size;
+}
+
+/* Fills in a v2 header for a message of 'nbyte' bytes. Returns the size of
+ * the header, or 0 (with errno set to EMSGSIZE) if 'nbyte' is too big. */
+static size_t frame_header_encode(char *header, uint32_t nbyte,
+                                  const struct socks_frame *frame)
+{
+    uint32_t flags;
+
+    if (nbyte & socks_flag_mask) {
+        errno = EMSGSIZE;
+        return 0;
+    }
+
+    flags = socks_v2_flag;
+    flags |= frame->tagged ? socks_tag_flag : 0;
+    flags |= frame->batch ? socks_batch_flag : 0;
+    serialize_uint32(header, nbyte | flags);
+
+    if (frame->tagged) {
+        serialize_uint32(header + socks_header_size, frame->id);
+    }
+
+    return frame_header_size(frame);
+}
+
 static int socks_address_make(const char *filename, struct sockaddr_un *result)
 {
     size_t length = strnlen(filename, PATH_MAX + 1);
 
     if (length > address_maxlen) {
-        fprintf(stderr, path_toolong, progname);
+        fprintf(stderr, path_toolong);
         return -1;
     }
 
@@ -125,226 +319,2992 @@ static int socks_address_make(const char *filename, struct sockaddr_un *result)
     return 0;
 }
 
-static ssize_t socks_recv(int fd, void *buf, size_t bufsize)
+static int64_t monotonic_us(void)
 {
-    char header[4];
-    uint32_t msgsize;
-    ssize_t result;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
 
-    result = read_count(fd, header, 4);
+/* Picks a delay between half of 'backoff_us' and all of it. */
+static int64_t backoff_jitter(unsigned int backoff_us)
+{
+    static _Thread_local uint32_t state;
 
-    if (result < 0) {
-        return result;
+    if (state == 0) {
+        state = (uint32_t) monotonic_us() ^ ((uint32_t) getpid() << 16) ^ 1;
     }
 
-    msgsize = deserialize_uint32(header);
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
 
-    if (msgsize > bufsize) {
-        errno = EMSGSIZE;
+    return (backoff_us / 2) + (state % ((backoff_us / 2) + 1));
+}
+
+/* Opens a client connection to the server at 'filename', retrying refused
+ * connections until the connect deadline. Returns the socket, or -1 in the
+ * event of an error. */
+static int socks_connect(const char *filename)
+{
+    struct sockaddr_un address;
+    struct timespec pause;
+    unsigned int backoff_us = connect_backoff_min_us;
+    int64_t deadline = monotonic_us() + ((int64_t) connect_deadline_ms * 1000);
+    int64_t remaining;
+    int64_t delay;
+    int socket_fd;
+    int error;
+
+    if (socks_address_make(filename, &address) < 0) {
+        errno = ENAMETOOLONG;
         return -1;
     }
 
-    return read_count(fd, buf, msgsize);
-}
+    while (1) {
+        socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
 
-static ssize_t socks_send(int fd, const void *buf, uint32_t nbyte)
-{
-    char header[4];
-    ssize_t result;
+        if (socket_fd < 0) {
+            return socket_fd;
+        }
 
-    serialize_uint32(header, nbyte);
-    result = write_count(fd, header, 4);
+        if (connect_nointr(socket_fd, (struct sockaddr *) &address,
+                           sizeof(address)) == 0) {
+            return socket_fd;
+        }
 
-    if (result < 0) {
-        return result;
-    }
+        error = errno;
+        close_nointr(socket_fd);
 
-    return write_count(fd, buf, nbyte);
-}
+        if ((error != ECONNREFUSED) && (error != EAGAIN)) {
+            errno = error;
+            return -1;
+        }
 
-static int socks_process_request(int connection_fd, socks_callback_t callback,
-                                 uint32_t input_size)
-{
-    int result;
-    char buffer[input_size + 1];
+        atomic_fetch_add_explicit(&connects_refused, 1, memory_order_relaxed);
+        remaining = deadline - monotonic_us();
 
-    buffer[input_size + 1] = '\x00';
-    result = read_count(connection_fd, buffer, input_size);
+        if (remaining <= 0) {
+            errno = error;
+            return -1;
+        }
 
-    if (result < 0) {
-        return result;
-    }
+        delay = backoff_jitter(backoff_us);
+        delay = (delay < remaining) ? delay : remaining;
 
-    result = fd_socket_setflag(connection_fd);
+        pause.tv_sec = (time_t)(delay / 1000000);
+        pause.tv_nsec = (long)(delay % 1000000) * 1000;
+        nanosleep_nointr(&pause, NULL);
 
-    if (result < 0) {
-        return result;
+        atomic_fetch_add_explicit(&connects_retried, 1, memory_order_relaxed);
+
+        if (backoff_us < connect_backoff_max_us) {
+            backoff_us *= 2;
+        }
     }
+}
 
-    result = callback(connection_fd, buffer, input_size);
+union fd_control {
+    struct cmsghdr align;
+    char data[CMSG_SPACE(sizeof(int) * socks_max_fds)];
+};
 
-    if (fd_socket_checkflag(connection_fd)) {
-        int response_result = socks_respond(connection_fd, "", 0);
-        if (result == 0) {
-            result = response_result;
+static unsigned int control_get_fds(struct msghdr *msg, int *fds,
+                                    unsigned int maxfds)
+{
+    unsigned int count = 0;
+    unsigned int available;
+    int received;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if ((cmsg->cmsg_level != SOL_SOCKET) ||
+            (cmsg->cmsg_type != SCM_RIGHTS)) {
+            continue;
+        }
+
+        available = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (unsigned int x = 0; x < available; x++) {
+            memcpy(&received, CMSG_DATA(cmsg) + (x * sizeof(int)),
+                   sizeof(int));
+
+            if (count < maxfds) {
+                fds[count++] = received;
+            } else {
+                close_nointr(received);
+            }
         }
     }
 
-    return result;
+    return count;
 }
 
-/*----------------------------------------------------------------------------*/
-
-ssize_t socks_respond(int fd, const void *buf, uint32_t nbyte)
+/* Attaches 'fds' to 'msg' as an SCM_RIGHTS message. */
+static void control_put_fds(struct msghdr *msg, union fd_control *control,
+                            const int *fds, unsigned int nfds)
 {
-    ssize_t result = fd_socket_clearflag(fd);
+    struct cmsghdr *cmsg;
 
-    if (result < 0) {
-        return result;
-    }
+    memset(control, 0, sizeof(*control));
+    msg->msg_control = control->data;
+    msg->msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
 
-    result = socks_send(fd, buf, nbyte);
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+}
 
-    if (result < 0) {
-        return result;
+static void close_fds(const int *fds, unsigned int nfds)
+{
+    for (unsigned int x = 0; x < nfds; x++) {
+        close_nointr(fds[x]);
     }
-    return 0;
 }
 
-int socks_server_open(const char *filename)
+/* Receives one message of either version. A v2 message arrives in a single
+ * recvmsg(). For v1, that call only gets the header record, and the body
+ * record is read afterwards. If 'nfds' isn't NULL, descriptors that came
+ * with the message are stored in 'fds' (see socks_recv()). */
+static ssize_t socks_recv_framed(int fd, void *buf, size_t bufsize, int *fds,
+                                 unsigned int *nfds)
 {
-    int result;
-    int socket_fd;
-    struct sockaddr_un address;
+    char header[socks_header_size];
+    union fd_control control;
+    uint32_t msgsize;
+    ssize_t result;
 
-    result = socks_address_make(filename, &address);
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = buf, .iov_len = bufsize}
+    };
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+
+    if (nfds != NULL) {
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+    }
+
+    result = recvmsg_nointr(fd, &msg, (nfds != NULL) ? MSG_CMSG_CLOEXEC : 0);
 
     if (result < 0) {
         return result;
     }
 
-    socket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (nfds != NULL) {
+        *nfds = control_get_fds(&msg, fds, *nfds);
 
-    if (socket_fd < 0) {
-        return socket_fd;
+        if (msg.msg_flags & MSG_CTRUNC) {
+            errno = EMSGSIZE;
+            return -1;
+        }
     }
 
-    result = fd_socket_clearflag(socket_fd);
+    if (result == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
 
-    if (result < 0) {
-        return result;
+    if (result < socks_header_size) {
+        errno = EPROTO;
+        return -1;
     }
 
-    result = bind(socket_fd, (struct sockaddr *) &address, sizeof(address));
+    msgsize = deserialize_uint32(header);
 
-    if (result != 0) {
-        return -1;
+    if (msgsize & socks_v2_flag) {
+        msgsize &= ~socks_v2_flag;
+
+        if (msgsize & socks_flag_mask) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if ((msg.msg_flags & MSG_TRUNC) || (msgsize > bufsize)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        if (msgsize != (size_t) result - socks_header_size) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        return (ssize_t) msgsize;
     }
 
-    result = listen(socket_fd, 4);
+    if (result != socks_header_size) {
+        errno = EPROTO;
+        return -1;
+    }
 
-    if (result != 0) {
+    if (msgsize > bufsize) {
+        errno = EMSGSIZE;
         return -1;
     }
 
-    return socket_fd;
+    return read_count(fd, buf, msgsize);
 }
 
-int socks_server_process(int socket_fd, socks_callback_t callback)
+/* Receives a message, and any descriptors sent with it if 'nfds' isn't NULL.
+ * On entry, *nfds holds the capacity of 'fds', and on return, the number of
+ * descriptors received. They're closed again if the message can't be
+ * received. */
+static ssize_t socks_recv(int fd, void *buf, size_t bufsize, int *fds,
+                          unsigned int *nfds)
 {
-    int connection_fd;
+    ssize_t result = socks_recv_framed(fd, buf, bufsize, fds, nfds);
+
+    if ((result < 0) && (nfds != NULL)) {
+        close_fds(fds, *nfds);
+        *nfds = 0;
+    }
+
+    return result;
+}
+
+/* Receives the body of a v2 message whose header has only been peeked at. */
+static ssize_t socks_recv_record(int fd, void *buf, uint32_t msgsize,
+                                 const struct socks_frame *frame, int flags)
+{
+    char header[socks_tagged_header_size];
+    size_t header_size = frame_header_size(frame);
     ssize_t result;
-    char header[4];
-    uint32_t msgsize;
 
-    connection_fd = accept_nointr(socket_fd, 0, 0);
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = header_size},
+        {.iov_base = buf, .iov_len = msgsize}
+    };
 
-    if (connection_fd < 0) {
-        return connection_fd;
-    }
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
 
-    result = read_count(connection_fd, header, 4);
+    result = recvmsg_nointr(fd, &msg, flags);
 
     if (result < 0) {
-        return (int) result;
+        return result;
     }
 
-    msgsize = deserialize_uint32(header);
-    result = socks_process_request(connection_fd, callback, msgsize);
-    close_nointr(connection_fd);
+    if ((size_t) result != (msgsize + header_size)) {
+        errno = (result == 0) ? ECONNRESET : EPROTO;
+        return -1;
+    }
 
-    return result;
+    return (ssize_t) msgsize;
 }
 
-ssize_t socks_client_process(const char *filename, const char *input,
-                             uint32_t nbyte, char *output, uint32_t bufsize)
+/* Peeks at the next record to find out how it's framed and how big its body
+ * is. MSG_TRUNC makes the kernel report the full record length even though
+ * only the header is copied out. Returns the record length, or -1 (with
+ * errno set to EAGAIN if 'flags' has MSG_DONTWAIT and nothing has arrived
+ * yet). */
+static ssize_t socks_peek_header(int fd, uint32_t *msgsize,
+                                 struct socks_frame *frame, int flags)
 {
+    char header[socks_tagged_header_size];
     ssize_t result;
-    int socket_fd;
-    struct sockaddr_un address;
+    uint32_t value;
 
-    result = socks_address_make(filename, &address);
+    result = recv(fd, header, sizeof(header), MSG_PEEK | MSG_TRUNC | flags);
 
     if (result < 0) {
         return result;
     }
 
-    socket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (result == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
 
-    if (socket_fd < 0) {
-        fprintf(stderr, "Couldn't open socket [%s]\n", filename);
-        return socket_fd;
+    if (result < socks_header_size) {
+        errno = EPROTO;
+        return -1;
     }
 
-    result = connect_nointr(socket_fd, (struct sockaddr *) &address,
-                            sizeof(address));
+    value = deserialize_uint32(header);
+    *frame = frame_v1;
+    *msgsize = value;
 
-    if (result != 0) {
-        fprintf(stderr, "Couldn't connect to socket [%s]\n", filename);
-        close_nointr(socket_fd);
-        return result;
-    }
+    if (value & socks_v2_flag) {
+        frame->version = 2;
+        frame->tagged = (value & socks_tag_flag) != 0;
+        frame->batch = (value & socks_batch_flag) != 0;
+        *msgsize = value & ~socks_flag_mask;
 
-    result = socks_send(socket_fd, input, nbyte);
+        if (frame->tagged && (result >= socks_tagged_header_size)) {
+            frame->id = deserialize_uint32(header + socks_header_size);
+        }
+    }
 
-    if (result < 0) {
-        close_nointr(socket_fd);
-        return result;
+    if (((frame->version == 1) && (result != socks_header_size)) ||
+        ((frame->version == 2) &&
+         ((size_t) result != (*msgsize + frame_header_size(frame))))) {
+        errno = EPROTO;
+        return -1;
     }
 
-    result = socks_recv(socket_fd, output, bufsize);
-    close_nointr(socket_fd);
     return result;
 }
 
-int socks_server_wait(int socket_fd)
+/* Sends a message, with 'fds' attached (if there are any) as SCM_RIGHTS
+ * ancillary data. For v1, the descriptors go with the header record. */
+static ssize_t socks_send(int fd, const void *buf, uint32_t nbyte,
+                          const struct socks_frame *frame, const int *fds,
+                          unsigned int nfds)
 {
-    int result;
-    fd_set read_fds;
-    fd_set error_fds;
+    char header[socks_tagged_header_size];
+    size_t header_size = frame_header_size(frame);
+    union fd_control control;
+    ssize_t result;
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = header_size},
+        {.iov_base = (void *) buf, .iov_len = nbyte}
+    };
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+
+    if (nfds > socks_max_fds) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nfds != 0) {
+        control_put_fds(&msg, &control, fds, nfds);
+    }
+
+    if (frame->version == 1) {
+        serialize_uint32(header, nbyte);
 
-    FD_ZERO(&read_fds);
-    FD_ZERO(&error_fds);
-    FD_SET(socket_fd, &read_fds);
-    FD_SET(socket_fd, &error_fds);
+        if (nfds != 0) {
+            msg.msg_iovlen = 1;
+            result = sendmsg_nointr(fd, &msg, MSG_NOSIGNAL);
+        } else {
+            result = write_count(fd, header, socks_header_size);
+        }
+
+        if (result < 0) {
+            return result;
+        }
+
+        return write_count(fd, buf, nbyte);
+    }
 
-    result = select_nointr(socket_fd + 1, &read_fds, NULL, &error_fds, NULL);
+    if (frame_header_encode(header, nbyte, frame) == 0) {
+        return -1;
+    }
 
-    /* We might normally use FD_ISSET here, but this isn't necessary
-     * because we're only listening for one item (the socket). */
+    result = sendmsg_nointr(fd, &msg, MSG_NOSIGNAL);
 
     if (result < 0) {
         return result;
     }
 
-    if (result == 0) {
+    if ((size_t) result != (nbyte + header_size)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return (ssize_t) nbyte;
+}
+
+/* Makes sure that 'output' has room for 'nbyte' more bytes. */
+static int batch_reserve(struct batch_output *output, size_t nbyte)
+{
+    size_t size = (output->size != 0) ? output->size : 256;
+    char *data;
+
+    while ((size - output->used) < nbyte) {
+        size *= 2;
+    }
+
+    if (size != output->size) {
+        data = realloc(output->data, size);
+
+        if (data == NULL) {
+            return -1;
+        }
+
+        output->data = data;
+        output->size = size;
+    }
+
+    return 0;
+}
+
+static int batch_append(struct batch_output *output, const void *buf,
+                        uint32_t nbyte)
+{
+    if (batch_reserve(output, nbyte) != 0) {
         return -1;
     }
 
+    memcpy(output->data + output->used, buf, nbyte);
+    output->used += nbyte;
     return 0;
 }
 
-int socks_server_close(int socket_fd)
+/* Steps through the items of a batch envelope. '*cursor' starts just after
+ * the item count. Returns 1 and fills in the next item, 0 at the end of the
+ * envelope, or -1 if the envelope is malformed. */
+static int batch_next(const char **cursor, const char *end, const char **item,
+                      uint32_t *nbyte)
 {
-    return close_nointr(socket_fd);
+    if (*cursor == end) {
+        return 0;
+    }
+
+    if ((size_t)(end - *cursor) < 4) {
+        return -1;
+    }
+
+    *nbyte = deserialize_uint32(*cursor);
+    *cursor += 4;
+
+    if ((size_t)(end - *cursor) < *nbyte) {
+        return -1;
+    }
+
+    *item = *cursor;
+    *cursor += *nbyte;
+    return 1;
+}
+
+/* Checks that a batch envelope is well-formed, and returns its item count
+ * (or -1). */
+static int64_t batch_count(const char *buffer, uint32_t input_size)
+{
+    const char *cursor = buffer + 4;
+    const char *end = buffer + input_size;
+    const char *item;
+    uint32_t expected;
+    uint32_t nbyte;
+    uint32_t found = 0;
+    int result;
+
+    if (input_size < 4) {
+        return -1;
+    }
+
+    expected = deserialize_uint32(buffer);
+
+    while ((result = batch_next(&cursor, end, &item, &nbyte)) > 0) {
+        found++;
+    }
+
+    return ((result == 0) && (found == expected)) ? (int64_t) found : -1;
+}
+
+/* Sends a response for a request that came in on 'connection_fd', through
+ * the output queue of 'conn' if it's a socks_server connection. */
+static ssize_t dispatch_send(int connection_fd, struct socks_conn *conn,
+                             const void *buf, uint32_t nbyte,
+                             const struct socks_frame *frame, const int *fds,
+                             unsigned int nfds)
+{
+    if (conn != NULL) {
+        return conn_send(conn, buf, nbyte, frame, fds, nfds);
+    }
+
+    return socks_send(connection_fd, buf, nbyte, frame, fds, nfds);
+}
+
+/* Runs the callback once for each item of a batch, collecting what each one
+ * responds with, and sends all of the results back as one message. Each
+ * item gets its own NUL-terminated copy, like a standalone request does. */
+static int socks_dispatch_batch(int connection_fd, struct socks_conn *conn,
+                                socks_callback_t callback, const char *buffer,
+                                uint32_t input_size,
+                                const struct socks_frame *frame)
+{
+    struct batch_output output = {NULL, 0, 0};
+    const char *cursor = buffer + 4;
+    const char *end = buffer + input_size;
+    const char *item;
+    char *copy;
+    size_t start;
+    uint32_t nbyte;
+    int64_t count = batch_count(buffer, input_size);
+    int result = 0;
+
+    if (count < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (batch_reserve(&output, 4) != 0) {
+        return -1;
+    }
+
+    serialize_uint32(output.data, (uint32_t) count);
+    output.used = 4;
+    current.fd = connection_fd;
+    current.frame = *frame;
+    current.batch = &output;
+
+    while ((result == 0) && (batch_next(&cursor, end, &item, &nbyte) > 0)) {
+        copy = buffer_get((size_t) nbyte + 1);
+        result = ((copy == NULL) || (batch_reserve(&output, 8) != 0)) ? -1 : 0;
+
+        if (result == 0) {
+            memcpy(copy, item, nbyte);
+            copy[nbyte] = '\x00';
+            start = output.used;
+            output.used += 8;
+
+            current.pending = true;
+            serialize_uint32(output.data + start,
+                             (uint32_t) callback(connection_fd, copy, nbyte));
+            serialize_uint32(output.data + start + 4,
+                             (uint32_t)(output.used - start - 8));
+        }
+
+        buffer_put(copy, (size_t) nbyte + 1);
+    }
+
+    current.fd = -1;
+    current.frame = frame_v1;
+    current.pending = false;
+    current.batch = NULL;
+
+    if (result == 0) {
+        result = (output.used > UINT32_MAX) ? -1 :
+                 (int) dispatch_send(connection_fd, conn, output.data,
+                                     (uint32_t) output.used, frame, NULL, 0);
+    }
+
+    free(output.data);
+    return (result < 0) ? -1 : 0;
+}
+
+/* Runs the callback for a request that's already been read, and sends an
+ * empty response if the callback didn't send one. 'conn' is the
+ * socks_server connection that the request came in on, or NULL. */
+static int socks_dispatch(int connection_fd, struct socks_conn *conn,
+                          socks_callback_t callback, const char *buffer,
+                          uint32_t input_size, const struct socks_frame *frame)
+{
+    int response_result;
+    int result;
+
+    if (frame->batch) {
+        return socks_dispatch_batch(connection_fd, conn, callback, buffer,
+                                    input_size, frame);
+    }
+
+    current.fd = connection_fd;
+    current.frame = *frame;
+    current.pending = true;
+    current.conn = conn;
+    result = callback(connection_fd, buffer, input_size);
+
+    if (current.pending) {
+        response_result = socks_respond(connection_fd, "", 0);
+
+        if (result == 0) {
+            result = response_result;
+        }
+    }
+
+    current.fd = -1;
+    current.frame = frame_v1;
+    current.pending = false;
+    current.conn = NULL;
+    return result;
+}
+
+static int socks_process_request(int connection_fd, socks_callback_t callback,
+                                 uint32_t input_size,
+                                 const struct socks_frame *frame)
+{
+    ssize_t result;
+    size_t buffer_size = (size_t) input_size + 1;
+    char *buffer = buffer_get(buffer_size);
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    if (frame->version == 2) {
+        result = socks_recv_record(connection_fd, buffer, input_size, frame,
+                                   0);
+    } else {
+        result = read_count(connection_fd, buffer, input_size);
+    }
+
+    if (result >= 0) {
+        buffer[input_size] = '\x00';
+        result = socks_dispatch(connection_fd, NULL, callback, buffer,
+                                input_size, frame);
+    }
+
+    buffer_put(buffer, buffer_size);
+    return (int) result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+ssize_t socks_respond(int fd, const void *buf, uint32_t nbyte)
+{
+    return socks_respond_fds(fd, buf, nbyte, NULL, 0);
+}
+
+ssize_t socks_respond_fds(int fd, const void *buf, uint32_t nbyte,
+                          const int *fds, unsigned int nfds)
+{
+    const struct socks_frame *frame = &frame_v1;
+    ssize_t result;
+
+    if ((current.fd == fd) && (current.batch != NULL)) {
+        if (nfds != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        current.pending = false;
+        return (batch_append(current.batch, buf, nbyte) != 0) ? -1 :
+               (ssize_t) nbyte;
+    }
+
+    if (current.fd == fd) {
+        current.pending = false;
+        frame = &current.frame;
+    }
+
+    result = dispatch_send(fd, (current.fd == fd) ? current.conn : NULL, buf,
+                           nbyte, frame, fds, nfds);
+
+    if (result < 0) {
+        return result;
+    }
+    return 0;
+}
+
+int socks_server_open(const char *filename)
+{
+    int result;
+    int socket_fd;
+    struct sockaddr_un address;
+
+    result = socks_address_make(filename, &address);
+
+    if (result < 0) {
+        return result;
+    }
+
+    socket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if (socket_fd < 0) {
+        return socket_fd;
+    }
+
+    result = bind(socket_fd, (struct sockaddr *) &address, sizeof(address));
+
+    if (result != 0) {
+        return -1;
+    }
+
+    result = listen(socket_fd, listen_backlog);
+
+    if (result != 0) {
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+int socks_server_process(int socket_fd, socks_callback_t callback)
+{
+    int connection_fd;
+    ssize_t result;
+    char header[socks_header_size];
+    struct socks_frame frame;
+    uint32_t msgsize;
+
+    connection_fd = accept_nointr(socket_fd, 0, 0);
+
+    if (connection_fd < 0) {
+        return connection_fd;
+    }
+
+    result = socks_peek_header(connection_fd, &msgsize, &frame, 0);
+
+    if ((result >= 0) && (msgsize > max_message)) {
+        errno = EMSGSIZE;
+        result = -1;
+    }
+
+    if ((result >= 0) && (frame.version == 1)) {
+        result = read_count(connection_fd, header, sizeof(header));
+    }
+
+    if (result < 0) {
+        close_nointr(connection_fd);
+        return (int) result;
+    }
+
+    result = socks_process_request(connection_fd, callback, msgsize, &frame);
+    close_nointr(connection_fd);
+
+    return result;
+}
+
+ssize_t socks_client_process(const char *filename, const char *input,
+                             uint32_t nbyte, char *output, uint32_t bufsize)
+{
+    return socks_client_process_fds(filename, input, nbyte, output, bufsize,
+                                    NULL, NULL);
+}
+
+ssize_t socks_client_process_fds(const char *filename, const char *input,
+                                 uint32_t nbyte, char *output,
+                                 uint32_t bufsize, int *fds,
+                                 unsigned int *nfds)
+{
+    struct socks_frame frame = {.version = client_version};
+    unsigned int capacity = 0;
+    ssize_t result;
+    int socket_fd;
+
+    if (nfds != NULL) {
+        capacity = *nfds;
+        *nfds = 0;
+    }
+
+    socket_fd = socks_connect(filename);
+
+    if (socket_fd < 0) {
+        fprintf(stderr, "Couldn't connect to socket [%s]\n", filename);
+        return socket_fd;
+    }
+
+    result = socks_send(socket_fd, input, nbyte, &frame, NULL, 0);
+
+    if (result < 0) {
+        close_nointr(socket_fd);
+        return result;
+    }
+
+    if (nfds != NULL) {
+        *nfds = capacity;
+    }
+
+    result = socks_recv(socket_fd, output, bufsize, fds, nfds);
+    close_nointr(socket_fd);
+    return result;
+}
+
+int socks_subscribe(const char *filename, const char *input, uint32_t nbyte)
+{
+    struct socks_frame frame = {.version = client_version};
+    int socket_fd = socks_connect(filename);
+
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    if (socks_send(socket_fd, input, nbyte, &frame, NULL, 0) < 0) {
+        close_nointr(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+ssize_t socks_event_recv(int fd, char *output, uint32_t bufsize)
+{
+    return socks_recv(fd, output, bufsize, NULL, NULL);
+}
+
+int socks_server_wait(int socket_fd)
+{
+    struct pollfd target = {
+        .fd = socket_fd,
+        .events = POLLIN
+    };
+
+    int result = poll_nointr(&target, 1, -1);
+
+    if (result < 0) {
+        return result;
+    }
+
+    if (result == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int socks_server_close(int socket_fd)
+{
+    return close_nointr(socket_fd);
+}
+
+/*----------------------------------------------------------------------------*/
+
+enum {
+    server_batch = 64,
+    server_burst = 16
+};
+
+/* Per-connection read state. A v2 request arrives as one record, so it's
+ * read in one go. A v1 request is a header record followed by a body record,
+ * and the body can arrive on a later wakeup than the header.
+ *
+ * With workers, 'busy' counts the connection's requests that haven't been
+ * collected yet. A connection is 'paused' (taken out of the epoll set) while
+ * an untagged request is with the workers, so that its responses stay in
+ * order, or while it's 'stalled' waiting for room in the worker queue. A
+ * connection that has to be dropped while it's busy is 'closing', and is
+ * dropped once its last request is collected.
+ *
+ * Connections are non-blocking. Responses that the socket won't take
+ * straight away wait on the 'out' queue, which 'out_lock' guards since
+ * workers respond too, and which is flushed when epoll reports the socket
+ * writable. A client that lets more than the server's output limit pile up
+ * is 'out_failed', and is dropped. */
+
+struct socks_output {
+    struct socks_output *next;
+    char *data;
+    size_t nbyte;
+    unsigned int nfds;
+    int fds[];
+};
+
+struct socks_conn {
+    struct socks_conn *prev;
+    struct socks_conn *next;
+    struct socks_conn *stalled_next;
+    struct socks_server *server;
+    int fd;
+    bool in_body;
+    struct socks_frame frame;
+    uint32_t body_used;
+    uint32_t msgsize;
+    char *body;
+    unsigned int busy;
+    bool paused;
+    bool stalled;
+    bool closing;
+    bool want_write;
+    struct socks_subscriber *sub;
+    pthread_mutex_t out_lock;
+    struct socks_output *out_head;
+    struct socks_output *out_tail;
+    size_t out_bytes;
+    bool out_failed;
+};
+
+/* A pushed event. One copy is shared by every subscriber queue that holds
+ * it. Events are only touched by the thread that runs the server, so the
+ * reference count is a plain integer. */
+
+struct socks_push {
+    unsigned int refs;
+    uint32_t nbyte;
+    char data[];
+};
+
+/* A subscribed connection's queue of events that couldn't be sent yet, as a
+ * ring of up to 'capacity' entries. For v1 subscribers, 'header_sent' is set
+ * when the head event's header record went out but its body didn't. A
+ * 'dead' subscriber overflowed with socks_overflow_disconnect, and is just
+ * waiting for its connection to be dropped. */
+
+struct socks_subscriber {
+    struct socks_subscriber *prev;
+    struct socks_subscriber *next;
+    struct socks_conn *conn;
+    unsigned int version;
+    enum socks_overflow overflow;
+    bool header_sent;
+    bool dead;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+    struct socks_push *queue[];
+};
+
+/* A request handed to the workers. Jobs are allocated up front, and the free
+ * ones are only touched by the thread that runs the server. */
+
+struct socks_job {
+    struct socks_job *next;
+    struct socks_conn *conn;
+    int fd;
+    char *body;
+    uint32_t msgsize;
+    struct socks_frame frame;
+    int result;
+};
+
+/* Workers take jobs from 'queue' and put them on 'done' when the callback
+ * returns, then write to 'wake_fd' (an eventfd in the server's epoll set) so
+ * that the server thread collects them. */
+
+struct socks_workers {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    socks_callback_t callback;
+    struct socks_job *queue_head;
+    struct socks_job *queue_tail;
+    struct socks_job *done;
+    bool stopping;
+    int wake_fd;
+    unsigned int nthreads;
+    pthread_t *threads;
+    struct socks_job *jobs;
+    struct socks_job *free_jobs;
+    socks_serial_t serial;
+    struct socks_conn *stalled_head;
+    struct socks_conn *stalled_tail;
+};
+
+/* The listening socket is registered with a NULL data.ptr, the workers'
+ * wake_fd with a pointer to the socks_workers, and each connection with a
+ * pointer to its socks_conn. */
+
+struct socks_server {
+    int socket_fd;
+    int socket_flags;
+    int epoll_fd;
+    socks_callback_t callback;
+    unsigned int max_connections;
+    unsigned int count;
+    bool accepting;
+    struct socks_conn *conns;
+    struct socks_workers *workers;
+    struct socks_conn *dispatching;
+    struct socks_subscriber *subscribers;
+    unsigned long dropped;
+    size_t output_limit;
+};
+
+static int server_set_accepting(struct socks_server *server, bool accepting)
+{
+    struct epoll_event event = {.events = accepting ? EPOLLIN : 0};
+
+    if (server->accepting == accepting) {
+        return 0;
+    }
+
+    event.data.ptr = NULL;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->socket_fd,
+                  &event) != 0) {
+        return -1;
+    }
+
+    server->accepting = accepting;
+    return 0;
+}
+
+static uint32_t conn_events(const struct socks_conn *conn)
+{
+    return conn->want_write ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+}
+
+static void conn_pause(struct socks_server *server, struct socks_conn *conn)
+{
+    if (conn->paused == false) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->paused = true;
+    }
+}
+
+static int conn_resume(struct socks_server *server, struct socks_conn *conn)
+{
+    struct epoll_event event = {.events = conn_events(conn)};
+
+    if (conn->paused == false) {
+        return 0;
+    }
+
+    event.data.ptr = conn;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) != 0) {
+        return -1;
+    }
+
+    conn->paused = false;
+    return 0;
+}
+
+static void conn_want_write(struct socks_server *server,
+                            struct socks_conn *conn, bool want_write)
+{
+    struct epoll_event event;
+
+    if (conn->want_write == want_write) {
+        return;
+    }
+
+    conn->want_write = want_write;
+
+    if (conn->paused == false) {
+        event.events = conn_events(conn);
+        event.data.ptr = conn;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+}
+
+/* Asks epoll to report when the connection is writable, for as long as it
+ * has queued responses or its subscriber has queued events. */
+static void conn_update_write(struct socks_server *server,
+                              struct socks_conn *conn)
+{
+    bool want_write;
+
+    pthread_mutex_lock(&conn->out_lock);
+    want_write = (conn->out_head != NULL);
+    pthread_mutex_unlock(&conn->out_lock);
+
+    if ((conn->sub != NULL) && (conn->sub->count != 0)) {
+        want_write = true;
+    }
+
+    conn_want_write(server, conn, want_write);
+}
+
+static bool conn_failed(struct socks_conn *conn)
+{
+    bool failed;
+
+    pthread_mutex_lock(&conn->out_lock);
+    failed = conn->out_failed;
+    pthread_mutex_unlock(&conn->out_lock);
+    return failed;
+}
+
+static void push_release(struct socks_push *push)
+{
+    if (--push->refs == 0) {
+        free(push);
+    }
+}
+
+static void sub_clear(struct socks_subscriber *sub)
+{
+    while (sub->count != 0) {
+        push_release(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % sub->capacity;
+        sub->count--;
+    }
+
+    sub->header_sent = false;
+}
+
+static void sub_free(struct socks_server *server, struct socks_subscriber *sub)
+{
+    sub_clear(sub);
+
+    if (sub->prev != NULL) {
+        sub->prev->next = sub->next;
+    } else {
+        server->subscribers = sub->next;
+    }
+
+    if (sub->next != NULL) {
+        sub->next->prev = sub->prev;
+    }
+
+    sub->conn->sub = NULL;
+    free(sub);
+}
+
+/* Disconnects a subscriber that fell too far behind. The connection isn't
+ * dropped here, since that could happen in the middle of handling another
+ * connection's events. Shutting it down makes it readable at EOF, and it's
+ * dropped when that's handled. */
+static void sub_kill(struct socks_server *server, struct socks_subscriber *sub)
+{
+    pthread_mutex_lock(&sub->conn->out_lock);
+    sub_clear(sub);
+    pthread_mutex_unlock(&sub->conn->out_lock);
+    sub->dead = true;
+    conn_update_write(server, sub->conn);
+    shutdown(sub->conn->fd, SHUT_RDWR);
+}
+
+/* Tries to send one event without blocking. Returns 1 if it was sent, 0 if
+ * the socket is full, or -1 in the event of an error. A v1 event is two
+ * records, so it can go out half at a time. */
+static int sub_send(struct socks_subscriber *sub, const struct socks_push *push)
+{
+    char header[socks_header_size];
+    ssize_t result;
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = (void *) push->data, .iov_len = push->nbyte}
+    };
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+
+    if (sub->version == 2) {
+        serialize_uint32(header, push->nbyte | socks_v2_flag);
+    } else if (sub->header_sent == false) {
+        serialize_uint32(header, push->nbyte);
+        msg.msg_iovlen = 1;
+    } else {
+        msg.msg_iov = &iov[1];
+        msg.msg_iovlen = 1;
+    }
+
+    result = sendmsg_nointr(sub->conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (result < 0) {
+        return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+    }
+
+    if ((sub->version == 1) && (sub->header_sent == false) &&
+        (push->nbyte != 0)) {
+        sub->header_sent = true;
+        return sub_send(sub, push);
+    }
+
+    sub->header_sent = false;
+    return 1;
+}
+
+/* Adds an event to a subscriber's queue, making room as its overflow policy
+ * says. */
+static void sub_enqueue(struct socks_server *server,
+                        struct socks_subscriber *sub, struct socks_push *push)
+{
+    unsigned int victim;
+
+    if (sub->count == sub->capacity) {
+        if (sub->overflow == socks_overflow_disconnect) {
+            sub_kill(server, sub);
+            return;
+        }
+
+        /* Drop the oldest event, unless half of it has already been sent, in
+         * which case the next one goes instead. */
+
+        victim = sub->header_sent ? 1 : 0;
+        server->dropped++;
+
+        if (victim >= sub->count) {
+            return;
+        }
+
+        push_release(sub->queue[(sub->head + victim) % sub->capacity]);
+
+        if (victim == 0) {
+            sub->head = (sub->head + 1) % sub->capacity;
+        } else {
+            sub->queue[(sub->head + 1) % sub->capacity] =
+                sub->queue[sub->head];
+            sub->head = (sub->head + 1) % sub->capacity;
+        }
+
+        sub->count--;
+    }
+
+    push->refs++;
+    sub->queue[(sub->head + sub->count) % sub->capacity] = push;
+    sub->count++;
+    conn_want_write(server, sub->conn, true);
+}
+
+/* Sends as much of a subscriber's queue as the socket will take. Returns 0,
+ * or -1 if the connection failed. */
+static int sub_flush(struct socks_subscriber *sub)
+{
+    int result;
+
+    while (sub->count != 0) {
+        result = sub_send(sub, sub->queue[sub->head]);
+
+        if (result <= 0) {
+            return result;
+        }
+
+        push_release(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % sub->capacity;
+        sub->count--;
+    }
+
+    return 0;
+}
+
+static void output_free(struct socks_output *output)
+{
+    close_fds(output->fds, output->nfds);
+    free(output);
+}
+
+/* Returns true if a new record can go straight out on the connection: none
+ * of its responses are queued, and it isn't halfway through a v1 event. */
+static bool conn_idle(const struct socks_conn *conn)
+{
+    return (conn->out_head == NULL) &&
+           ((conn->sub == NULL) || (conn->sub->header_sent == false));
+}
+
+/* Sends one record without blocking, or queues it if the socket is full.
+ * Returns 0, or -1 if the connection failed or the record would take the
+ * queue over the server's output limit. Called with 'out_lock' held. */
+static int conn_send_record(struct socks_conn *conn, const struct iovec *iov,
+                            int iovcnt, const int *fds, unsigned int nfds)
+{
+    struct socks_output *output;
+    union fd_control control;
+    size_t nbyte = 0;
+    size_t used = 0;
+    ssize_t result;
+
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *) iov,
+        .msg_iovlen = (size_t) iovcnt
+    };
+
+    for (int x = 0; x < iovcnt; x++) {
+        nbyte += iov[x].iov_len;
+    }
+
+    if (conn_idle(conn)) {
+        if (nfds != 0) {
+            control_put_fds(&msg, &control, fds, nfds);
+        }
+
+        result = sendmsg_nointr(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (result >= 0) {
+            return 0;
+        }
+
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            return -1;
+        }
+    }
+
+    /* One record can always be queued, however big it is, so that a large
+     * response doesn't cost the client its connection on its own. */
+
+    if ((conn->out_bytes != 0) &&
+        ((conn->out_bytes + nbyte) > conn->server->output_limit)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    output = malloc(sizeof(*output) + (nfds * sizeof(int)) + nbyte);
+
+    if (output == NULL) {
+        return -1;
+    }
+
+    output->next = NULL;
+    output->data = (char *) &output->fds[nfds];
+    output->nbyte = nbyte;
+    output->nfds = 0;
+
+    for (int x = 0; x < iovcnt; x++) {
+        memcpy(output->data + used, iov[x].iov_base, iov[x].iov_len);
+        used += iov[x].iov_len;
+    }
+
+    while (output->nfds < nfds) {
+        output->fds[output->nfds] = fcntl(fds[output->nfds], F_DUPFD_CLOEXEC,
+                                          0);
+
+        if (output->fds[output->nfds] < 0) {
+            output_free(output);
+            return -1;
+        }
+
+        output->nfds++;
+    }
+
+    if (conn->out_tail != NULL) {
+        conn->out_tail->next = output;
+    } else {
+        conn->out_head = output;
+    }
+
+    conn->out_tail = output;
+    conn->out_bytes += nbyte;
+    return 0;
+}
+
+/* Sends a response on a socks_server connection. This can be called from
+ * any thread; the server thread notices queued output when it next looks
+ * at the connection (see conn_update_write()). */
+static ssize_t conn_send(struct socks_conn *conn, const void *buf,
+                         uint32_t nbyte, const struct socks_frame *frame,
+                         const int *fds, unsigned int nfds)
+{
+    char header[socks_tagged_header_size];
+    int result;
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = socks_header_size},
+        {.iov_base = (void *) buf, .iov_len = nbyte}
+    };
+
+    if (nfds > socks_max_fds) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (frame->version == 1) {
+        serialize_uint32(header, nbyte);
+    } else {
+        iov[0].iov_len = frame_header_encode(header, nbyte, frame);
+
+        if (iov[0].iov_len == 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&conn->out_lock);
+
+    if (conn->out_failed) {
+        errno = EPIPE;
+        result = -1;
+    } else if (frame->version == 1) {
+        result = conn_send_record(conn, iov, 1, fds, nfds);
+
+        if ((result == 0) && (nbyte != 0)) {
+            result = conn_send_record(conn, &iov[1], 1, NULL, 0);
+        }
+    } else {
+        result = conn_send_record(conn, iov, 2, fds, nfds);
+    }
+
+    if (result < 0) {
+        conn->out_failed = true;
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+    return (result < 0) ? -1 : (ssize_t) nbyte;
+}
+
+/* Sends as much of the connection's queued responses as the socket will
+ * take. Returns 0, or -1 if the connection failed. Called with 'out_lock'
+ * held. */
+static int conn_flush_output(struct socks_conn *conn)
+{
+    struct socks_output *output;
+    union fd_control control;
+    struct iovec iov;
+    struct msghdr msg;
+
+    while ((output = conn->out_head) != NULL) {
+        iov.iov_base = output->data;
+        iov.iov_len = output->nbyte;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (output->nfds != 0) {
+            control_put_fds(&msg, &control, output->fds, output->nfds);
+        }
+
+        if (sendmsg_nointr(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+        }
+
+        conn->out_head = output->next;
+
+        if (conn->out_head == NULL) {
+            conn->out_tail = NULL;
+        }
+
+        conn->out_bytes -= output->nbyte;
+        output_free(output);
+    }
+
+    return 0;
+}
+
+/* Handles a writable connection. A v1 event that's been half sent has to be
+ * finished first, then queued responses go out ahead of queued events.
+ * Returns 0, or -1 if the connection failed. */
+static int conn_flush(struct socks_server *server, struct socks_conn *conn)
+{
+    struct socks_subscriber *sub = conn->sub;
+    int result = 0;
+
+    pthread_mutex_lock(&conn->out_lock);
+
+    if ((sub != NULL) && sub->header_sent) {
+        result = sub_flush(sub);
+    }
+
+    if ((result == 0) && ((sub == NULL) || (sub->header_sent == false))) {
+        result = conn_flush_output(conn);
+    }
+
+    if ((result == 0) && (sub != NULL) && conn_idle(conn)) {
+        result = sub_flush(sub);
+    }
+
+    if (result < 0) {
+        conn->out_failed = true;
+    }
+
+    pthread_mutex_unlock(&conn->out_lock);
+    conn_update_write(server, conn);
+    return result;
+}
+
+/* Takes a connection off the list of those waiting for room in the worker
+ * queue. */
+static void workers_unstall(struct socks_workers *workers,
+                            struct socks_conn *conn)
+{
+    struct socks_conn **link = &workers->stalled_head;
+    struct socks_conn *previous = NULL;
+
+    while (*link != conn) {
+        previous = *link;
+        link = &previous->stalled_next;
+    }
+
+    *link = conn->stalled_next;
+
+    if (workers->stalled_tail == conn) {
+        workers->stalled_tail = previous;
+    }
+
+    conn->stalled = false;
+    conn->stalled_next = NULL;
+}
+
+static void server_drop(struct socks_server *server, struct socks_conn *conn)
+{
+    struct socks_output *output;
+
+    conn_pause(server, conn);
+
+    /* Workers still hold the descriptor, so it can't be closed (and its
+     * number reused) until they're done with it. */
+
+    if (conn->busy != 0) {
+        conn->closing = true;
+        return;
+    }
+
+    /* A stalled connection can be dropped from workers_collect() while it's
+     * still queued for room, so it has to come off that list first. */
+
+    if (conn->stalled) {
+        workers_unstall(server->workers, conn);
+    }
+
+    if (conn->sub != NULL) {
+        sub_free(server, conn->sub);
+    }
+
+    while ((output = conn->out_head) != NULL) {
+        conn->out_head = output->next;
+        output_free(output);
+    }
+
+    pthread_mutex_destroy(&conn->out_lock);
+    close_nointr(conn->fd);
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        server->conns = conn->next;
+    }
+
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+
+    buffer_put(conn->body, (size_t) conn->msgsize + 1);
+    free(conn);
+    server->count--;
+
+    if (server->count < server->max_connections) {
+        server_set_accepting(server, true);
+    }
+}
+
+static int server_add(struct socks_server *server, int fd)
+{
+    struct socks_conn *conn = calloc(1, sizeof(*conn));
+
+    if (conn == NULL) {
+        close_nointr(fd);
+        return -1;
+    }
+
+    conn->server = server;
+    conn->fd = fd;
+    conn->paused = true;
+    pthread_mutex_init(&conn->out_lock, NULL);
+
+    if (conn_resume(server, conn) != 0) {
+        pthread_mutex_destroy(&conn->out_lock);
+        close_nointr(fd);
+        free(conn);
+        return -1;
+    }
+
+    conn->next = server->conns;
+
+    if (conn->next != NULL) {
+        conn->next->prev = conn;
+    }
+
+    server->conns = conn;
+    server->count++;
+
+    if (server->count >= server->max_connections) {
+        return server_set_accepting(server, false);
+    }
+
+    return 0;
+}
+
+/* Accepts every connection that's waiting (up to max_connections), so that
+ * a burst of clients is cleared in one wakeup instead of one per pass
+ * through epoll_wait(). The listening socket is non-blocking while the
+ * server owns it, and so are connections, so that a client that stops
+ * reading can't hold up the server (see conn_send()). */
+static int server_accept(struct socks_server *server)
+{
+    int fd;
+
+    while (server->accepting) {
+        fd = accept4(server->socket_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if ((fd < 0) && ((errno == EINTR) || (errno == ECONNABORTED))) {
+            continue;
+        }
+
+        if (fd < 0) {
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+        }
+
+        if (server_add(server, fd) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void * worker_main(void *arg)
+{
+    struct socks_workers *workers = arg;
+    struct socks_job *job;
+    uint64_t one = 1;
+
+    while (1) {
+        pthread_mutex_lock(&workers->lock);
+
+        while ((workers->stopping == false) && (workers->queue_head == NULL)) {
+            pthread_cond_wait(&workers->ready, &workers->lock);
+        }
+
+        if (workers->stopping) {
+            pthread_mutex_unlock(&workers->lock);
+            return NULL;
+        }
+
+        job = workers->queue_head;
+        workers->queue_head = job->next;
+
+        if (workers->queue_head == NULL) {
+            workers->queue_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&workers->lock);
+
+        job->result = socks_dispatch(job->fd, job->conn, workers->callback,
+                                     job->body, job->msgsize, &job->frame);
+
+        pthread_mutex_lock(&workers->lock);
+        job->next = workers->done;
+        workers->done = job;
+        pthread_mutex_unlock(&workers->lock);
+
+        write_nointr(workers->wake_fd, &one, sizeof(one));
+    }
+}
+
+/* Takes the connection's finished request and queues it for the workers. */
+static void workers_submit(struct socks_server *server,
+                           struct socks_conn *conn)
+{
+    struct socks_workers *workers = server->workers;
+    struct socks_job *job = workers->free_jobs;
+
+    workers->free_jobs = job->next;
+    job->next = NULL;
+    job->conn = conn;
+    job->fd = conn->fd;
+    job->body = conn->body;
+    job->msgsize = conn->msgsize;
+    job->frame = conn->frame;
+    conn->busy++;
+
+    pthread_mutex_lock(&workers->lock);
+
+    if (workers->queue_tail != NULL) {
+        workers->queue_tail->next = job;
+    } else {
+        workers->queue_head = job;
+    }
+
+    workers->queue_tail = job;
+    pthread_cond_signal(&workers->ready);
+    pthread_mutex_unlock(&workers->lock);
+}
+
+/* Parks a connection until there's room in the worker queue. */
+static void workers_stall(struct socks_server *server,
+                          struct socks_conn *conn)
+{
+    struct socks_workers *workers = server->workers;
+
+    conn_pause(server, conn);
+
+    if (conn->stalled) {
+        return;
+    }
+
+    conn->stalled = true;
+    conn->stalled_next = NULL;
+
+    if (workers->stalled_tail != NULL) {
+        workers->stalled_tail->stalled_next = conn;
+    } else {
+        workers->stalled_head = conn;
+    }
+
+    workers->stalled_tail = conn;
+}
+
+/* Finishes the requests that the workers are done with: releases their
+ * buffers and jobs, drops connections whose callbacks failed, and resumes
+ * connections that were waiting on them. */
+static void workers_collect(struct socks_server *server)
+{
+    struct socks_workers *workers = server->workers;
+    struct socks_job *done;
+    struct socks_job *job;
+    struct socks_conn *conn;
+    uint64_t count;
+
+    read_nointr(workers->wake_fd, &count, sizeof(count));
+
+    pthread_mutex_lock(&workers->lock);
+    done = workers->done;
+    workers->done = NULL;
+    pthread_mutex_unlock(&workers->lock);
+
+    while (done != NULL) {
+        job = done;
+        done = job->next;
+        conn = job->conn;
+
+        buffer_put(job->body, (size_t) job->msgsize + 1);
+        job->next = workers->free_jobs;
+        workers->free_jobs = job;
+        conn->busy--;
+
+        if ((job->result < 0) || conn_failed(conn)) {
+            conn->closing = true;
+        } else {
+            conn_update_write(server, conn);
+        }
+
+        if (conn->busy != 0) {
+            continue;
+        }
+
+        if (conn->closing) {
+            server_drop(server, conn);
+        } else if (conn->stalled == false) {
+            conn_resume(server, conn);
+        }
+    }
+
+    while ((workers->stalled_head != NULL) && (workers->free_jobs != NULL)) {
+        conn = workers->stalled_head;
+        workers->stalled_head = conn->stalled_next;
+
+        if (workers->stalled_head == NULL) {
+            workers->stalled_tail = NULL;
+        }
+
+        conn->stalled = false;
+
+        if (conn->closing) {
+            server_drop(server, conn);
+        } else if ((conn->busy == 0) || conn->frame.tagged) {
+            conn_resume(server, conn);
+        }
+    }
+}
+
+static void workers_stop(struct socks_workers *workers)
+{
+    pthread_mutex_lock(&workers->lock);
+    workers->stopping = true;
+    pthread_cond_broadcast(&workers->ready);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (unsigned int x = 0; x < workers->nthreads; x++) {
+        pthread_join(workers->threads[x], NULL);
+    }
+}
+
+static void workers_free(struct socks_workers *workers)
+{
+    if (workers->wake_fd >= 0) {
+        close_nointr(workers->wake_fd);
+    }
+
+    pthread_cond_destroy(&workers->ready);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers->threads);
+    free(workers->jobs);
+    free(workers);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Reads whatever is available for the connection's current request. Returns
+ * 1 once the request is complete, 0 if more data is needed, or -1 if the
+ * connection should be closed. */
+static int conn_read(struct socks_conn *conn)
+{
+    char header[socks_header_size];
+    ssize_t result;
+
+    if (conn->in_body == false) {
+        result = socks_peek_header(conn->fd, &conn->msgsize, &conn->frame,
+                                   MSG_DONTWAIT);
+
+        if (result < 0) {
+            return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+        }
+
+        if (conn->msgsize > max_message) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        conn->body = buffer_get((size_t) conn->msgsize + 1);
+
+        if (conn->body == NULL) {
+            return -1;
+        }
+
+        if (conn->frame.version == 2) {
+            result = socks_recv_record(conn->fd, conn->body, conn->msgsize,
+                                       &conn->frame, MSG_DONTWAIT);
+
+            if (result < 0) {
+                return -1;
+            }
+
+            conn->body[conn->msgsize] = '\x00';
+            return 1;
+        }
+
+        if (recv(conn->fd, header, sizeof(header), MSG_DONTWAIT) !=
+            sizeof(header)) {
+            return -1;
+        }
+
+        conn->in_body = true;
+    }
+
+    if (conn->body_used < conn->msgsize) {
+        result = recv(conn->fd, conn->body + conn->body_used,
+                      conn->msgsize - conn->body_used, MSG_DONTWAIT);
+
+        if (result <= 0) {
+            return ((result < 0) && ((errno == EAGAIN) || (errno == EINTR))) ?
+                   0 : -1;
+        }
+
+        conn->body_used += (uint32_t) result;
+
+        if (conn->body_used < conn->msgsize) {
+            return 0;
+        }
+    }
+
+    conn->body[conn->msgsize] = '\x00';
+    return 1;
+}
+
+/* Returns true if the request that 'conn' just read has to run on the server
+ * thread. A batch does if any of its items do. */
+static bool request_is_serial(const struct socks_workers *workers,
+                              const struct socks_conn *conn)
+{
+    const char *cursor = conn->body + 4;
+    const char *end = conn->body + conn->msgsize;
+    const char *item;
+    uint32_t nbyte;
+
+    if (workers->serial == NULL) {
+        return false;
+    }
+
+    if (conn->frame.batch == false) {
+        return workers->serial(conn->body, conn->msgsize);
+    }
+
+    if (batch_count(conn->body, conn->msgsize) < 0) {
+        return true;
+    }
+
+    while (batch_next(&cursor, end, &item, &nbyte) > 0) {
+        if (workers->serial(item, nbyte)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Handles a readable connection. Returns the number of requests handled, or
+ * -1 if the connection was closed. With workers, requests that aren't
+ * marked as serial are handed off instead of being run here. */
+static int server_service(struct socks_server *server, struct socks_conn *conn)
+{
+    struct socks_workers *workers = server->workers;
+    int handled = 0;
+    int result;
+
+    while ((handled < server_burst) && (conn->paused == false)) {
+        if ((workers != NULL) && (workers->free_jobs == NULL)) {
+            workers_stall(server, conn);
+            break;
+        }
+
+        result = conn_read(conn);
+
+        if (result == 0) {
+            break;
+        }
+
+        if (result > 0) {
+            if ((workers != NULL) && !request_is_serial(workers, conn)) {
+                workers_submit(server, conn);
+
+                if (conn->frame.tagged == false) {
+                    conn_pause(server, conn);
+                }
+
+                result = 0;
+            } else {
+                server->dispatching = conn;
+                result = socks_dispatch(conn->fd, conn, server->callback,
+                                        conn->body, conn->msgsize,
+                                        &conn->frame);
+                server->dispatching = NULL;
+                buffer_put(conn->body, (size_t) conn->msgsize + 1);
+
+                if (conn_failed(conn)) {
+                    result = -1;
+                }
+            }
+
+            conn->body = NULL;
+            conn->in_body = false;
+            conn->body_used = 0;
+            conn->msgsize = 0;
+            handled++;
+        }
+
+        if (result < 0) {
+            server_drop(server, conn);
+            return -1;
+        }
+    }
+
+    conn_update_write(server, conn);
+    return handled;
+}
+
+struct socks_server * socks_server_create(int socket_fd,
+                                          socks_callback_t callback,
+                                          unsigned int max_connections)
+{
+    struct epoll_event event = {.events = EPOLLIN};
+    struct socks_server *server;
+
+    if ((callback == NULL) || (max_connections == 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    server = calloc(1, sizeof(*server));
+
+    if (server == NULL) {
+        return NULL;
+    }
+
+    server->socket_fd = socket_fd;
+    server->socket_flags = fcntl(socket_fd, F_GETFL);
+    server->callback = callback;
+    server->max_connections = max_connections;
+    server->accepting = true;
+    server->output_limit = socks_default_output_limit;
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event.data.ptr = NULL;
+
+    if ((server->socket_flags < 0) || (server->epoll_fd < 0) ||
+        (fcntl(socket_fd, F_SETFL, server->socket_flags | O_NONBLOCK) != 0) ||
+        (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) != 0)) {
+        if (server->socket_flags >= 0) {
+            fcntl(socket_fd, F_SETFL, server->socket_flags);
+        }
+
+        if (server->epoll_fd >= 0) {
+            close_nointr(server->epoll_fd);
+        }
+
+        free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+int socks_server_start_workers(struct socks_server *server,
+                               unsigned int nthreads, unsigned int queue_depth,
+                               socks_serial_t serial)
+{
+    struct epoll_event event = {.events = EPOLLIN};
+    struct socks_workers *workers;
+    unsigned int njobs = nthreads + queue_depth;
+    sigset_t blocked;
+    sigset_t previous;
+    int result = 0;
+
+    if ((server->workers != NULL) || (nthreads == 0) || (queue_depth == 0) ||
+        (njobs < nthreads)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    workers = calloc(1, sizeof(*workers));
+
+    if (workers == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->ready, NULL);
+    workers->callback = server->callback;
+    workers->serial = serial;
+    workers->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    workers->threads = calloc(nthreads, sizeof(*workers->threads));
+    workers->jobs = calloc(njobs, sizeof(*workers->jobs));
+    event.data.ptr = workers;
+
+    if ((workers->wake_fd < 0) || (workers->threads == NULL) ||
+        (workers->jobs == NULL) ||
+        (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, workers->wake_fd,
+                   &event) != 0)) {
+        workers_free(workers);
+        return -1;
+    }
+
+    for (unsigned int x = 0; x < njobs; x++) {
+        workers->jobs[x].next = workers->free_jobs;
+        workers->free_jobs = &workers->jobs[x];
+    }
+
+    /* Signals are left to the thread that runs the server. */
+
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_SETMASK, &blocked, &previous);
+
+    while ((result == 0) && (workers->nthreads < nthreads)) {
+        result = pthread_create(&workers->threads[workers->nthreads], NULL,
+                                worker_main, workers);
+
+        if (result == 0) {
+            workers->nthreads++;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (result != 0) {
+        workers_stop(workers);
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, workers->wake_fd, NULL);
+        workers_free(workers);
+        errno = result;
+        return -1;
+    }
+
+    server->workers = workers;
+    return 0;
+}
+
+void socks_server_destroy(struct socks_server *server)
+{
+    struct socks_workers *workers;
+    struct socks_job *job;
+
+    if (server == NULL) {
+        return;
+    }
+
+    workers = server->workers;
+
+    /* Once the workers have stopped, the requests that they didn't get to
+     * are thrown away along with the finished ones. */
+
+    if (workers != NULL) {
+        workers_stop(workers);
+
+        while ((job = workers->queue_head) != NULL) {
+            workers->queue_head = job->next;
+            job->next = workers->done;
+            workers->done = job;
+        }
+
+        while ((job = workers->done) != NULL) {
+            workers->done = job->next;
+            buffer_put(job->body, (size_t) job->msgsize + 1);
+            job->conn->busy--;
+        }
+
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, workers->wake_fd, NULL);
+        workers_free(workers);
+        server->workers = NULL;
+    }
+
+    while (server->conns != NULL) {
+        server_drop(server, server->conns);
+    }
+
+    fcntl(server->socket_fd, F_SETFL, server->socket_flags);
+    close_nointr(server->epoll_fd);
+    free(server);
+}
+
+int socks_server_fd(const struct socks_server *server)
+{
+    return server->epoll_fd;
+}
+
+unsigned int socks_server_connections(const struct socks_server *server)
+{
+    return server->count;
+}
+
+void socks_server_set_output_limit(struct socks_server *server, size_t nbyte)
+{
+    server->output_limit = nbyte;
+}
+
+int socks_server_run(struct socks_server *server, int timeout_ms)
+{
+    struct epoll_event events[server_batch];
+    struct socks_conn *conn;
+    bool collect = false;
+    int handled = 0;
+    int ready;
+    int result;
+
+    ready = epoll_wait_nointr(server->epoll_fd, events, server_batch,
+                              timeout_ms);
+
+    if (ready < 0) {
+        return -1;
+    }
+
+    /* A connection can only be dropped while its own event is handled, so
+     * none of the later pointers in 'events' can go stale. Collecting from
+     * the workers can drop any connection, so it's left until the end. */
+
+    for (int x = 0; x < ready; x++) {
+        if (events[x].data.ptr == NULL) {
+            server_accept(server);
+            continue;
+        }
+
+        if (events[x].data.ptr == server->workers) {
+            collect = true;
+            continue;
+        }
+
+        conn = events[x].data.ptr;
+
+        if ((events[x].events & EPOLLOUT) && (conn_flush(server, conn) < 0)) {
+            server_drop(server, conn);
+            continue;
+        }
+
+        if ((events[x].events & ~(uint32_t) EPOLLOUT) == 0) {
+            continue;
+        }
+
+        result = server_service(server, conn);
+
+        if (result > 0) {
+            handled += result;
+        }
+    }
+
+    if (collect) {
+        workers_collect(server);
+    }
+
+    return handled;
+}
+
+int socks_server_subscribe(struct socks_server *server, int fd,
+                           unsigned int max_queued,
+                           enum socks_overflow overflow)
+{
+    struct socks_conn *conn = server->dispatching;
+    struct socks_subscriber *sub;
+
+    if ((conn == NULL) || (conn->fd != fd) || (conn->sub != NULL) ||
+        (max_queued == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sub = calloc(1, sizeof(*sub) + (max_queued * sizeof(sub->queue[0])));
+
+    if (sub == NULL) {
+        return -1;
+    }
+
+    sub->conn = conn;
+    sub->version = conn->frame.version;
+    sub->overflow = overflow;
+    sub->capacity = max_queued;
+    sub->next = server->subscribers;
+
+    if (sub->next != NULL) {
+        sub->next->prev = sub;
+    }
+
+    server->subscribers = sub;
+    pthread_mutex_lock(&conn->out_lock);
+    conn->sub = sub;
+    pthread_mutex_unlock(&conn->out_lock);
+    return 0;
+}
+
+int socks_server_publish(struct socks_server *server, const void *buf,
+                         uint32_t nbyte)
+{
+    struct socks_push *push;
+    int reached = 0;
+    int result;
+
+    if (server->subscribers == NULL) {
+        return 0;
+    }
+
+    push = malloc(sizeof(*push) + nbyte);
+
+    if (push == NULL) {
+        return -1;
+    }
+
+    push->refs = 1;
+    push->nbyte = nbyte;
+    memcpy(push->data, buf, nbyte);
+
+    /* Subscribers that are keeping up get the event straight away. It's only
+     * copied into a queue when the socket is full. */
+
+    for (struct socks_subscriber *sub = server->subscribers; sub != NULL;
+         sub = sub->next) {
+        if (sub->dead) {
+            continue;
+        }
+
+        pthread_mutex_lock(&sub->conn->out_lock);
+        result = ((sub->count == 0) && conn_idle(sub->conn)) ?
+                 sub_send(sub, push) : 0;
+        pthread_mutex_unlock(&sub->conn->out_lock);
+
+        if (result < 0) {
+            sub_kill(server, sub);
+            continue;
+        }
+
+        if (result == 0) {
+            sub_enqueue(server, sub, push);
+        }
+
+        reached += (sub->dead == false);
+    }
+
+    push_release(push);
+    return reached;
+}
+
+unsigned long socks_server_dropped(const struct socks_server *server)
+{
+    return server->dropped;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* A request that's been sent on a session and hasn't been claimed yet. Once
+ * its response arrives ahead of a socks_session_recv() call for it, the
+ * response is kept in 'data' until it's claimed. */
+
+struct socks_call {
+    struct socks_call *next;
+    uint32_t id;
+    bool done;
+    uint32_t size;
+    char *data;
+};
+
+struct socks_session {
+    int fd;
+    uint32_t next_id;
+    struct socks_call *calls;
+};
+
+static struct socks_call ** session_find(struct socks_session *session,
+                                         uint32_t id)
+{
+    struct socks_call **link = &session->calls;
+
+    while ((*link != NULL) && ((*link)->id != id)) {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+static void session_forget(struct socks_call **link)
+{
+    struct socks_call *call = *link;
+
+    *link = call->next;
+    free(call->data);
+    free(call);
+}
+
+/* Receives the next response on the session. If it's the one for 'wanted',
+ * it goes straight into 'output'; otherwise it's stored with its call (or
+ * discarded if nobody is waiting for it). Returns the size of the wanted
+ * response, -2 if a different one was received, or -1 in the event of an
+ * error. */
+static ssize_t session_recv_next(struct socks_session *session,
+                                 uint32_t wanted, char *output,
+                                 uint32_t bufsize)
+{
+    char header[socks_tagged_header_size];
+    struct socks_frame frame;
+    struct socks_call **link;
+    uint32_t msgsize;
+    char *data;
+
+    if (socks_peek_header(session->fd, &msgsize, &frame, 0) < 0) {
+        return -1;
+    }
+
+    if (frame.tagged == false) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    link = session_find(session, frame.id);
+
+    /* Reading just the header of a SEQPACKET record discards the rest of
+     * it, which is how unwanted and oversized responses are dropped. */
+
+    if ((*link == NULL) || ((frame.id == wanted) && (msgsize > bufsize))) {
+        if (recv(session->fd, header, sizeof(header), 0) < 0) {
+            return -1;
+        }
+
+        if (*link == NULL) {
+            return -2;
+        }
+
+        session_forget(link);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (frame.id == wanted) {
+        if (socks_recv_record(session->fd, output, msgsize, &frame, 0) < 0) {
+            return -1;
+        }
+
+        session_forget(link);
+        return (ssize_t) msgsize;
+    }
+
+    data = malloc((size_t) msgsize + 1);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (socks_recv_record(session->fd, data, msgsize, &frame, 0) < 0) {
+        free(data);
+        return -1;
+    }
+
+    (*link)->data = data;
+    (*link)->size = msgsize;
+    (*link)->done = true;
+    return -2;
+}
+
+struct socks_session * socks_session_open(const char *filename)
+{
+    struct socks_session *session = calloc(1, sizeof(*session));
+
+    if (session == NULL) {
+        return NULL;
+    }
+
+    session->fd = socks_connect(filename);
+
+    if (session->fd < 0) {
+        free(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+void socks_session_close(struct socks_session *session)
+{
+    if (session == NULL) {
+        return;
+    }
+
+    while (session->calls != NULL) {
+        session_forget(&session->calls);
+    }
+
+    close_nointr(session->fd);
+    free(session);
+}
+
+int socks_session_fd(const struct socks_session *session)
+{
+    return session->fd;
+}
+
+int socks_session_send(struct socks_session *session, const char *input,
+                       uint32_t nbyte, uint32_t *id)
+{
+    struct socks_frame frame = {.version = 2, .tagged = true};
+    struct socks_call *call = calloc(1, sizeof(*call));
+
+    if (call == NULL) {
+        return -1;
+    }
+
+    frame.id = session->next_id++;
+
+    if (socks_send(session->fd, input, nbyte, &frame, NULL, 0) < 0) {
+        free(call);
+        return -1;
+    }
+
+    call->id = frame.id;
+    call->next = session->calls;
+    session->calls = call;
+    *id = frame.id;
+    return 0;
+}
+
+ssize_t socks_session_recv(struct socks_session *session, uint32_t id,
+                           char *output, uint32_t bufsize)
+{
+    struct socks_call **link = session_find(session, id);
+    ssize_t result = -2;
+
+    if (*link == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (result == -2) {
+        if ((*link)->done) {
+            if ((*link)->size > bufsize) {
+                session_forget(link);
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            result = (ssize_t)(*link)->size;
+            memcpy(output, (*link)->data, (*link)->size);
+            session_forget(link);
+            return result;
+        }
+
+        result = session_recv_next(session, id, output, bufsize);
+
+        /* Storing another call's response can reorder the list, so look
+         * this one up again. */
+
+        link = session_find(session, id);
+    }
+
+    return result;
+}
+
+ssize_t socks_session_process(struct socks_session *session,
+                              const char *input, uint32_t nbyte,
+                              char *output, uint32_t bufsize)
+{
+    uint32_t id;
+
+    if (socks_session_send(session, input, nbyte, &id) < 0) {
+        return -1;
+    }
+
+    return socks_session_recv(session, id, output, bufsize);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Sessions that aren't in use wait on the 'idle' stack. 'open' counts every
+ * session that exists, whether it's idle or checked out by a caller. */
+
+struct socks_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    char *filename;
+    unsigned int max_sessions;
+    unsigned int open;
+    unsigned int idle_count;
+    struct socks_session **idle;
+};
+
+/* Checks out an idle session, or opens a new one if the pool has room.
+ * Blocks while every session is in use. */
+static struct socks_session * pool_take(struct socks_pool *pool)
+{
+    struct socks_session *session = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while ((pool->idle_count == 0) && (pool->open >= pool->max_sessions)) {
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+
+    if (pool->idle_count != 0) {
+        session = pool->idle[--pool->idle_count];
+    } else {
+        pool->open++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (session == NULL) {
+        session = socks_session_open(pool->filename);
+
+        if (session == NULL) {
+            pthread_mutex_lock(&pool->lock);
+            pool->open--;
+            pthread_cond_signal(&pool->available);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    return session;
+}
+
+/* Returns a session to the pool, or closes it if it's 'broken'. */
+static void pool_give(struct socks_pool *pool, struct socks_session *session,
+                      bool broken)
+{
+    if (broken) {
+        socks_session_close(session);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (broken) {
+        pool->open--;
+    } else {
+        pool->idle[pool->idle_count++] = session;
+    }
+
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Closes every idle session. Used once a session finds that the server went
+ * away, since the others were connected to the same server. */
+static void pool_drop_idle(struct socks_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->idle_count != 0) {
+        socks_session_close(pool->idle[--pool->idle_count]);
+        pool->open--;
+    }
+
+    pthread_cond_broadcast(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Whether a failed send means that the server has gone away (for example,
+ * because it restarted) and never got the request, so that it's safe to
+ * send again on a new connection. */
+static bool pool_should_reconnect(int error)
+{
+    return (error == EPIPE) || (error == ECONNRESET) ||
+           (error == ECONNREFUSED) || (error == ENOTCONN);
+}
+
+struct socks_pool * socks_pool_create(const char *filename,
+                                      unsigned int max_sessions)
+{
+    struct socks_pool *pool;
+
+    if (max_sessions == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->filename = strdup(filename);
+    pool->idle = calloc(max_sessions, sizeof(*pool->idle));
+    pool->max_sessions = max_sessions;
+
+    if ((pool->filename == NULL) || (pool->idle == NULL)) {
+        free(pool->filename);
+        free(pool->idle);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    return pool;
+}
+
+void socks_pool_destroy(struct socks_pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    for (unsigned int x = 0; x < pool->idle_count; x++) {
+        socks_session_close(pool->idle[x]);
+    }
+
+    pthread_cond_destroy(&pool->available);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->filename);
+    free(pool->idle);
+    free(pool);
+}
+
+ssize_t socks_pool_process(struct socks_pool *pool, const char *input,
+                           uint32_t nbyte, char *output, uint32_t bufsize)
+{
+    struct socks_session *session = pool_take(pool);
+    ssize_t result;
+    uint32_t id;
+    int error;
+
+    if (session == NULL) {
+        return -1;
+    }
+
+    result = socks_session_send(session, input, nbyte, &id);
+
+    /* An idle connection finds out that its server went away when it next
+     * sends. One reconnect covers a server that has since come back. */
+
+    if ((result < 0) && pool_should_reconnect(errno)) {
+        pool_give(pool, session, true);
+        pool_drop_idle(pool);
+        session = pool_take(pool);
+
+        if (session == NULL) {
+            return -1;
+        }
+
+        result = socks_session_send(session, input, nbyte, &id);
+    }
+
+    if (result >= 0) {
+        result = socks_session_recv(session, id, output, bufsize);
+    }
+
+    /* An oversized response is dropped without disturbing the connection.
+     * Anything else leaves the session in an unknown state. */
+
+    error = errno;
+    pool_give(pool, session, (result < 0) && (error != EMSGSIZE));
+    errno = error;
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+struct socks_batch_item {
+    int32_t status;
+    uint32_t nbyte;
+    const char *data;
+};
+
+/* 'request' is the envelope being built, with room for the item count at
+ * the front. 'response' holds the last reply, which 'results' points into.
+ * 'results' has room for 'results_size' items, and grows along with the
+ * request. */
+
+struct socks_batch {
+    struct batch_output request;
+    uint32_t count;
+    char *response;
+    struct socks_batch_item *results;
+    uint32_t results_size;
+    uint32_t nresults;
+};
+
+/* Checks a batch response against the request and indexes its items. */
+static int batch_parse(struct socks_batch *batch, uint32_t msgsize)
+{
+    const char *cursor = batch->response + 4;
+    const char *end = batch->response + msgsize;
+    struct socks_batch_item *item;
+
+    if ((msgsize < 4) ||
+        (deserialize_uint32(batch->response) != batch->count)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    for (uint32_t x = 0; x < batch->count; x++) {
+        item = &batch->results[x];
+
+        if ((size_t)(end - cursor) < 8) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        item->status = (int32_t) deserialize_uint32(cursor);
+        item->nbyte = deserialize_uint32(cursor + 4);
+        cursor += 8;
+
+        if ((size_t)(end - cursor) < item->nbyte) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        item->data = cursor;
+        cursor += item->nbyte;
+    }
+
+    if (cursor != end) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    batch->nresults = batch->count;
+    return 0;
+}
+
+struct socks_batch * socks_batch_create(void)
+{
+    struct socks_batch *batch = calloc(1, sizeof(*batch));
+
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    if (batch_reserve(&batch->request, 4) != 0) {
+        free(batch);
+        return NULL;
+    }
+
+    batch->request.used = 4;
+    return batch;
+}
+
+void socks_batch_destroy(struct socks_batch *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+
+    free(batch->request.data);
+    free(batch->response);
+    free(batch->results);
+    free(batch);
+}
+
+int socks_batch_add(struct socks_batch *batch, const char *input,
+                    uint32_t nbyte)
+{
+    struct socks_batch_item *results;
+    uint32_t size;
+
+    if ((batch->request.used + 4 + nbyte) > max_message) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (batch->count == batch->results_size) {
+        size = (batch->results_size != 0) ? (batch->results_size * 2) : 16;
+        results = realloc(batch->results, size * sizeof(*batch->results));
+
+        if (results == NULL) {
+            return -1;
+        }
+
+        batch->results = results;
+        batch->results_size = size;
+    }
+
+    if (batch_reserve(&batch->request, (size_t) nbyte + 4) != 0) {
+        return -1;
+    }
+
+    serialize_uint32(batch->request.data + batch->request.used, nbyte);
+    batch->request.used += 4;
+    batch_append(&batch->request, input, nbyte);
+    batch->count++;
+    return 0;
+}
+
+int socks_batch_process(const char *filename, struct socks_batch *batch)
+{
+    struct socks_frame frame = {.version = 2, .batch = true};
+    struct socks_frame reply;
+    uint32_t msgsize;
+    ssize_t result;
+    int error;
+    int fd;
+
+    batch->nresults = 0;
+    free(batch->response);
+    batch->response = NULL;
+    serialize_uint32(batch->request.data, batch->count);
+
+    fd = socks_connect(filename);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    result = socks_send(fd, batch->request.data,
+                        (uint32_t) batch->request.used, &frame, NULL, 0);
+
+    if (result >= 0) {
+        result = socks_peek_header(fd, &msgsize, &reply, 0);
+    }
+
+    if ((result >= 0) && (reply.batch == false)) {
+        errno = EPROTO;
+        result = -1;
+    }
+
+    if (result >= 0) {
+        batch->response = malloc((msgsize != 0) ? msgsize : 1);
+        result = (batch->response == NULL) ? -1 :
+                 socks_recv_record(fd, batch->response, msgsize, &reply, 0);
+    }
+
+    if (result >= 0) {
+        result = batch_parse(batch, msgsize);
+    }
+
+    error = errno;
+    close_nointr(fd);
+    errno = error;
+    return (result < 0) ? -1 : (int) batch->count;
+}
+
+int socks_batch_result(const struct socks_batch *batch, unsigned int index,
+                       const char **output, uint32_t *nbyte, int *status)
+{
+    if (index >= batch->nresults) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *output = batch->results[index].data;
+    *nbyte = batch->results[index].nbyte;
+    *status = batch->results[index].status;
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+ssize_t socks_send_fds(int fd, const void *buf, uint32_t nbyte,
+                       const int *fds, unsigned int nfds)
+{
+    char header[4];
+    union fd_control control;
+    ssize_t result;
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = (void *) buf, .iov_len = nbyte}
+    };
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+
+    if (nfds > socks_max_fds) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    serialize_uint32(header, nbyte);
+
+    if (nfds != 0) {
+        control_put_fds(&msg, &control, fds, nfds);
+    }
+
+    result = sendmsg_nointr(fd, &msg, MSG_NOSIGNAL);
+
+    if (result < 0) {
+        return result;
+    }
+
+    if ((size_t) result != (nbyte + sizeof(header))) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return (ssize_t) nbyte;
+}
+
+ssize_t socks_recv_fds(int fd, void *buf, size_t bufsize, int *fds,
+                       unsigned int *nfds)
+{
+    char header[4];
+    union fd_control control;
+    uint32_t msgsize;
+    ssize_t result;
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = buf, .iov_len = bufsize}
+    };
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control.data,
+        .msg_controllen = sizeof(control.data)
+    };
+
+    unsigned int capacity = *nfds;
+    *nfds = 0;
+
+    result = recvmsg_nointr(fd, &msg, MSG_CMSG_CLOEXEC);
+
+    if (result < 0) {
+        return result;
+    }
+
+    *nfds = control_get_fds(&msg, fds, capacity);
+
+    if (result == 0) {
+        errno = ECONNRESET;
+    } else if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        errno = EMSGSIZE;
+    } else if ((size_t) result < sizeof(header)) {
+        errno = EPROTO;
+    } else {
+        msgsize = deserialize_uint32(header);
+
+        if (msgsize == ((size_t) result - sizeof(header))) {
+            return (ssize_t) msgsize;
+        }
+
+        errno = EPROTO;
+    }
+
+    close_fds(fds, *nfds);
+    *nfds = 0;
+    return -1;
+}
+
+int socks_set_backlog(int backlog)
+{
+    if (backlog < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    listen_backlog = backlog;
+    return 0;
+}
+
+void socks_set_connect_deadline(unsigned int timeout_ms)
+{
+    connect_deadline_ms = timeout_ms;
+}
+
+void socks_get_connect_stats(struct socks_connect_stats *stats)
+{
+    stats->refused = atomic_load_explicit(&connects_refused,
+                                          memory_order_relaxed);
+    stats->retried = atomic_load_explicit(&connects_retried,
+                                          memory_order_relaxed);
+}
+
+int socks_set_max_message(uint32_t nbyte)
+{
+    if (nbyte & socks_flag_mask) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    max_message = nbyte;
+    return 0;
+}
+
+int socks_set_protocol(unsigned int version)
+{
+    if ((version != 1) && (version != 2)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    client_version = version;
+    return 0;
 }
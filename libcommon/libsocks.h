@@ -1,6 +1,7 @@
 #ifndef _LIBSOCKS_H_
 #define _LIBSOCKS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -13,6 +14,15 @@ typedef int (*socks_callback_t)(int response_fd, const char *buf,
                                 uint32_t nbyte);
 
 ssize_t socks_respond(int fd, const void *buf, uint32_t nbyte);
+
+/* Same as socks_respond(), but also passes up to socks_max_fds descriptors
+ * to the client (via SCM_RIGHTS), for example to hand out the read end of a
+ * pipe so that the client can read a service's output straight from the
+ * kernel. The caller still owns 'fds' and should close its copies. */
+
+ssize_t socks_respond_fds(int fd, const void *buf, uint32_t nbyte,
+                          const int *fds, unsigned int nfds);
+
 int socks_server_open(const char *filename);
 int socks_server_close(int socket_fd);
 
@@ -24,10 +34,325 @@ int socks_server_process(int socket_fd, socks_callback_t callback);
 ssize_t socks_client_process(const char *filename, const char *input,
                              uint32_t nbyte, char *output, uint32_t bufsize);
 
+/* Same as socks_client_process(), but also receives descriptors sent with
+ * socks_respond_fds(). On entry, *nfds holds the capacity of 'fds'; on
+ * return it holds the number of descriptors received (any beyond the
+ * capacity are closed). Received descriptors are marked close-on-exec. */
+
+ssize_t socks_client_process_fds(const char *filename, const char *input,
+                                 uint32_t nbyte, char *output,
+                                 uint32_t bufsize, int *fds,
+                                 unsigned int *nfds);
+
+/* Selects the framing that clients use for requests. Version 1 (the
+ * default) sends a header record and a body record, which every server
+ * understands; version 2 sends each message as a single record with one
+ * sendmsg(), and should only be selected once every server that the process
+ * talks to has been built with it, since older servers misread it. Servers
+ * accept both, and answer each request in the version it used. Returns 0 on
+ * a success, or -1 for an unknown version. */
+
+int socks_set_protocol(unsigned int version);
+
+enum {socks_default_max_message = 65536};
+
+/* Sets the size of the largest request that servers will accept (by default,
+ * socks_default_max_message). Bigger requests are refused with EMSGSIZE
+ * before their bodies are read, and the connection is closed. Returns 0 on a
+ * success, or -1 if 'nbyte' is too big for the protocol. */
+
+int socks_set_max_message(uint32_t nbyte);
+
+/* Sets the listen() backlog for sockets made by later socks_server_open()
+ * calls. The default is SOMAXCONN, and the kernel caps it at
+ * net.core.somaxconn. Returns 0 on a success, or -1 if 'backlog' is less
+ * than 1. */
+
+int socks_set_backlog(int backlog);
+
+enum {socks_default_connect_deadline = 1000};
+
+/* Clients retry connections that are refused (ECONNREFUSED or EAGAIN, as
+ * happens while the server restarts or when its listen queue is full) with
+ * jittered exponential backoff, for up to 'timeout_ms' milliseconds in
+ * total (by default, socks_default_connect_deadline). 0 turns retrying off. */
+
+void socks_set_connect_deadline(unsigned int timeout_ms);
+
+struct socks_connect_stats {
+    unsigned long refused;
+    unsigned long retried;
+};
+
+/* Reports how many client connection attempts in this process have been
+ * refused, and how many of those were tried again. */
+
+void socks_get_connect_stats(struct socks_connect_stats *stats);
+
 int socks_server_wait(int socket_fd);
 
 /*----------------------------------------------------------------------------*/
 
-extern const char *progname;
+/* Event-driven server. Unlike socks_server_process(), which serves one
+ * client at a time with blocking reads, a socks_server keeps up to
+ * 'max_connections' clients connected at once and reads their requests
+ * without blocking, as data arrives. The callback only runs once a whole
+ * request has been buffered. Connections stay open for more requests until
+ * the client closes them (or until a callback returns a negative value).
+ * While the limit is reached, new clients wait in the listen queue. */
+
+struct socks_server;
+
+/* Creates a server for a socket from socks_server_open(). The socket is
+ * switched to non-blocking mode until socks_server_destroy(), so that every
+ * waiting client can be accepted in one pass. Returns NULL in the event of an
+ * error. */
+
+struct socks_server * socks_server_create(int socket_fd,
+                                          socks_callback_t callback,
+                                          unsigned int max_connections);
+
+/* Stops any workers, closes every client connection and frees the server.
+ * Requests that the workers hadn't started are dropped. The listening socket
+ * is left open. */
+
+void socks_server_destroy(struct socks_server *server);
+
+/* Returns true for requests that have to be handled on the thread that runs
+ * the server (for example, because they change supervisor state). */
+
+typedef bool (*socks_serial_t)(const char *buf, uint32_t nbyte);
+
+/* Hands requests off to a pool of 'nthreads' worker threads, so that slow
+ * callbacks don't hold up other clients. Up to 'queue_depth' requests can
+ * wait for a free worker; beyond that, connections stop being read until
+ * there's room. Requests for which 'serial' returns true (or none, if it's
+ * NULL) still run inline in socks_server_run(), one at a time. Other
+ * requests can run at the same time as each other and as the server thread,
+ * so the callback has to be thread-safe for them.
+ *
+ * Responses still go through socks_respond() on the request's connection.
+ * Untagged requests are handled one at a time per connection, so their
+ * responses stay in order; tagged requests from sessions can be handled in
+ * parallel and answered in any order. Returns 0 on a success, or -1 in the
+ * event of an error. */
+
+int socks_server_start_workers(struct socks_server *server,
+                               unsigned int nthreads, unsigned int queue_depth,
+                               socks_serial_t serial);
+
+/* Returns a descriptor that becomes readable when socks_server_run() has
+ * work to do, for use with poll() or an outer event loop. */
+
+int socks_server_fd(const struct socks_server *server);
+
+/* Returns the number of connected clients. */
+
+unsigned int socks_server_connections(const struct socks_server *server);
+
+enum {socks_default_output_limit = 1048576};
+
+/* Responses that a client's socket won't take straight away are queued
+ * until it's writable, instead of blocking the server. A client that lets
+ * more than 'nbyte' bytes (socks_default_output_limit, unless this is
+ * called) pile up that way is disconnected. */
+
+void socks_server_set_output_limit(struct socks_server *server, size_t nbyte);
+
+/* Waits up to 'timeout_ms' milliseconds (-1 waits forever, 0 doesn't block)
+ * for activity, and handles everything that's ready. Returns the number of
+ * requests that were handled, or -1 in the event of an error. */
+
+int socks_server_run(struct socks_server *server, int timeout_ms);
+
+/*----------------------------------------------------------------------------*/
+
+/* Event subscriptions. A client subscribes by sending a request (whatever
+ * the server's protocol uses for that) on a connection that it keeps open.
+ * The server's callback accepts it with socks_server_subscribe(), and from
+ * then on, every socks_server_publish() pushes a message down the
+ * connection without the client having to ask.
+ *
+ * Events are sent without blocking. When a subscriber's socket is full,
+ * events wait in a queue of up to 'max_queued' entries; when that's full
+ * too, 'overflow' decides between dropping the oldest queued event and
+ * disconnecting the subscriber. Both functions have to be called on the
+ * thread that runs the server, so subscribe requests must be serial when
+ * workers are in use. */
+
+enum socks_overflow {
+    socks_overflow_drop_oldest,
+    socks_overflow_disconnect
+};
+
+/* Makes the connection of the request that's being handled a subscriber.
+ * Only valid inside a callback running in socks_server_run(), with the
+ * callback's 'response_fd'. Returns 0 on a success, or -1 in the event of
+ * an error. */
+
+int socks_server_subscribe(struct socks_server *server, int fd,
+                           unsigned int max_queued,
+                           enum socks_overflow overflow);
+
+/* Pushes a message to every subscriber. Returns the number of subscribers
+ * that it was sent or queued to, or -1 in the event of an error. */
+
+int socks_server_publish(struct socks_server *server, const void *buf,
+                         uint32_t nbyte);
+
+/* Returns the number of events that were dropped from full queues. */
+
+unsigned long socks_server_dropped(const struct socks_server *server);
+
+/* Connects to the server and sends a subscribe request. Returns the
+ * connection, from which the response to the request and then the pushed
+ * events are read with socks_event_recv(), or -1 in the event of an error.
+ * The connection is closed with close(). */
+
+int socks_subscribe(const char *filename, const char *input, uint32_t nbyte);
+
+/* Waits for the next message on a subscription. Returns its size, or -1 in
+ * the event of an error (errno is set to ECONNRESET if the server hung up). */
+
+ssize_t socks_event_recv(int fd, char *output, uint32_t bufsize);
+
+/*----------------------------------------------------------------------------*/
+
+/* Client sessions. Where socks_client_process() connects for every request,
+ * a session keeps one connection open for as many requests as it likes, and
+ * can have several of them in flight at once. Each request is tagged with an
+ * id that the server copies into its response, so responses can be collected
+ * in any order. Sessions need a server that keeps connections open, like the
+ * event-driven one; socks_server_process() closes the connection after one
+ * request. A session must not be used by more than one thread at a time. */
+
+struct socks_session;
+
+/* Connects a session to the server at 'filename'. Returns NULL in the event
+ * of an error. */
+
+struct socks_session * socks_session_open(const char *filename);
+
+/* Closes the connection, and discards any responses that weren't collected. */
+
+void socks_session_close(struct socks_session *session);
+
+/* Returns the session's socket, which becomes readable when a response
+ * arrives. */
+
+int socks_session_fd(const struct socks_session *session);
+
+/* Sends a request without waiting for the response, and stores its id in
+ * *id. Returns 0 on a success, or -1 in the event of an error. */
+
+int socks_session_send(struct socks_session *session, const char *input,
+                       uint32_t nbyte, uint32_t *id);
+
+/* Waits for the response to request 'id'. Responses to other requests that
+ * arrive first are kept until they're asked for. Returns the size of the
+ * response, or -1 in the event of an error (errno is set to EMSGSIZE if the
+ * response was bigger than 'bufsize', in which case it's discarded). */
+
+ssize_t socks_session_recv(struct socks_session *session, uint32_t id,
+                           char *output, uint32_t bufsize);
+
+/* Sends a request and waits for its response, like socks_client_process(). */
+
+ssize_t socks_session_process(struct socks_session *session,
+                              const char *input, uint32_t nbyte,
+                              char *output, uint32_t bufsize);
+
+/*----------------------------------------------------------------------------*/
+
+/* A thread-safe pool of up to 'max_sessions' sessions to one server. Sessions
+ * are opened as they're needed and kept for reuse. When the server restarts,
+ * a request that finds its connection closed is sent again on a new one.
+ * Requests that fail after they were sent aren't repeated, since the server
+ * might have acted on them. */
+
+struct socks_pool;
+
+/* Returns NULL in the event of an error. No connections are made until the
+ * first request. */
+
+struct socks_pool * socks_pool_create(const char *filename,
+                                      unsigned int max_sessions);
+
+/* Closes every session in the pool. It mustn't be in use by other threads. */
+
+void socks_pool_destroy(struct socks_pool *pool);
+
+/* Sends a request on one of the pool's sessions (waiting for one if they're
+ * all in use), and returns the size of the response or -1 in the event of an
+ * error. */
+
+ssize_t socks_pool_process(struct socks_pool *pool, const char *input,
+                           uint32_t nbyte, char *output, uint32_t bufsize);
+
+/*----------------------------------------------------------------------------*/
+
+/* Batches send several requests in one message. The server runs its
+ * callback once per item, in order, and sends every item's response (along
+ * with what the callback returned) back as one message, so a batch of N
+ * requests costs one round trip instead of N. Items are handled like
+ * standalone requests, except that their callbacks can't pass descriptors
+ * (socks_respond_fds() fails with EINVAL) and a failing item doesn't close
+ * the connection.
+ *
+ * Batches always use protocol version 2, whatever socks_set_protocol() says,
+ * and the whole response has to fit in one socket record. */
+
+struct socks_batch;
+
+/* Returns an empty batch, or NULL in the event of an error. */
+
+struct socks_batch * socks_batch_create(void);
+
+void socks_batch_destroy(struct socks_batch *batch);
+
+/* Appends a request to the batch. Returns 0 on a success, or -1 in the event
+ * of an error (errno is set to EMSGSIZE if the batch would be bigger than
+ * the maximum message size). */
+
+int socks_batch_add(struct socks_batch *batch, const char *input,
+                    uint32_t nbyte);
+
+/* Sends the batch and waits for its results. The batch can be processed
+ * again, which replaces the previous results. Returns the number of items,
+ * or -1 in the event of an error (errno is set to EPROTO if the server
+ * rejected the batch or sent back a malformed response). */
+
+int socks_batch_process(const char *filename, struct socks_batch *batch);
+
+/* Looks up the result of item 'index' from the last socks_batch_process()
+ * call. *output points into the batch, and stays valid until the batch is
+ * processed again or destroyed. *status is what the server's callback
+ * returned for the item. Returns 0 on a success, or -1 if there's no such
+ * result. */
+
+int socks_batch_result(const struct socks_batch *batch, unsigned int index,
+                       const char **output, uint32_t *nbyte, int *status);
+
+/*----------------------------------------------------------------------------*/
+
+enum {socks_max_fds = 64};
+
+/* Sends a framed message and up to socks_max_fds file descriptors (via
+ * SCM_RIGHTS) as a single record. Returns 'nbyte' on a success, or -1 in the
+ * event of an error. */
+
+ssize_t socks_send_fds(int fd, const void *buf, uint32_t nbyte,
+                       const int *fds, unsigned int nfds);
+
+/* Receives a message sent by socks_send_fds(). On entry, *nfds holds the
+ * capacity of 'fds'; on return it holds the number of descriptors received
+ * (any beyond the capacity are closed). Received descriptors are marked
+ * close-on-exec.
+ *
+ * Returns the size of the message body, or -1 in the event of an error
+ * (errno is set to ECONNRESET if the peer closed the connection). */
+
+ssize_t socks_recv_fds(int fd, void *buf, size_t bufsize, int *fds,
+                       unsigned int *nfds);
 
 #endif
@@ -0,0 +1,420 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libstatus.h"
+
+/* File layout: a 64-byte header, followed by 'capacity' records. Everything
+ * is in native byte order, since the board is only shared between processes
+ * on the same machine. */
+
+static const char status_magic[8] = {'R', 'U', 'N', 'D', 'S', 'T', 'A', 'T'};
+
+enum {
+    status_layout = 1,
+    spins_before_yield = 1000,
+    read_deadline_us = 100000
+};
+
+struct status_header {
+    char magic[8];
+    uint32_t layout;
+    uint32_t record_size;
+    uint32_t capacity;
+    _Atomic uint32_t used;
+    _Atomic uint32_t retired;
+    char reserved[36];
+};
+
+struct status_record {
+    _Atomic uint32_t sequence;
+    uint32_t reserved;
+    struct status_entry entry;
+};
+
+struct status_board {
+    struct status_header *header;
+    struct status_record *records;
+    size_t map_size;
+    bool writable;
+};
+
+_Static_assert(sizeof(struct status_header) == 64,
+               "status header must stay 64 bytes");
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2,
+               "status boards need lock-free atomics to work across processes");
+
+/*----------------------------------------------------------------------------*/
+
+static int64_t monotonic_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static size_t board_size(uint32_t capacity)
+{
+    return sizeof(struct status_header) +
+           ((size_t) capacity * sizeof(struct status_record));
+}
+
+static struct status_board * board_map(int fd, size_t size, bool writable)
+{
+    struct status_board *board = calloc(1, sizeof(*board));
+    int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void *map;
+
+    if (board == NULL) {
+        return NULL;
+    }
+
+    map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        free(board);
+        return NULL;
+    }
+
+    board->header = map;
+    board->records = (struct status_record *)(board->header + 1);
+    board->map_size = size;
+    board->writable = writable;
+    return board;
+}
+
+static bool header_valid(const struct status_header *header, size_t size)
+{
+    return (memcmp(header->magic, status_magic, sizeof(status_magic)) == 0) &&
+           (header->layout == status_layout) &&
+           (header->record_size == sizeof(struct status_record)) &&
+           (board_size(header->capacity) <= size);
+}
+
+/* Marks the board that's currently at 'filename' (if there is one) as
+ * retired, so that its readers know to reopen. */
+static void board_retire_file(const char *filename)
+{
+    struct status_header *header;
+    struct stat info;
+    int fd = open_nointr(filename, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+
+    if ((fstat(fd, &info) == 0) &&
+        ((size_t) info.st_size >= sizeof(*header))) {
+        header = mmap(NULL, sizeof(*header), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+
+        if (header != MAP_FAILED) {
+            if (memcmp(header->magic, status_magic,
+                       sizeof(status_magic)) == 0) {
+                atomic_store_explicit(&header->retired, 1,
+                                      memory_order_release);
+            }
+
+            munmap(header, sizeof(*header));
+        }
+    }
+
+    close_nointr(fd);
+}
+
+static void put_int32(char *target, int32_t value)
+{
+    uint32_t input = (uint32_t) value;
+
+    target[0] = (char)((input >> 0) & 0xFF);
+    target[1] = (char)((input >> 8) & 0xFF);
+    target[2] = (char)((input >> 16) & 0xFF);
+    target[3] = (char)((input >> 24) & 0xFF);
+}
+
+static int32_t get_int32(const char *input)
+{
+    uint32_t result = 0;
+
+    result += (uint32_t)((unsigned char) input[0]) << 0;
+    result += (uint32_t)((unsigned char) input[1]) << 8;
+    result += (uint32_t)((unsigned char) input[2]) << 16;
+    result += (uint32_t)((unsigned char) input[3]) << 24;
+
+    return (int32_t) result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+struct status_board * status_board_create(const char *filename,
+                                          unsigned int capacity)
+{
+    char tempname[PATH_MAX + 1];
+    struct status_board *board;
+    size_t size = board_size(capacity);
+    int result;
+    int fd;
+
+    if (capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* The new board is built under a temporary name and renamed into place,
+     * so readers never see a partly initialized file. */
+
+    result = snprintf(tempname, sizeof(tempname), "%s.new", filename);
+
+    if ((result < 0) || ((size_t) result >= sizeof(tempname))) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    /* open_nointr() has no mode argument, and opening a regular file isn't
+     * interrupted by signals anyway. */
+
+    fd = open(tempname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t) size) != 0) {
+        close_nointr(fd);
+        unlink(tempname);
+        return NULL;
+    }
+
+    board = board_map(fd, size, true);
+    close_nointr(fd);
+
+    if (board == NULL) {
+        unlink(tempname);
+        return NULL;
+    }
+
+    memcpy(board->header->magic, status_magic, sizeof(status_magic));
+    board->header->layout = status_layout;
+    board->header->record_size = sizeof(struct status_record);
+    board->header->capacity = capacity;
+
+    board_retire_file(filename);
+
+    if (rename(tempname, filename) != 0) {
+        status_board_close(board);
+        unlink(tempname);
+        return NULL;
+    }
+
+    return board;
+}
+
+struct status_board * status_board_open(const char *filename)
+{
+    struct status_board *board;
+    struct stat info;
+    int fd = open_nointr(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &info) != 0) {
+        close_nointr(fd);
+        return NULL;
+    }
+
+    if ((size_t) info.st_size < sizeof(struct status_header)) {
+        close_nointr(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    board = board_map(fd, (size_t) info.st_size, false);
+    close_nointr(fd);
+
+    if (board == NULL) {
+        return NULL;
+    }
+
+    if (!header_valid(board->header, board->map_size)) {
+        status_board_close(board);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return board;
+}
+
+void status_board_close(struct status_board *board)
+{
+    if (board == NULL) {
+        return;
+    }
+
+    if (board->writable) {
+        atomic_store_explicit(&board->header->retired, 1,
+                              memory_order_release);
+    }
+
+    munmap(board->header, board->map_size);
+    free(board);
+}
+
+unsigned int status_board_capacity(const struct status_board *board)
+{
+    return board->header->capacity;
+}
+
+unsigned int status_board_used(const struct status_board *board)
+{
+    return atomic_load_explicit(&board->header->used, memory_order_acquire);
+}
+
+int status_board_publish(struct status_board *board, unsigned int slot,
+                         const struct status_entry *entry)
+{
+    struct status_record *record;
+    uint32_t sequence;
+
+    if ((board->writable == false) || (slot >= board->header->capacity)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    record = &board->records[slot];
+    sequence = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&record->sequence, sequence + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(&record->entry, entry, sizeof(*entry));
+    record->entry.name[status_name_max] = '\x00';
+
+    atomic_store_explicit(&record->sequence, sequence + 2,
+                          memory_order_release);
+
+    if (slot >= atomic_load_explicit(&board->header->used,
+                                     memory_order_relaxed)) {
+        atomic_store_explicit(&board->header->used, slot + 1,
+                              memory_order_release);
+    }
+
+    return 0;
+}
+
+int status_board_read(const struct status_board *board, unsigned int slot,
+                      struct status_entry *entry)
+{
+    const struct status_record *record;
+    unsigned int spins = 0;
+    int64_t deadline = 0;
+    uint32_t before;
+    uint32_t after;
+
+    if (slot >= board->header->capacity) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (atomic_load_explicit(&board->header->retired, memory_order_acquire)) {
+        errno = ESTALE;
+        return -1;
+    }
+
+    record = &board->records[slot];
+
+    while (1) {
+        before = atomic_load_explicit(&record->sequence,
+                                      memory_order_acquire);
+
+        if ((before & 1) == 0) {
+            memcpy(entry, &record->entry, sizeof(*entry));
+            atomic_thread_fence(memory_order_acquire);
+            after = atomic_load_explicit(&record->sequence,
+                                         memory_order_relaxed);
+
+            if (before == after) {
+                break;
+            }
+        }
+
+        /* The writer could be descheduled in the middle of an update, so
+         * don't spin against it forever. It could also have died in the
+         * middle of one, leaving the sequence odd for good, so give up once
+         * the deadline passes. */
+
+        if (++spins >= spins_before_yield) {
+            if (deadline == 0) {
+                deadline = monotonic_us() + read_deadline_us;
+            } else if (monotonic_us() >= deadline) {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            sched_yield();
+            spins = 0;
+        }
+    }
+
+    entry->name[status_name_max] = '\x00';
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+size_t status_event_encode(const struct status_event *event, char *buf)
+{
+    size_t length = strnlen(event->name, status_name_max);
+
+    buf[0] = (char) event->kind;
+    put_int32(buf + 1, event->pid);
+    put_int32(buf + 5, event->code);
+    buf[9] = (char) length;
+    memcpy(buf + 10, event->name, length);
+
+    return 10 + length;
+}
+
+int status_event_decode(const char *buf, size_t nbyte,
+                        struct status_event *event)
+{
+    size_t length;
+
+    if ((nbyte < 10) || (nbyte > status_event_max)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    length = (unsigned char) buf[9];
+
+    if ((length != (nbyte - 10)) || (buf[0] < status_event_started) ||
+        (buf[0] > status_event_stopped)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    event->kind = (unsigned char) buf[0];
+    event->pid = get_int32(buf + 1);
+    event->code = get_int32(buf + 5);
+    memcpy(event->name, buf + 10, length);
+    event->name[length] = '\x00';
+    return 0;
+}
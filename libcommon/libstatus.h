@@ -0,0 +1,121 @@
+#ifndef _LIBSTATUS_H_
+#define _LIBSTATUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared-memory status board. The supervisor publishes one fixed-size record
+ * per service into a file that readers map read-only, so status queries
+ * don't need a socket round trip or any work from the supervisor. Each
+ * record is guarded by a seqlock: the writer bumps a sequence number to an
+ * odd value before changing a record and to the next even value afterwards,
+ * and readers retry if the number changed (or was odd) while they copied the
+ * record out. After status_board_open(), reading is done entirely in user
+ * space.
+ *
+ * There must only be one writer per board. When a board is recreated (for
+ * example, after the supervisor restarts), the old file is marked as retired
+ * and replaced, and readers of the old file get ESTALE and should reopen. */
+
+enum {status_name_max = 63};
+
+enum status_state {
+    status_unused = 0,
+    status_stopped,
+    status_starting,
+    status_running,
+    status_stopping,
+    status_failed
+};
+
+struct status_entry {
+    int32_t pid;
+    uint32_t state;
+    int64_t start_time;
+    uint32_t restarts;
+    int32_t exit_code;
+    char name[status_name_max + 1];
+};
+
+struct status_board;
+
+/*----------------------------------------------------------------------------*/
+
+/* Creates a board with room for 'capacity' records at 'filename', replacing
+ * (and retiring) any board that's already there. Every record starts out as
+ * status_unused. Returns NULL in the event of an error. */
+
+struct status_board * status_board_create(const char *filename,
+                                          unsigned int capacity);
+
+/* Maps an existing board for reading. Returns NULL in the event of an error
+ * (errno is set to EPROTO if the file isn't a status board). */
+
+struct status_board * status_board_open(const char *filename);
+
+/* Unmaps the board. If it was made with status_board_create(), the file is
+ * left in place but marked as retired. */
+
+void status_board_close(struct status_board *board);
+
+/* Returns the number of records that the board can hold. */
+
+unsigned int status_board_capacity(const struct status_board *board);
+
+/* Returns one more than the highest slot that has ever been published, which
+ * is how far readers need to scan. */
+
+unsigned int status_board_used(const struct status_board *board);
+
+/* Stores 'entry' in 'slot'. Only for boards from status_board_create().
+ * Returns 0 on a success, or -1 if the slot is out of range. */
+
+int status_board_publish(struct status_board *board, unsigned int slot,
+                         const struct status_entry *entry);
+
+/* Copies a consistent snapshot of 'slot' into *entry. Returns 0 on a
+ * success, or -1 if the slot is out of range (EINVAL), the board has been
+ * retired (ESTALE), or the record stayed mid-update for too long (EAGAIN),
+ * as happens when the writer dies in the middle of publishing it. */
+
+int status_board_read(const struct status_board *board, unsigned int slot,
+                      struct status_entry *entry);
+
+/*----------------------------------------------------------------------------*/
+
+/* State-change events, in a compact encoding for pushing to subscribers with
+ * socks_server_publish(). An encoded event is one byte of kind, the pid and
+ * code as little-endian 32-bit integers, one byte of name length, and the
+ * name (without a NUL). For status_event_exited, 'code' is the exit status,
+ * or the negated signal number if the service was killed. It's 0 for the
+ * other kinds. */
+
+enum status_event_kind {
+    status_event_started = 1,
+    status_event_exited,
+    status_event_restarting,
+    status_event_stopped
+};
+
+struct status_event {
+    uint32_t kind;
+    int32_t pid;
+    int32_t code;
+    char name[status_name_max + 1];
+};
+
+enum {status_event_max = 10 + status_name_max};
+
+/* Encodes 'event' into 'buf', which must have room for status_event_max
+ * bytes. Names longer than status_name_max are cut short. Returns the
+ * encoded size. */
+
+size_t status_event_encode(const struct status_event *event, char *buf);
+
+/* Decodes an event. Returns 0 on a success, or -1 (with errno set to EPROTO)
+ * if 'buf' doesn't hold a valid event. */
+
+int status_event_decode(const char *buf, size_t nbyte,
+                        struct status_event *event);
+
+#endif
@@ -0,0 +1,470 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libproc.h"
+#include "libreap.h"
+#include "libsignal.h"
+#include "libsocks.h"
+#include "libzygote.h"
+
+/* Requests are laid out as three native-endian uint32_t counts (argc, envc
+ * and the number of kept descriptors), the int32_t numbers that each kept
+ * descriptor should have in the new process, and then the NUL-terminated
+ * filename, argv strings and envp strings. The stdin/stdout/stderr
+ * descriptors ride along as SCM_RIGHTS, followed by the kept descriptors.
+ * Each reply is a struct zygote_reply. The zygote waits for the exec to
+ * succeed or fail before replying, so a reply can carry both a PID and an
+ * error; in that case the caller has to reap the failed child.
+ *
+ * Replies carry nothing that ties them to a request, so each request and its
+ * reply are sent and received under 'zygote_lock'. Otherwise two threads
+ * launching at once could each pick up the other's reply. */
+
+enum {
+    zygote_msg_max = 131072,
+    zygote_stack_size = 65536,
+    zygote_nfds = 3,
+    zygote_max_keep = socks_max_fds - zygote_nfds
+};
+
+struct zygote_request {
+    const char *filename;
+    char **argv;
+    char **envp;
+    int fds[socks_max_fds];
+    int keep_fds[zygote_max_keep];
+    uint32_t keep_count;
+};
+
+struct zygote_reply {
+    int32_t pid;
+    int32_t error;
+};
+
+static int zygote_fd = -1;
+static pid_t zygote_pid = -1;
+static pthread_mutex_t zygote_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*----------------------------------------------------------------------------*/
+
+static size_t strings_size(char *const list[], uint32_t *count)
+{
+    size_t result = 0;
+
+    for (*count = 0; list[*count] != NULL; (*count)++) {
+        result += strlen(list[*count]) + 1;
+    }
+
+    return result;
+}
+
+static char * strings_pack(char *dest, char *const list[])
+{
+    size_t length;
+
+    for (unsigned int x = 0; list[x] != NULL; x++) {
+        length = strlen(list[x]) + 1;
+        memcpy(dest, list[x], length);
+        dest += length;
+    }
+
+    return dest;
+}
+
+static char * strings_unpack(char *cursor, const char *end, char *list[],
+                             uint32_t count)
+{
+    for (uint32_t x = 0; x < count; x++) {
+        if (cursor >= end) {
+            return NULL;
+        }
+
+        list[x] = cursor;
+        cursor += strlen(cursor) + 1;
+    }
+
+    list[count] = NULL;
+    return cursor;
+}
+
+static int request_parse(char *buffer, size_t length,
+                         struct zygote_request *request)
+{
+    uint32_t counts[3];
+    char *cursor = buffer + sizeof(counts);
+    const char *end = buffer + length;
+
+    if ((length <= sizeof(counts)) || (buffer[length - 1] != '\x00')) {
+        return -1;
+    }
+
+    memcpy(counts, buffer, sizeof(counts));
+
+    if ((counts[0] == 0) || (counts[0] > length) || (counts[1] > length) ||
+        (counts[2] > zygote_max_keep) ||
+        ((counts[2] * sizeof(int32_t)) >= (size_t)(end - cursor))) {
+        return -1;
+    }
+
+    request->keep_count = counts[2];
+    memcpy(request->keep_fds, cursor, counts[2] * sizeof(int32_t));
+    cursor += counts[2] * sizeof(int32_t);
+
+    request->argv = malloc((counts[0] + counts[1] + 2) * sizeof(char *));
+
+    if (request->argv == NULL) {
+        return -1;
+    }
+
+    request->envp = request->argv + counts[0] + 1;
+    request->filename = cursor;
+    cursor += strlen(cursor) + 1;
+
+    cursor = strings_unpack(cursor, end, request->argv, counts[0]);
+
+    if (cursor != NULL) {
+        cursor = strings_unpack(cursor, end, request->envp, counts[1]);
+    }
+
+    if (cursor == NULL) {
+        free(request->argv);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+struct zygote_child_args {
+    struct zygote_request *request;
+    int error_fd;
+};
+
+/* Moves the received descriptors to the numbers that the caller asked for.
+ * Everything (including the error pipe) is first moved above the highest
+ * requested number, so that no dup2() clobbers a descriptor that's still
+ * needed. */
+
+static int remap_fds(struct zygote_request *request, int *error_fd)
+{
+    unsigned int nfds = zygote_nfds + request->keep_count;
+    int lowest = STDERR_FILENO;
+
+    for (uint32_t x = 0; x < request->keep_count; x++) {
+        if (request->keep_fds[x] > lowest) {
+            lowest = request->keep_fds[x];
+        }
+    }
+
+    lowest++;
+    *error_fd = fcntl(*error_fd, F_DUPFD_CLOEXEC, lowest);
+
+    if (*error_fd < 0) {
+        return -1;
+    }
+
+    for (unsigned int x = 0; x < nfds; x++) {
+        request->fds[x] = fcntl(request->fds[x], F_DUPFD_CLOEXEC, lowest);
+
+        if (request->fds[x] < 0) {
+            return -1;
+        }
+    }
+
+    for (uint32_t x = 0; x < request->keep_count; x++) {
+        if ((request->keep_fds[x] > STDERR_FILENO) &&
+            (dup2_nointr(request->fds[zygote_nfds + x],
+                         request->keep_fds[x]) < 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int zygote_child(void *arg)
+{
+    const struct zygote_child_args *args = arg;
+    struct zygote_request *request = args->request;
+    int error_fd = args->error_fd;
+    int error;
+
+    if (remap_fds(request, &error_fd) != 0) {
+        error = errno;
+        write_nointr(error_fd, &error, sizeof(error));
+        _exit(127);
+    }
+
+    proc_child_exec(request->filename, request->argv, request->envp,
+                    request->fds, request->keep_fds, request->keep_count,
+                    error_fd);
+}
+
+static void zygote_spawn(char *buffer, ssize_t length,
+                         struct zygote_request *request, unsigned int nfds,
+                         char *stack, struct zygote_reply *reply)
+{
+    struct zygote_child_args args = {.request = request};
+    int error_pipe[2];
+    pid_t child;
+
+    reply->pid = -1;
+    reply->error = EPROTO;
+
+    if ((nfds < zygote_nfds) ||
+        (request_parse(buffer, (size_t) length, request) != 0)) {
+        return;
+    }
+
+    if (nfds != (zygote_nfds + request->keep_count)) {
+        free(request->argv);
+        return;
+    }
+
+    if (pipe2(error_pipe, O_CLOEXEC) != 0) {
+        reply->error = errno;
+        free(request->argv);
+        return;
+    }
+
+    args.error_fd = error_pipe[1];
+    child = clone(zygote_child, stack + zygote_stack_size,
+                  CLONE_PARENT | SIGCHLD, &args);
+    reply->error = errno;
+    free(request->argv);
+    close_nointr(error_pipe[1]);
+
+    if (child < 0) {
+        close_nointr(error_pipe[0]);
+        return;
+    }
+
+    reply->pid = (int32_t) child;
+    reply->error = proc_exec_status(error_pipe[0]);
+}
+
+static _Noreturn void zygote_main(int fd)
+{
+    struct zygote_request request;
+    struct zygote_reply reply;
+    char *buffer = malloc(zygote_msg_max);
+    char *stack = malloc(zygote_stack_size);
+    unsigned int nfds;
+    ssize_t length;
+
+    if ((buffer == NULL) || (stack == NULL)) {
+        _exit(1);
+    }
+
+    while (1) {
+        nfds = socks_max_fds;
+        length = socks_recv_fds(fd, buffer, zygote_msg_max, request.fds,
+                                &nfds);
+
+        if (length < 0) {
+            if ((errno != EMSGSIZE) && (errno != EPROTO)) {
+                _exit(0);
+            }
+
+            reply.pid = -1;
+            reply.error = errno;
+        } else {
+            zygote_spawn(buffer, length, &request, nfds, stack, &reply);
+        }
+
+        for (unsigned int x = 0; x < nfds; x++) {
+            close_nointr(request.fds[x]);
+        }
+
+        if (socks_send_fds(fd, &reply, sizeof(reply), NULL, 0) < 0) {
+            _exit(0);
+        }
+    }
+}
+
+/* Sends one request and waits for its reply. Returns 0 on a success, or -1
+ * in the event of an error. */
+static int zygote_exchange(const char *buffer, size_t length, int fds[],
+                           unsigned int nfds, struct zygote_reply *reply)
+{
+    unsigned int reply_nfds = 0;
+    ssize_t result;
+    int error;
+
+    pthread_mutex_lock(&zygote_lock);
+    result = socks_send_fds(zygote_fd, buffer, (uint32_t) length, fds, nfds);
+
+    if (result >= 0) {
+        result = socks_recv_fds(zygote_fd, reply, sizeof(*reply), NULL,
+                                &reply_nfds);
+    }
+
+    error = errno;
+    pthread_mutex_unlock(&zygote_lock);
+
+    if (result < 0) {
+        errno = error;
+        return -1;
+    }
+
+    if (result != sizeof(*reply)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int zygote_start(void)
+{
+    int pair[2];
+    pid_t child;
+
+    if (zygote_fd >= 0) {
+        return 0;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+        perror("couldn't create zygote socket");
+        return -1;
+    }
+
+    child = fork();
+
+    if (child < 0) {
+        perror("couldn't fork zygote");
+        close_nointr(pair[0]);
+        close_nointr(pair[1]);
+        return -1;
+    }
+
+    if (child == 0) {
+        close_nointr(pair[0]);
+        signal_pipefd_cleanup();
+        zygote_main(pair[1]);
+    }
+
+    close_nointr(pair[1]);
+    zygote_fd = pair[0];
+    zygote_pid = child;
+    return 0;
+}
+
+int zygote_stop(void)
+{
+    int8_t errcode;
+    int result;
+
+    if (zygote_fd < 0) {
+        return 0;
+    }
+
+    close_nointr(zygote_fd);
+    result = proc_wait(zygote_pid, -1, &errcode);
+
+    zygote_fd = -1;
+    zygote_pid = -1;
+    return (result < 0) ? -1 : 0;
+}
+
+bool zygote_running(void)
+{
+    return (zygote_fd >= 0);
+}
+
+pid_t zygote_launch(const char *filename, const struct proc_spec *spec,
+                    char *const envp[])
+{
+    int fds[socks_max_fds] = {spec->stdin_fd, spec->stdout_fd,
+                              spec->stderr_fd};
+    uint32_t counts[3];
+    size_t length;
+    char *buffer;
+    char *cursor;
+    struct zygote_reply reply;
+    int8_t errcode;
+    int result;
+
+    if (zygote_fd < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (spec->keep_count > zygote_max_keep) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    counts[2] = spec->keep_count;
+
+    for (uint32_t x = 0; x < counts[2]; x++) {
+        fds[zygote_nfds + x] = spec->keep_fds[x];
+    }
+
+    length = sizeof(counts) + (counts[2] * sizeof(int32_t));
+    length += strlen(filename) + 1;
+    length += strings_size(spec->argv, &counts[0]);
+    length += strings_size(envp, &counts[1]);
+
+    if (length > zygote_msg_max) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    buffer = malloc(length);
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    memcpy(buffer, counts, sizeof(counts));
+    cursor = buffer + sizeof(counts);
+
+    for (uint32_t x = 0; x < counts[2]; x++) {
+        int32_t keep_fd = (int32_t) spec->keep_fds[x];
+        memcpy(cursor, &keep_fd, sizeof(keep_fd));
+        cursor += sizeof(keep_fd);
+    }
+
+    memcpy(cursor, filename, strlen(filename) + 1);
+    cursor += strlen(filename) + 1;
+    cursor = strings_pack(cursor, spec->argv);
+    strings_pack(cursor, envp);
+
+    result = zygote_exchange(buffer, length, fds, zygote_nfds + counts[2],
+                             &reply);
+    free(buffer);
+
+    if (result != 0) {
+        return -1;
+    }
+
+    if (reply.error != 0) {
+        if (reply.pid > 0) {
+            proc_wait((pid_t) reply.pid, -1, &errcode);
+        }
+
+        errno = reply.error;
+        return -1;
+    }
+
+    reap_expect((pid_t) reply.pid);
+    return (pid_t) reply.pid;
+}
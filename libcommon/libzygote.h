@@ -0,0 +1,42 @@
+#ifndef _LIBZYGOTE_H_
+#define _LIBZYGOTE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "libproc.h"
+
+/* A zygote is a small helper process that launches programs on behalf of its
+ * parent. It's forked once, early on (before the parent grows large tables
+ * or starts threads), and then forks from its own small address space for
+ * each launch. Requests and the stdin/stdout/stderr descriptors are passed
+ * over a socketpair with socks_send_fds().
+ *
+ * Launched processes are created with CLONE_PARENT, so they're children of
+ * the zygote's parent rather than of the zygote. They can be waited on with
+ * waitpid() or proc_wait() as usual (or collected by the libreap reaper),
+ * and SIGCHLD goes to the parent. */
+
+/*----------------------------------------------------------------------------*/
+
+/* Starts the zygote. Returns 0 on a success (or if it's already running), or
+ * -1 in the event of an error. */
+
+int zygote_start(void);
+
+/* Stops the zygote and waits for it to exit. Processes that it launched are
+ * unaffected. */
+
+int zygote_stop(void);
+
+bool zygote_running(void);
+
+/* Asks the zygote to run 'filename' with spec->argv and the given envp. The
+ * spec's stdin/stdout/stderr and kept descriptors are passed along, and end
+ * up under the same numbers that they'd get from proc_launch_spec(). Returns
+ * the new process's PID, or -1 (with errno set) in the event of an error. */
+
+pid_t zygote_launch(const char *filename, const struct proc_spec *spec,
+                    char *const envp[]);
+
+#endif
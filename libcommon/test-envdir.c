@@ -0,0 +1,220 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libenvdir.h"
+#include "libnointr.h"
+
+/* Checks the envdir rules that snapshots apply, and that snapshots share one
+ * inotify descriptor without missing each other's changes. Exits with a
+ * non-zero status if anything fails. */
+
+enum {snapshot_count = 200};
+
+static unsigned int failures = 0;
+static char root[64];
+
+static void check(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static int write_file(const char *dir, const char *name, const char *data,
+                      size_t nbyte, mode_t mode)
+{
+    char filename[128];
+    int fd;
+
+    snprintf(filename, sizeof(filename), "%s/%s/%s", root, dir, name);
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (write_nointr(fd, data, nbyte) != (ssize_t) nbyte) {
+        close_nointr(fd);
+        return -1;
+    }
+
+    return close_nointr(fd);
+}
+
+static void remove_file(const char *dir, const char *name)
+{
+    char filename[128];
+
+    snprintf(filename, sizeof(filename), "%s/%s/%s", root, dir, name);
+    unlink(filename);
+}
+
+/* Returns the value of 'name' in the snapshot's environment, or NULL if it
+ * isn't set. */
+static const char * snapshot_getenv(const struct envdir_snapshot *snapshot,
+                                    const char *name)
+{
+    struct proc_spec spec = {0};
+    size_t length = strlen(name);
+
+    envdir_snapshot_fill(snapshot, &spec);
+
+    for (unsigned int x = 0; spec.envp[x] != NULL; x++) {
+        if ((strncmp(spec.envp[x], name, length) == 0) &&
+            (spec.envp[x][length] == '=')) {
+            return spec.envp[x] + length + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static void test_rules(const char *envdir)
+{
+    struct envdir_snapshot *snapshot;
+    char *argv[] = {"prog", NULL};
+    const char *value;
+
+    setenv("EMPTY", "inherited", 1);
+    setenv("NEWLINE", "inherited", 1);
+
+    check((write_file("env", "EMPTY", "", 0, 0644) == 0) &&
+          (write_file("env", "NEWLINE", "\n", 1, 0644) == 0) &&
+          (write_file("env", "BLANKS", "value \t\nsecond\n", 15, 0644) == 0) &&
+          (write_file("env", "NUL", "a\0b\n", 4, 0644) == 0) &&
+          (write_file("env", ".hidden", "x", 1, 0644) == 0), "envdir setup");
+
+    snapshot = envdir_snapshot_create(argv, envdir);
+    check(snapshot != NULL, "envdir_snapshot_create()");
+
+    if (snapshot == NULL) {
+        return;
+    }
+
+    check(snapshot_getenv(snapshot, "EMPTY") == NULL,
+          "an empty file unsets its variable");
+    value = snapshot_getenv(snapshot, "NEWLINE");
+    check((value != NULL) && (strcmp(value, "") == 0),
+          "a lone newline sets the variable to \"\"");
+    value = snapshot_getenv(snapshot, "BLANKS");
+    check((value != NULL) && (strcmp(value, "value") == 0),
+          "first line with trailing blanks removed");
+    value = snapshot_getenv(snapshot, "NUL");
+    check((value != NULL) && (strcmp(value, "a\nb") == 0),
+          "NULs turn into newlines");
+    check(snapshot_getenv(snapshot, ".hidden") == NULL, "dotfiles skipped");
+    envdir_snapshot_destroy(snapshot);
+
+    check(write_file("env", "A=B", "x", 1, 0644) == 0, "envdir setup");
+    errno = 0;
+    check((envdir_snapshot_create(argv, envdir) == NULL) && (errno == EINVAL),
+          "a name containing '=' is an error");
+    remove_file("env", "A=B");
+}
+
+/* More snapshots than the default limit on inotify instances all get
+ * watched, and a change only rebuilds the snapshots that it concerns,
+ * whichever of them reads the shared descriptor first. */
+static void test_shared(const char *envdir)
+{
+    struct envdir_snapshot *snapshots[snapshot_count] = {0};
+    struct envdir_snapshot *other;
+    char *argv[] = {"prog", NULL};
+    char run_file[128];
+    int watched = 0;
+
+    for (int x = 0; x < snapshot_count; x++) {
+        snapshots[x] = envdir_snapshot_create(argv, NULL);
+
+        if ((snapshots[x] != NULL) &&
+            (envdir_snapshot_fd(snapshots[x]) >= 0) &&
+            (envdir_snapshot_fd(snapshots[x]) ==
+             envdir_snapshot_fd(snapshots[0]))) {
+            watched++;
+        }
+    }
+
+    check(watched == snapshot_count, "every snapshot shares one watch fd");
+
+    other = envdir_snapshot_create(argv, envdir);
+    check(other != NULL, "envdir_snapshot_create() alongside others");
+
+    if (other == NULL) {
+        return;
+    }
+
+    check(write_file("env", "ADDED", "1\n", 2, 0644) == 0, "envdir change");
+    check(envdir_snapshot_refresh(snapshots[0]) == 0,
+          "unrelated snapshot isn't rebuilt");
+    check(envdir_snapshot_refresh(other) == 1,
+          "change routed to its snapshot");
+    check(snapshot_getenv(other, "ADDED") != NULL, "rebuilt contents");
+    check(envdir_snapshot_refresh(other) == 0, "nothing left to rebuild");
+
+    /* The run file's watch is shared, so dropping one of its users mustn't
+     * take it away from the rest. */
+
+    for (int x = 1; x < snapshot_count; x++) {
+        envdir_snapshot_destroy(snapshots[x]);
+    }
+
+    snprintf(run_file, sizeof(run_file), "%s/bin/prog", root);
+    check(chmod(run_file, 0700) == 0, "run file change");
+    check(envdir_snapshot_refresh(snapshots[0]) == 1,
+          "run file still watched for the remaining snapshot");
+    check(envdir_snapshot_refresh(other) == 1,
+          "run file change routed to every user");
+
+    envdir_snapshot_destroy(snapshots[0]);
+    envdir_snapshot_destroy(other);
+}
+
+int main(void)
+{
+    char envdir[80];
+    char bindir[80];
+    char path[128];
+
+    snprintf(root, sizeof(root), "/tmp/test-envdir.%d", (int) getpid());
+    snprintf(envdir, sizeof(envdir), "%s/env", root);
+    snprintf(bindir, sizeof(bindir), "%s/bin", root);
+    snprintf(path, sizeof(path), "%s:/usr/bin:/bin", bindir);
+
+    if ((mkdir(root, 0755) != 0) || (mkdir(envdir, 0755) != 0) ||
+        (mkdir(bindir, 0755) != 0) ||
+        (write_file("bin", "prog", "#!/bin/sh\n", 10, 0755) != 0)) {
+        perror("setup");
+        return 1;
+    }
+
+    setenv("PATH", path, 1);
+    test_rules(envdir);
+    test_shared(envdir);
+
+    remove_file("env", "EMPTY");
+    remove_file("env", "NEWLINE");
+    remove_file("env", "BLANKS");
+    remove_file("env", "NUL");
+    remove_file("env", ".hidden");
+    remove_file("env", "ADDED");
+    remove_file("bin", "prog");
+    rmdir(envdir);
+    rmdir(bindir);
+    rmdir(root);
+
+    if (failures != 0) {
+        fprintf(stderr, "test-envdir: %u failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("test-envdir: OK\n");
+    return 0;
+}
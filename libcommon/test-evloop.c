@@ -0,0 +1,160 @@
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libevloop.h"
+#include "libnointr.h"
+#include "libproc.h"
+#include "libreap.h"
+
+/* Checks that an event loop and the libreap reaper can share SIGCHLD: exits
+ * that the loop's signal reads take the wakeups for still end up in the
+ * reaper's table, and child watches take their exits from it. Exits with a
+ * non-zero status if anything fails. */
+
+static unsigned int failures = 0;
+static int signals_seen = 0;
+static int child_code = 0;
+static int child_status = -1;
+
+static void check(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static pid_t launch_exit(const char *code)
+{
+    char *argv[] = {"sh", "-c", (char *) code, NULL};
+    return proc_launch(argv, 0, 1, 2);
+}
+
+/* Waits for 'process' to exit without reaping it. */
+static void await_exit(pid_t process)
+{
+    siginfo_t info = {0};
+
+    waitid_nointr(P_PID, (id_t) process, &info, WEXITED | WNOWAIT);
+}
+
+static void on_signal(struct evloop *loop, const struct signal_info *info,
+                      void *arg)
+{
+    (void) loop;
+    (void) info;
+    (void) arg;
+    signals_seen++;
+}
+
+static void on_child(struct evloop *loop, pid_t pid, int code, int status,
+                     void *arg)
+{
+    (void) loop;
+    (void) pid;
+    (void) arg;
+    child_code = code;
+    child_status = status;
+}
+
+/* The loop's SIGUSR1 watch reads SIGCHLD along with it. */
+static void test_shared_read(struct evloop *loop)
+{
+    pid_t child = launch_exit("exit 5");
+    struct reap_status exited = {0};
+
+    await_exit(child);
+    raise(SIGUSR1);
+
+    for (int x = 0; (x < 10) && (signals_seen == 0); x++) {
+        evloop_run(loop, 100);
+    }
+
+    check(signals_seen == 1, "SIGUSR1 delivered");
+    check(reap_lookup(child, &exited) == 1,
+          "exit collected while the loop read SIGCHLD");
+    check((exited.code == CLD_EXITED) && (exited.status == 5),
+          "collected exit status");
+    reap_forget(child);
+}
+
+static void test_child_watch(struct evloop *loop)
+{
+    pid_t child = launch_exit("exit 7");
+
+    check(evloop_add_child(loop, child, on_child, NULL) != NULL,
+          "evloop_add_child()");
+
+    for (int x = 0; (x < 20) && (child_status < 0); x++) {
+        evloop_run(loop, 100);
+    }
+
+    check((child_code == CLD_EXITED) && (child_status == 7),
+          "child watch exit status");
+    check(reap_lookup(child, NULL) == 0, "child watch takes the record");
+}
+
+/* The reaper collects the child before the watch is added, so there's no
+ * pidfd to open; the exit comes from the table on the next pass instead. */
+static void test_collected_child(struct evloop *loop)
+{
+    pid_t child = launch_exit("exit 9");
+
+    await_exit(child);
+
+    while (reap_lookup(child, NULL) == 0) {
+        reap_collect();
+    }
+
+    child_code = 0;
+    child_status = -1;
+    check(evloop_add_child(loop, child, on_child, NULL) != NULL,
+          "evloop_add_child() after collect");
+    check(child_status == -1, "collected exit isn't reported right away");
+    evloop_run(loop, 0);
+    check((child_code == CLD_EXITED) && (child_status == 9),
+          "collected exit reported on the next pass");
+    check(reap_lookup(child, NULL) == 0, "collected exit is taken");
+}
+
+int main(void)
+{
+    struct evloop *loop;
+
+    if (reap_init() < 0) {
+        perror("reap_init");
+        return 1;
+    }
+
+    loop = evloop_create();
+
+    if ((loop == NULL) ||
+        (evloop_add_signal(loop, SIGUSR1, on_signal, NULL) == NULL)) {
+        perror("evloop");
+        return 1;
+    }
+
+    errno = 0;
+    check((evloop_add_signal(loop, SIGCHLD, on_signal, NULL) == NULL) &&
+          (errno == EBUSY), "SIGCHLD can't be watched alongside the reaper");
+
+    test_shared_read(loop);
+    test_child_watch(loop);
+    test_collected_child(loop);
+
+    evloop_destroy(loop);
+    reap_cleanup();
+
+    if (failures != 0) {
+        fprintf(stderr, "test-evloop: %u failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("test-evloop: OK\n");
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libpath.h"
+
+/* Checks that path_findprog_cached() answers from its cache until a $PATH
+ * directory changes, including one that's deleted and then recreated, and
+ * that the counters from path_cache_get_stats() add up. Exits with a
+ * non-zero status if anything fails. */
+
+static unsigned int failures = 0;
+static char bindir[64];
+static char prog[80];
+
+static void check(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static int make_prog(void)
+{
+    int fd = open(prog, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (write_nointr(fd, "#!/bin/sh\n", 10) != 10) {
+        close_nointr(fd);
+        return -1;
+    }
+
+    return close_nointr(fd);
+}
+
+/* Looks up "prog", and returns 1 if it resolved to the file in 'bindir', 0
+ * if it wasn't found, or -1 if something else happened. */
+static int lookup(void)
+{
+    char dest[PATH_MAX];
+
+    errno = 0;
+
+    if (path_findprog_cached("prog", dest, sizeof(dest)) == 0) {
+        return (strcmp(dest, prog) == 0) ? 1 : -1;
+    }
+
+    return (errno == ENOENT) ? 0 : -1;
+}
+
+/* Compares the counters against 'before' plus the given increments. */
+static int stats_moved(const struct path_cache_stats *before,
+                       unsigned long hits, unsigned long negative_hits,
+                       unsigned long misses, unsigned long invalidations)
+{
+    struct path_cache_stats after;
+
+    path_cache_get_stats(&after);
+    return (after.hits == before->hits + hits) &&
+           (after.negative_hits == before->negative_hits + negative_hits) &&
+           (after.misses == before->misses + misses) &&
+           (after.invalidations == before->invalidations + invalidations);
+}
+
+static void test_cache(void)
+{
+    struct path_cache_stats stats;
+
+    path_cache_get_stats(&stats);
+    check(lookup() == 1, "found in $PATH");
+    check(lookup() == 1, "found again");
+    check(stats_moved(&stats, 1, 0, 1, 0), "one miss, then a hit");
+
+    path_cache_get_stats(&stats);
+    check(unlink(prog) == 0, "delete prog");
+    check(lookup() == 0, "deleted program isn't found");
+    check(lookup() == 0, "still not found");
+    check(stats_moved(&stats, 0, 1, 1, 1),
+          "deletion invalidates, then a negative hit");
+
+    path_cache_get_stats(&stats);
+    check(make_prog() == 0, "recreate prog");
+    check(lookup() == 1, "recreated program is found");
+    check(stats_moved(&stats, 0, 0, 1, 1), "recreation invalidates");
+
+    path_cache_flush();
+    path_cache_get_stats(&stats);
+    check(lookup() == 1, "found after a flush");
+    check(stats_moved(&stats, 0, 0, 1, 0), "a flush empties the cache");
+}
+
+/* While the directory is gone it's checked by mtime. Once it's back it gets
+ * a new inotify watch, which is the only thing that sees a chmod of one of
+ * its entries (the directory's mtime doesn't change). */
+static void test_rewatch(void)
+{
+    struct path_cache_stats stats;
+
+    check((unlink(prog) == 0) && (rmdir(bindir) == 0), "remove $PATH dir");
+    check(lookup() == 0, "not found without its directory");
+    path_cache_get_stats(&stats);
+    check(lookup() == 0, "still not found");
+    check(stats_moved(&stats, 0, 1, 0, 0), "missing directory is cached");
+
+    check((mkdir(bindir, 0755) == 0) && (make_prog() == 0),
+          "recreate $PATH dir");
+    check(lookup() == 1, "found in the recreated directory");
+    check(lookup() == 1, "found again");
+
+    path_cache_get_stats(&stats);
+    check(chmod(prog, 0644) == 0, "chmod prog");
+    check(lookup() == 0, "non-executable program isn't found");
+    check(stats_moved(&stats, 0, 0, 1, 1),
+          "recreated directory is watched again");
+}
+
+int main(void)
+{
+    snprintf(bindir, sizeof(bindir), "/tmp/test-path.%d", (int) getpid());
+    snprintf(prog, sizeof(prog), "%s/prog", bindir);
+
+    /* "." is searched too, so it's moved somewhere that changes can't
+     * reach. */
+
+    if ((mkdir(bindir, 0755) != 0) || (make_prog() != 0) ||
+        (chdir("/") != 0)) {
+        perror("setup");
+        return 1;
+    }
+
+    setenv("PATH", bindir, 1);
+    test_cache();
+    test_rewatch();
+
+    unlink(prog);
+    rmdir(bindir);
+
+    if (failures != 0) {
+        fprintf(stderr, "test-path: %u failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("test-path: OK\n");
+    return 0;
+}
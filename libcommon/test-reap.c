@@ -0,0 +1,179 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libproc.h"
+#include "libreap.h"
+#include "libzygote.h"
+
+/* Checks that the libproc and libzygote wait functions still work while the
+ * libreap reaper owns every exit, including exits that it collected before
+ * anything asked for them. Exits with a non-zero status if anything fails. */
+
+static unsigned int failures = 0;
+static unsigned int waitid_calls = 0;
+
+/* Stands in for the C library's waitid(), so the test can count the calls
+ * that libreap and libproc make. */
+int waitid(idtype_t idtype, id_t id, siginfo_t *infop, int options)
+{
+    waitid_calls++;
+    return (int) syscall(SYS_waitid, idtype, id, infop, options, NULL);
+}
+
+static void check(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static pid_t launch_exit(const char *code)
+{
+    char *argv[] = {"sh", "-c", (char *) code, NULL};
+    return proc_launch(argv, 0, 1, 2);
+}
+
+/* Waits for 'process' to exit without reaping it, and then lets the reaper
+ * collect it, the way an event loop would. */
+static void collect_exit(pid_t process)
+{
+    struct timespec pause = {.tv_nsec = 1000000L};
+    siginfo_t info = {0};
+
+    waitid_nointr(P_PID, (id_t) process, &info, WEXITED | WNOWAIT);
+
+    while (reap_lookup(process, NULL) == 0) {
+        reap_collect();
+        nanosleep_nointr(&pause, NULL);
+    }
+}
+
+static void test_wait(void)
+{
+    pid_t child = launch_exit("exit 3");
+    int8_t errcode = 0;
+
+    collect_exit(child);
+    check(proc_wait(child, 1000, &errcode) == 1, "proc_wait() after collect");
+    check(errcode == 3, "proc_wait() exit code");
+    check(reap_lookup(child, NULL) == 0, "proc_wait() removes the record");
+
+    child = launch_exit("sleep 0.05; exit 4");
+    check(proc_wait(child, 5000, &errcode) == 1, "proc_wait() while running");
+    check(errcode == 4, "proc_wait() exit code while running");
+
+    child = launch_exit("exit 5");
+    collect_exit(child);
+    check(proc_polled_wait(child) == 5, "proc_polled_wait() after collect");
+
+    child = launch_exit("kill -9 $$");
+    collect_exit(child);
+    check(proc_wait(child, 1000, &errcode) == 1, "proc_wait() on a kill");
+    check(errcode == -1, "proc_wait() exit code on a kill");
+}
+
+static void test_running(void)
+{
+    pid_t child = launch_exit("sleep 0.05; exit 6");
+    int8_t errcode = 0;
+
+    waitid_calls = 0;
+    check(proc_running(child, &errcode), "proc_running() while running");
+    check(waitid_calls == 0, "proc_running() answers from the table alone");
+    collect_exit(child);
+    check(proc_running(child, &errcode) == false, "proc_running() after exit");
+    check(errcode == 6, "proc_running() exit code");
+    reap_forget(child);
+
+    errno = 0;
+    errcode = 0;
+    check(proc_running(getppid(), &errcode) == false,
+          "proc_running() on a non-child");
+    check((errno == ECHILD) && (errcode == -1),
+          "proc_running() reports ECHILD for a non-child");
+}
+
+static void test_waitset(void)
+{
+    struct proc_waitset *set = proc_waitset_create();
+    struct proc_exit exits[4];
+    unsigned int seen = 0;
+    pid_t early = launch_exit("exit 7");
+    pid_t late = launch_exit("sleep 0.05; exit 8");
+    int result;
+
+    collect_exit(early);
+    check(proc_waitset_add(set, early) == 0, "waitset add after collect");
+    check(proc_waitset_add(set, late) == 0, "waitset add while running");
+
+    while (proc_waitset_count(set) != 0) {
+        result = proc_waitset_wait(set, exits, 4, 5000);
+        check(result > 0, "proc_waitset_wait()");
+
+        if (result <= 0) {
+            break;
+        }
+
+        for (int x = 0; x < result; x++) {
+            check(exits[x].errcode == ((exits[x].pid == early) ? 7 : 8),
+                  "waitset exit code");
+            seen++;
+        }
+    }
+
+    check(seen == 2, "waitset reports every exit");
+    proc_waitset_destroy(set);
+}
+
+static void test_zygote(void)
+{
+    struct proc_spec spec = {.stdin_fd = 0, .stdout_fd = 1, .stderr_fd = 2};
+    char *argv[] = {"sh", "-c", "exit 9", NULL};
+    int8_t errcode = 0;
+    pid_t child;
+
+    check(zygote_start() == 0, "zygote_start()");
+    spec.argv = argv;
+    child = zygote_launch("/bin/sh", &spec, environ);
+    check(child > 0, "zygote_launch()");
+    waitid_calls = 0;
+    check(proc_running(child, &errcode) && (waitid_calls == 0),
+          "proc_running() on a zygote child");
+    collect_exit(child);
+    check(proc_wait(child, 1000, &errcode) == 1,
+          "proc_wait() on a zygote child");
+    check(errcode == 9, "zygote child exit code");
+    check(zygote_stop() == 0, "zygote_stop() with the reaper active");
+}
+
+int main(void)
+{
+    if (reap_init() < 0) {
+        fprintf(stderr, "FAIL: reap_init()\n");
+        return 1;
+    }
+
+    test_wait();
+    test_running();
+    test_waitset();
+    test_zygote();
+
+    reap_cleanup();
+
+    if (failures != 0) {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+
+    printf("test-reap: OK\n");
+    return 0;
+}
@@ -5,10 +5,10 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "libevloop.h"
 #include "libnointr.h"
 #include "libsignal.h"
 
@@ -95,52 +95,13 @@ static const char * lookup_sig_name(int signum)
     return empty;
 }
 
-static int wait_signals(int signal_list[], unsigned int count)
+static void report_signal(struct evloop *loop,
+                          const struct signal_info *info, void *arg)
 {
-    fd_set read_fds;
-    fd_set error_fds;
-    int fd_list[count];
-    int max_fd = -1;
-    int result;
-
-    FD_ZERO(&read_fds);
-    FD_ZERO(&error_fds);
-
-    for (unsigned int x = 0; x < count; x++) {
-        fd_list[x] = signal_pipefd_get(signal_list[x]);
-        FD_SET(fd_list[x], &read_fds);
-        FD_SET(fd_list[x], &error_fds);
-
-        if (fd_list[x] > max_fd) {
-            max_fd = fd_list[x];
-        }
-    }
-
-    result = select_nointr(max_fd + 1, &read_fds, NULL, &error_fds, NULL);
-
-    if (result < 0) {
-        perror("select call failed");
-        return result;
-    }
-
-    if (result == 0) {
-        return 0;
-    }
-
-    for (int x = 0; x < (int) count; x++) {
-        if (FD_ISSET(fd_list[x], &error_fds)) {
-            fprintf(stderr, "wait_signals got an error on signal[%d]\n", x);
-            signal_pipefd_clear(signal_list[x]);
-        }
-
-        if (FD_ISSET(fd_list[x], &read_fds)) {
-            fprintf(stderr, "wait_signals received signal [%s]\n",
-                    lookup_sig_name(signal_list[x]));
-            signal_pipefd_clear(signal_list[x]);
-        }
-    }
-
-    return 0;
+    (void) loop;
+    (void) arg;
+    fprintf(stderr, "main loop received signal [%s]\n",
+            lookup_sig_name(info->signum));
 }
 
 int main(int argc, char *argv[])
@@ -181,14 +142,15 @@ int main(int argc, char *argv[])
         }
     }
 
-    signal_pipefd_connect(SIGUSR2);
+    struct evloop *loop = evloop_create();
+    evloop_add_signal(loop, SIGUSR1, report_signal, NULL);
+    evloop_add_signal(loop, SIGUSR2, report_signal, NULL);
 
     printf("Entering main-loop\n");
-    int signal_set[2] = {SIGUSR1, SIGUSR2};
-    while (1) {
-        wait_signals(signal_set, 2);
+    while (evloop_run(loop, -1) >= 0) {
     }
 
+    evloop_destroy(loop);
     signal_pipefd_cleanup();
     return 0;
 }
@@ -0,0 +1,170 @@
+#include "config.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libproc.h"
+#include "libsignal.h"
+
+/* Checks that deliveries taken with signal_pipefd_drain() and
+ * signal_pipefd_clear() don't leave their records in the pipe backend's
+ * ring, where they'd crowd out the siginfo of other signals, and that both
+ * backends report deliveries (including sigqueue() payloads) the same way.
+ * Exits with a non-zero status if anything fails. */
+
+enum {
+    deliveries = 1000,
+    queued = 20
+};
+
+static unsigned int failures = 0;
+
+static void check(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* SIGUSR1's first record sits at the front of the ring while SIGUSR2 is
+ * delivered far more often than the ring has room for, and only ever
+ * drained or cleared. */
+static void test_ring(void)
+{
+    union sigval payload = {.sival_int = 42};
+    struct signal_info info[4];
+    int count;
+
+    if ((signal_pipefd_connect(SIGUSR1) < 0) ||
+        (signal_pipefd_connect(SIGUSR2) < 0)) {
+        check(0, "connect");
+        return;
+    }
+
+    raise(SIGUSR1);
+
+    for (int x = 0; x < deliveries; x++) {
+        raise(SIGUSR2);
+
+        if ((x % 2) == 0) {
+            check(signal_pipefd_drain(SIGUSR2) == 1, "drain");
+        } else {
+            check(signal_pipefd_clear(SIGUSR2) == 0, "clear");
+        }
+    }
+
+    sigqueue(getpid(), SIGUSR1, payload);
+    count = signal_pipefd_read(info, 4);
+
+    check(count == 2, "both SIGUSR1 deliveries read");
+
+    for (int x = 0; x < count; x++) {
+        check(info[x].signum == SIGUSR1, "no SIGUSR2 deliveries left");
+        check(info[x].pid == getpid(), "siginfo kept");
+    }
+
+    check((count == 2) && (info[1].value == 42), "sigqueue() payload kept");
+    signal_pipefd_cleanup();
+}
+
+/* check(), clear(), drain() and read() on a standard signal. */
+static void test_standard(void)
+{
+    struct signal_info info[4];
+
+    check(signal_pipefd_check(SIGUSR1) == 0, "nothing pending");
+    raise(SIGUSR1);
+    check(signal_pipefd_check(SIGUSR1) == 1, "check() sees the delivery");
+    check(signal_pipefd_clear(SIGUSR1) == 0, "clear()");
+    check(signal_pipefd_check(SIGUSR1) == 0, "clear() takes the delivery");
+    check(signal_pipefd_clear(SIGUSR1) < 0, "clear() with nothing pending");
+
+    raise(SIGUSR1);
+    check(signal_pipefd_drain(SIGUSR1) == 1, "drain()");
+    check(signal_pipefd_drain(SIGUSR1) == 0, "drain() with nothing pending");
+
+    raise(SIGUSR1);
+    check((signal_pipefd_read(info, 4) == 1) && (info[0].signum == SIGUSR1) &&
+          (info[0].pid == getpid()), "read()");
+    check(signal_pipefd_read(info, 4) == 0, "read() with nothing pending");
+}
+
+/* Every sigqueue() to a real-time signal comes out as its own entry, with
+ * its payload, and in the order that it was sent. The two signals' entries
+ * can be interleaved differently by each backend. */
+static void test_queued(void)
+{
+    struct signal_info info[2 * queued + 1];
+    int next[2] = {0, 0};
+    int in_order = 1;
+    int count;
+
+    for (int x = 0; x < queued; x++) {
+        sigqueue(getpid(), SIGRTMIN + 1, (union sigval) {.sival_int = x});
+        sigqueue(getpid(), SIGRTMIN + 2, (union sigval) {.sival_int = x});
+    }
+
+    count = signal_pipefd_read(info, 2 * queued + 1);
+    check(count == 2 * queued, "every sigqueue() read");
+
+    for (int x = 0; x < count; x++) {
+        int which = info[x].signum - (SIGRTMIN + 1);
+
+        if ((which < 0) || (which > 1) || (info[x].value != next[which])) {
+            in_order = 0;
+            break;
+        }
+
+        next[which]++;
+    }
+
+    check(in_order, "payloads in the order that they were sent");
+}
+
+/* A launched program starts with SIGUSR1 unblocked, even though the
+ * signalfd backend blocks it here, so it can kill itself with it. */
+static void test_child_mask(void)
+{
+    char *argv[] = {"sh", "-c", "kill -USR1 $$; exit 3", NULL};
+    pid_t child = proc_launch(argv, 0, 1, 2);
+    int status = 0;
+
+    check((child > 0) && (waitpid(child, &status, 0) == child) &&
+          WIFSIGNALED(status) && (WTERMSIG(status) == SIGUSR1),
+          "launched program doesn't inherit the blocked signals");
+}
+
+static void test_backend(signal_backend_t backend)
+{
+    check(signal_pipefd_set_backend(backend) == 0, "select backend");
+
+    if ((signal_pipefd_connect(SIGUSR1) < 0) ||
+        (signal_pipefd_connect(SIGRTMIN + 1) < 0) ||
+        (signal_pipefd_connect(SIGRTMIN + 2) < 0)) {
+        check(0, "connect");
+        return;
+    }
+
+    test_standard();
+    test_queued();
+    test_child_mask();
+    signal_pipefd_cleanup();
+}
+
+int main(void)
+{
+    test_ring();
+    test_backend(signal_backend_pipe);
+    test_backend(signal_backend_signalfd);
+
+    if (failures != 0) {
+        fprintf(stderr, "test-sigring: %u failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("test-sigring: OK\n");
+    return 0;
+}
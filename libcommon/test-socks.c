@@ -0,0 +1,962 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libsocks.h"
+
+/* Checks the event-driven server against clients that don't read their
+ * responses or events, and against connections that fail while they're
+ * waiting for the workers, along with protocol versions, passed descriptors
+ * and batches. Exits with a non-zero status if anything fails (or crashes,
+ * under the sanitizers), or is killed by SIGALRM if the server gets stuck. */
+
+enum {
+    response_size = 4096,
+    greedy_requests = 10000,
+    honest_requests = 100,
+    extra_pipes = 3,
+    events_published = 200,
+    event_max = 1024
+};
+
+/* The v2 and batch flags, set in the size word of a raw batch record. */
+static const uint32_t batch_flags = 0xA0000000U;
+
+static unsigned int failures = 0;
+static atomic_bool stopping = false;
+static char filename[64];
+static int extra_writers[extra_pipes];
+static int items_run = 0;
+static struct socks_server *sub_server = NULL;
+static enum socks_overflow sub_overflow = socks_overflow_drop_oldest;
+static bool subscribed = false;
+
+/* Progress through the events on a subscription. 'next' is the lowest
+ * sequence number that can still arrive. */
+
+struct event_count {
+    unsigned int received;
+    unsigned int next;
+    bool intact;
+};
+
+static void check(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* Responds with response_size copies of the request's first byte. */
+static int respond(int fd, const char *buf, uint32_t nbyte)
+{
+    char response[response_size];
+
+    memset(response, (nbyte != 0) ? buf[0] : '-', sizeof(response));
+    return (socks_respond(fd, response, sizeof(response)) < 0) ? -1 : 0;
+}
+
+/* Responds to "1" with the read end of a pipe holding "piped", and to
+ * anything else with the read ends of extra_pipes pipes, keeping their write
+ * ends in extra_writers. */
+static int respond_pipes(int fd, const char *buf, uint32_t nbyte)
+{
+    unsigned int count = ((nbyte != 0) && (buf[0] == '1')) ? 1 : extra_pipes;
+    int readers[extra_pipes];
+    int pipe_fds[2];
+    ssize_t result;
+
+    for (unsigned int x = 0; x < count; x++) {
+        if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+            return -1;
+        }
+
+        readers[x] = pipe_fds[0];
+        extra_writers[x] = pipe_fds[1];
+    }
+
+    if (count == 1) {
+        write_nointr(extra_writers[0], "piped", 5);
+        close_nointr(extra_writers[0]);
+    }
+
+    result = socks_respond_fds(fd, "fds", 3, readers, count);
+
+    for (unsigned int x = 0; x < count; x++) {
+        close_nointr(readers[x]);
+    }
+
+    return (result < 0) ? -1 : 0;
+}
+
+/* Echoes each request, except that "fail" fails without a response. */
+static int respond_items(int fd, const char *buf, uint32_t nbyte)
+{
+    items_run++;
+
+    if ((nbyte == 4) && (memcmp(buf, "fail", 4) == 0)) {
+        return -1;
+    }
+
+    return (socks_respond(fd, buf, nbyte) < 0) ? -1 : 0;
+}
+
+/* Subscribes the connection with room for two queued events, and shrinks
+ * its send buffer so that it fills up after a few of them. */
+static int respond_subscribe(int fd, const char *buf, uint32_t nbyte)
+{
+    int size = 4096;
+
+    (void) buf;
+    (void) nbyte;
+
+    if ((socks_server_subscribe(sub_server, fd, 2, sub_overflow) != 0) ||
+        (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0)) {
+        return -1;
+    }
+
+    subscribed = true;
+    return (socks_respond(fd, "ok", 2) < 0) ? -1 : 0;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec pause = {.tv_sec = ms / 1000,
+                             .tv_nsec = (ms % 1000) * 1000000L};
+
+    nanosleep_nointr(&pause, NULL);
+}
+
+static int fail_slowly(int fd, const char *buf, uint32_t nbyte)
+{
+    (void) fd;
+    (void) buf;
+    (void) nbyte;
+
+    sleep_ms(50);
+    return -1;
+}
+
+/* Returns true once nothing holds the read end of the pipe that 'fd' writes
+ * to. The server thread might still be closing its own copies when the
+ * client has its response, so this waits for up to a second. */
+static bool pipe_abandoned(int fd)
+{
+    for (int x = 0; x < 100; x++) {
+        if ((write(fd, "x", 1) < 0) && (errno == EPIPE)) {
+            return true;
+        }
+
+        sleep_ms(10);
+    }
+
+    return false;
+}
+
+static void * server_main(void *arg)
+{
+    struct socks_server *server = arg;
+
+    while (!atomic_load(&stopping)) {
+        socks_server_run(server, 50);
+    }
+
+    return NULL;
+}
+
+static struct socks_server * server_start(int socket_fd, pthread_t *thread,
+                                          socks_callback_t callback,
+                                          size_t output_limit)
+{
+    struct socks_server *server = socks_server_create(socket_fd, callback, 16);
+
+    if (server == NULL) {
+        return NULL;
+    }
+
+    socks_server_set_output_limit(server, output_limit);
+    atomic_store(&stopping, false);
+
+    if (pthread_create(thread, NULL, server_main, server) != 0) {
+        socks_server_destroy(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+static void server_stop(struct socks_server *server, pthread_t thread)
+{
+    atomic_store(&stopping, true);
+    pthread_join(thread, NULL);
+    socks_server_destroy(server);
+}
+
+/* A client that pipelines requests without ever reading the responses gets
+ * disconnected, and doesn't hold up anyone else in the meantime. */
+static void test_greedy(int socket_fd)
+{
+    struct socks_session *greedy = socks_session_open(filename);
+    struct socks_server *server;
+    char output[response_size];
+    pthread_t thread;
+    uint32_t id;
+    int sent = 0;
+
+    server = server_start(socket_fd, &thread, respond, 65536);
+    check((server != NULL) && (greedy != NULL), "greedy setup");
+
+    if ((server == NULL) || (greedy == NULL)) {
+        return;
+    }
+
+    while ((sent < greedy_requests) &&
+           (socks_session_send(greedy, "g", 1, &id) == 0)) {
+        sent++;
+    }
+
+    check(sent < greedy_requests, "greedy client is disconnected");
+    check(socks_client_process(filename, "h", 1, output, sizeof(output)) ==
+          response_size, "other client is served");
+    check(output[0] == 'h', "other client's response");
+
+    socks_session_close(greedy);
+    server_stop(server, thread);
+}
+
+/* A client that sends a lot before it starts reading, but stays under the
+ * output limit, gets every response intact. */
+static void test_backlog(int socket_fd)
+{
+    struct socks_session *session = socks_session_open(filename);
+    struct socks_server *server;
+    uint32_t ids[honest_requests];
+    char output[response_size];
+    char input[2] = {0};
+    pthread_t thread;
+    int intact = 0;
+
+    server = server_start(socket_fd, &thread, respond,
+                          socks_default_output_limit);
+    check((server != NULL) && (session != NULL), "backlog setup");
+
+    if ((server == NULL) || (session == NULL)) {
+        return;
+    }
+
+    for (int x = 0; x < honest_requests; x++) {
+        input[0] = (char) ('a' + (x % 26));
+        check(socks_session_send(session, input, 1, &ids[x]) == 0,
+              "backlog send");
+    }
+
+    for (int x = 0; x < honest_requests; x++) {
+        if ((socks_session_recv(session, ids[x], output, sizeof(output)) ==
+             response_size) && (output[0] == 'a' + (x % 26)) &&
+            (output[response_size - 1] == output[0])) {
+            intact++;
+        }
+    }
+
+    check(intact == honest_requests, "backlog responses are intact");
+
+    socks_session_close(session);
+    server_stop(server, thread);
+}
+
+/* With one worker and room for one more request, a third request stalls
+ * the connection. Once both of the others have failed, the connection is
+ * dropped while it's still waiting for room, and has to be taken off the
+ * stalled list before it's freed. */
+static void test_stalled(int socket_fd)
+{
+    struct socks_server *server = socks_server_create(socket_fd, fail_slowly,
+                                                      16);
+    struct socks_session *session = socks_session_open(filename);
+    uint32_t id;
+
+    check((server != NULL) && (session != NULL) &&
+          (socks_server_start_workers(server, 1, 1, NULL) == 0),
+          "stalled setup");
+
+    if ((server == NULL) || (session == NULL)) {
+        return;
+    }
+
+    for (int x = 0; x < 3; x++) {
+        socks_session_send(session, "s", 1, &id);
+    }
+
+    for (int x = 0; (x < 20) && (socks_server_connections(server) == 0);
+         x++) {
+        socks_server_run(server, 50);
+    }
+
+    socks_server_run(server, 50);
+    sleep_ms(250);
+
+    for (int x = 0; (x < 20) && (socks_server_connections(server) != 0);
+         x++) {
+        socks_server_run(server, 50);
+    }
+
+    check(socks_server_connections(server) == 0, "failed connection dropped");
+
+    socks_session_close(session);
+    socks_server_destroy(server);
+}
+
+/* Serves one request the way a server built before protocol v2 did: a
+ * 4-byte read for the header (which drops the rest of its record), a read of
+ * that many bytes for the body, and a reply in the same two records. The
+ * reply is the request's body, or "?" if the header wasn't a plain v1
+ * size. */
+static void * old_server_main(void *arg)
+{
+    int socket_fd = *(int *) arg;
+    uint32_t msgsize = 0;
+    char body[64];
+    ssize_t result = 1;
+    int fd = accept(socket_fd, NULL, NULL);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if ((read(fd, &msgsize, sizeof(msgsize)) != sizeof(msgsize)) ||
+        (msgsize == 0) || (msgsize > sizeof(body))) {
+        memcpy(body, "?", 1);
+        msgsize = 1;
+    } else {
+        result = read(fd, body, msgsize);
+    }
+
+    if (result > 0) {
+        write(fd, &msgsize, sizeof(msgsize));
+        write(fd, body, msgsize);
+    }
+
+    close_nointr(fd);
+    return NULL;
+}
+
+/* A pool whose server restarts between two requests sends the second one
+ * on a new connection, to the new server. */
+static void test_pool_restart(void)
+{
+    struct socks_server *server;
+    struct socks_pool *pool;
+    char pool_filename[80];
+    char output[response_size];
+    pthread_t thread;
+    int pool_fd;
+
+    snprintf(pool_filename, sizeof(pool_filename), "%s.pool", filename);
+    pool_fd = socks_server_open(pool_filename);
+    pool = socks_pool_create(pool_filename, 2);
+    server = server_start(pool_fd, &thread, respond,
+                          socks_default_output_limit);
+    check((pool_fd >= 0) && (pool != NULL) && (server != NULL),
+          "pool setup");
+
+    if ((pool_fd < 0) || (pool == NULL) || (server == NULL)) {
+        return;
+    }
+
+    check((socks_pool_process(pool, "a", 1, output, sizeof(output)) ==
+           response_size) && (output[0] == 'a'), "pool before restart");
+
+    server_stop(server, thread);
+    socks_server_close(pool_fd);
+    unlink(pool_filename);
+    pool_fd = socks_server_open(pool_filename);
+    server = (pool_fd >= 0) ?
+             server_start(pool_fd, &thread, respond,
+                          socks_default_output_limit) : NULL;
+    check(server != NULL, "server restart");
+
+    if (server != NULL) {
+        check((socks_pool_process(pool, "b", 1, output, sizeof(output)) ==
+               response_size) && (output[0] == 'b'), "pool after restart");
+        check(socks_server_connections(server) == 1,
+              "pool reconnected to the new server");
+        socks_pool_destroy(pool);
+        server_stop(server, thread);
+    } else {
+        socks_pool_destroy(pool);
+    }
+
+    socks_server_close(pool_fd);
+    unlink(pool_filename);
+}
+
+/* A client with the default settings still talks to a server that only
+ * knows v1, and one that selects v2 gets v2 answers from this server. */
+static void test_old_server(int socket_fd)
+{
+    struct socks_server *server;
+    char old_filename[80];
+    char output[response_size];
+    pthread_t thread;
+    int old_fd;
+
+    snprintf(old_filename, sizeof(old_filename), "%s.old", filename);
+    old_fd = socks_server_open(old_filename);
+    check(old_fd >= 0, "old server setup");
+
+    if (old_fd < 0) {
+        return;
+    }
+
+    if (pthread_create(&thread, NULL, old_server_main, &old_fd) == 0) {
+        check((socks_client_process(old_filename, "v1", 2, output,
+                                    sizeof(output)) == 2) &&
+              (memcmp(output, "v1", 2) == 0),
+              "default client against a v1-only server");
+        pthread_join(thread, NULL);
+    }
+
+    socks_server_close(old_fd);
+    unlink(old_filename);
+
+    server = server_start(socket_fd, &thread, respond,
+                          socks_default_output_limit);
+
+    if (server == NULL) {
+        return;
+    }
+
+    check(socks_set_protocol(2) == 0, "select v2");
+    check((socks_client_process(filename, "2", 1, output, sizeof(output)) ==
+           response_size) && (output[0] == '2'), "v2 client");
+    socks_set_protocol(1);
+    server_stop(server, thread);
+}
+
+/* A pipe's read end passed in a response works in the client, over either
+ * protocol version. Descriptors beyond what the client has room for are
+ * closed, which leaves their pipes without readers. */
+static void test_pass_fds(int socket_fd)
+{
+    struct socks_server *server;
+    char output[16];
+    char data[8];
+    pthread_t thread;
+    unsigned int nfds;
+    int fds[extra_pipes];
+
+    server = server_start(socket_fd, &thread, respond_pipes,
+                          socks_default_output_limit);
+    check(server != NULL, "pass fds setup");
+
+    if (server == NULL) {
+        return;
+    }
+
+    for (unsigned int version = 1; version <= 2; version++) {
+        socks_set_protocol(version);
+        nfds = 1;
+        fds[0] = -1;
+        check((socks_client_process_fds(filename, "1", 1, output,
+                                        sizeof(output), fds, &nfds) == 3) &&
+              (nfds == 1), (version == 1) ? "v1 response with a pipe" :
+                                            "v2 response with a pipe");
+        check((nfds == 1) && (read_nointr(fds[0], data, sizeof(data)) == 5) &&
+              (memcmp(data, "piped", 5) == 0), "read from the passed pipe");
+
+        if (nfds == 1) {
+            close_nointr(fds[0]);
+        }
+    }
+
+    socks_set_protocol(1);
+    nfds = 1;
+    check((socks_client_process_fds(filename, "3", 1, output, sizeof(output),
+                                    fds, &nfds) == 3) && (nfds == 1),
+          "response with more descriptors than room");
+    check(write(extra_writers[0], "x", 1) == 1, "kept descriptor is open");
+
+    for (unsigned int x = 1; x < extra_pipes; x++) {
+        check(pipe_abandoned(extra_writers[x]),
+              "descriptors beyond the capacity are closed");
+    }
+
+    for (unsigned int x = 0; x < extra_pipes; x++) {
+        close_nointr(extra_writers[x]);
+    }
+
+    if (nfds == 1) {
+        close_nointr(fds[0]);
+    }
+
+    server_stop(server, thread);
+}
+
+static char * put_uint32(char *cursor, uint32_t value)
+{
+    for (int x = 0; x < 4; x++) {
+        cursor[x] = (char)((value >> (8 * x)) & 0xFF);
+    }
+
+    return cursor + 4;
+}
+
+static int raw_connect(const char *name)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    strncpy(address.sun_path, name, sizeof(address.sun_path) - 1);
+
+    if ((fd >= 0) &&
+        (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0)) {
+        close_nointr(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Sends a v2 batch whose envelope says there's one item of 'item_size'
+ * bytes, followed by 'nbyte' bytes of it. */
+static int send_envelope(const char *name, uint32_t item_size, uint32_t nbyte)
+{
+    char record[64] = {0};
+    char *cursor = record + 4;
+    int fd = raw_connect(name);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    cursor = put_uint32(cursor, 1);
+    cursor = put_uint32(cursor, item_size) + nbyte;
+    put_uint32(record, (uint32_t)(cursor - record - 4) | batch_flags);
+
+    if (send(fd, record, (size_t)(cursor - record), MSG_NOSIGNAL) < 0) {
+        close_nointr(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Answers one request with a batch response that claims a 100-byte item but
+ * only holds 3 bytes of it. */
+static void * bad_batch_main(void *arg)
+{
+    int socket_fd = *(int *) arg;
+    char record[64];
+    char *cursor = record + 4;
+    int fd = accept(socket_fd, NULL, NULL);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    recv(fd, record, sizeof(record), 0);
+    cursor = put_uint32(cursor, 1);
+    cursor = put_uint32(cursor, 0);
+    cursor = put_uint32(cursor, 100);
+    memcpy(cursor, "abc", 3);
+    cursor += 3;
+    put_uint32(record, (uint32_t)(cursor - record - 4) | batch_flags);
+    send(fd, record, (size_t)(cursor - record), MSG_NOSIGNAL);
+    close_nointr(fd);
+    return NULL;
+}
+
+/* A failing item gets its status back without holding up the others. */
+static void test_batch_items(int socket_fd)
+{
+    struct socks_batch *batch = socks_batch_create();
+    struct socks_server *server;
+    const char *output;
+    pthread_t thread;
+    uint32_t nbyte;
+    int status;
+
+    server = server_start(socket_fd, &thread, respond_items,
+                          socks_default_output_limit);
+    check((server != NULL) && (batch != NULL), "batch setup");
+
+    if ((server == NULL) || (batch == NULL)) {
+        return;
+    }
+
+    check((socks_batch_add(batch, "one", 3) == 0) &&
+          (socks_batch_add(batch, "fail", 4) == 0) &&
+          (socks_batch_add(batch, "three", 5) == 0), "socks_batch_add()");
+    check(socks_batch_process(filename, batch) == 3, "socks_batch_process()");
+    check((socks_batch_result(batch, 0, &output, &nbyte, &status) == 0) &&
+          (status == 0) && (nbyte == 3) && (memcmp(output, "one", 3) == 0),
+          "first item");
+    check((socks_batch_result(batch, 1, &output, &nbyte, &status) == 0) &&
+          (status == -1) && (nbyte == 0), "failing item");
+    check((socks_batch_result(batch, 2, &output, &nbyte, &status) == 0) &&
+          (status == 0) && (nbyte == 5) && (memcmp(output, "three", 5) == 0),
+          "item after the failing one");
+
+    socks_batch_destroy(batch);
+    server_stop(server, thread);
+}
+
+/* Item lengths that run past the end of the envelope are refused before
+ * any callback runs, and so is a response that does the same to a client. */
+static void test_batch_malformed(int socket_fd)
+{
+    struct socks_batch *batch = socks_batch_create();
+    const uint32_t item_sizes[2] = {100, 0xFFFFFFF0U};
+    pthread_t thread;
+    int fd;
+
+    for (int x = 0; x < 2; x++) {
+        items_run = 0;
+        fd = send_envelope(filename, item_sizes[x], 3);
+        check(fd >= 0, "malformed batch sent");
+        errno = 0;
+        check((socks_server_process(socket_fd, respond_items) < 0) &&
+              (errno == EPROTO) && (items_run == 0),
+              (x == 0) ? "truncated item refused with EPROTO" :
+                         "over-long item refused with EPROTO");
+
+        if (fd >= 0) {
+            close_nointr(fd);
+        }
+    }
+
+    check((batch != NULL) && (socks_batch_add(batch, "x", 1) == 0),
+          "batch setup");
+
+    if ((batch != NULL) &&
+        (pthread_create(&thread, NULL, bad_batch_main, &socket_fd) == 0)) {
+        errno = 0;
+        check((socks_batch_process(filename, batch) < 0) &&
+              (errno == EPROTO), "truncated batch response gives EPROTO");
+        pthread_join(thread, NULL);
+    }
+
+    socks_batch_destroy(batch);
+}
+
+/* A batch can't grow past the maximum message size, and one that's bigger
+ * than the server's maximum is refused. */
+static void test_batch_size(int socket_fd)
+{
+    struct socks_batch *batch = socks_batch_create();
+    static char item[30000];
+    struct socks_server *server;
+    pthread_t thread;
+
+    server = server_start(socket_fd, &thread, respond_items,
+                          socks_default_output_limit);
+    check((server != NULL) && (batch != NULL), "batch size setup");
+
+    if ((server == NULL) || (batch == NULL)) {
+        return;
+    }
+
+    check((socks_batch_add(batch, item, sizeof(item)) == 0) &&
+          (socks_batch_add(batch, item, sizeof(item)) == 0),
+          "batch under the maximum message size");
+    errno = 0;
+    check((socks_batch_add(batch, item, sizeof(item)) < 0) &&
+          (errno == EMSGSIZE), "batch over the maximum message size");
+
+    items_run = 0;
+    socks_set_max_message(1024);
+    check((socks_batch_process(filename, batch) < 0) && (items_run == 0),
+          "server refuses a batch over its maximum message size");
+    socks_set_max_message(socks_default_max_message);
+
+    socks_batch_destroy(batch);
+    server_stop(server, thread);
+}
+
+/* Events vary in size (from 4 to 703 bytes), so that a full socket cuts
+ * them off at different points. */
+static uint32_t event_length(unsigned int sequence)
+{
+    return (uint32_t) sizeof(sequence) + ((sequence * 97) % 700);
+}
+
+/* Fills in event 'sequence', which starts with its sequence number. */
+static uint32_t event_fill(char *event, unsigned int sequence)
+{
+    uint32_t nbyte = event_length(sequence);
+
+    memset(event, (char) sequence, nbyte);
+    memcpy(event, &sequence, sizeof(sequence));
+    return nbyte;
+}
+
+/* Checks an event that arrived on a subscription: it has to be whole, and
+ * come after the ones before it. */
+static void event_check(struct event_count *count, const char *event,
+                        ssize_t nbyte)
+{
+    unsigned int sequence;
+
+    memcpy(&sequence, event, sizeof(sequence));
+
+    if ((nbyte < (ssize_t) sizeof(sequence)) || (sequence < count->next) ||
+        (nbyte != (ssize_t) event_length(sequence)) ||
+        (event[nbyte - 1] != (char) sequence)) {
+        count->intact = false;
+        return;
+    }
+
+    count->received++;
+    count->next = sequence + 1;
+}
+
+/* Connects a subscriber with the given overflow policy and protocol
+ * version, and takes the response to its request. Returns the connection,
+ * or -1 in the event of an error. */
+static int subscriber_open(int socket_fd, enum socks_overflow overflow,
+                           unsigned int version)
+{
+    char output[8];
+    int fd;
+
+    sub_server = socks_server_create(socket_fd, respond_subscribe, 16);
+    sub_overflow = overflow;
+    subscribed = false;
+
+    if (sub_server == NULL) {
+        return -1;
+    }
+
+    socks_set_protocol(version);
+    fd = socks_subscribe(filename, "s", 1);
+    socks_set_protocol(1);
+
+    for (int x = 0; (fd >= 0) && (x < 20) && (subscribed == false); x++) {
+        socks_server_run(sub_server, 50);
+    }
+
+    if ((fd >= 0) && (socks_event_recv(fd, output, sizeof(output)) != 2)) {
+        close_nointr(fd);
+        fd = -1;
+    }
+
+    if (fd < 0) {
+        socks_server_destroy(sub_server);
+        sub_server = NULL;
+    }
+
+    return fd;
+}
+
+/* Lets the server flush its queues, and reads everything that arrives on
+ * 'fd' until it goes quiet or hangs up. Returns the result of the last
+ * socks_event_recv() call. */
+static ssize_t events_drain(int fd, struct event_count *count)
+{
+    struct pollfd target = {.fd = fd, .events = POLLIN};
+    char event[event_max];
+    ssize_t result = 0;
+
+    while (result >= 0) {
+        socks_server_run(sub_server, 10);
+
+        if (poll_nointr(&target, 1, 100) <= 0) {
+            break;
+        }
+
+        result = socks_event_recv(fd, event, sizeof(event));
+
+        if (result >= 0) {
+            event_check(count, event, result);
+        }
+    }
+
+    return result;
+}
+
+/* A subscriber that stops reading loses the oldest queued events, and gets
+ * the rest (ending with the newest) once it reads again. */
+static void test_drop_oldest(int socket_fd)
+{
+    struct event_count count = {0, 0, true};
+    char event[event_max];
+    unsigned long dropped;
+    int fd = subscriber_open(socket_fd, socks_overflow_drop_oldest, 2);
+
+    check(fd >= 0, "drop-oldest subscriber setup");
+
+    if (fd < 0) {
+        return;
+    }
+
+    for (unsigned int x = 0; x < events_published; x++) {
+        socks_server_publish(sub_server, event, event_fill(event, x));
+    }
+
+    dropped = socks_server_dropped(sub_server);
+    check(dropped != 0, "events dropped from a full queue");
+    events_drain(fd, &count);
+    check(count.intact, "drop-oldest events arrive whole and in order");
+    check(count.received + dropped == events_published,
+          "every event either arrives or is counted as dropped");
+    check(count.next == events_published, "newest event kept");
+
+    close_nointr(fd);
+    socks_server_destroy(sub_server);
+}
+
+/* A subscriber with the disconnect policy is hung up on instead, once its
+ * queue overflows. */
+static void test_disconnect(int socket_fd)
+{
+    struct event_count count = {0, 0, true};
+    char event[event_max];
+    int reached = 1;
+    int fd = subscriber_open(socket_fd, socks_overflow_disconnect, 2);
+
+    check(fd >= 0, "disconnect subscriber setup");
+
+    if (fd < 0) {
+        return;
+    }
+
+    for (unsigned int x = 0; (x < events_published) && (reached > 0); x++) {
+        reached = socks_server_publish(sub_server, event,
+                                       event_fill(event, x));
+    }
+
+    check(reached == 0, "overflowing subscriber is cut off");
+    errno = 0;
+    check((events_drain(fd, &count) < 0) && (errno == ECONNRESET),
+          "subscriber sees the hangup");
+    check(count.intact, "events before the hangup arrive whole");
+    check(socks_server_dropped(sub_server) == 0,
+          "disconnecting doesn't count drops");
+
+    close_nointr(fd);
+    socks_server_destroy(sub_server);
+}
+
+/* Reads every record that's waiting on a v1 subscription, without
+ * blocking. Returns true if it stopped between a header and its body. */
+static bool records_drain(int fd, struct event_count *count, bool *in_body,
+                          uint32_t *expected)
+{
+    char record[event_max];
+    ssize_t result;
+
+    while ((result = recv(fd, record, sizeof(record), MSG_DONTWAIT)) > 0) {
+        if ((result == 4) && (*in_body == false)) {
+            memcpy(expected, record, sizeof(*expected));
+            *in_body = true;
+        } else {
+            count->intact = count->intact && *in_body &&
+                            (result == (ssize_t) *expected);
+            event_check(count, record, result);
+            *in_body = false;
+        }
+    }
+
+    return *in_body;
+}
+
+/* A v1 event is two records, and a full socket can take the header but not
+ * the body. Events are published in rounds that fill the socket at many
+ * different points, and the client looks at what it got before the server
+ * can send any more. Every event still has to arrive with the body that
+ * belongs to its header, even while the queue drops events around a
+ * half-sent one. */
+static void test_half_sent(int socket_fd)
+{
+    struct event_count count = {0, 0, true};
+    char event[event_max];
+    unsigned int sequence = 0;
+    uint32_t expected = 0;
+    bool in_body = false;
+    bool half_seen = false;
+    int fd = subscriber_open(socket_fd, socks_overflow_drop_oldest, 1);
+
+    check(fd >= 0, "v1 subscriber setup");
+
+    if (fd < 0) {
+        return;
+    }
+
+    while (sequence < events_published) {
+        for (int x = 0; x < 8; x++, sequence++) {
+            socks_server_publish(sub_server, event,
+                                 event_fill(event, sequence));
+        }
+
+        half_seen = records_drain(fd, &count, &in_body, &expected) ||
+                    half_seen;
+
+        for (int x = 0; x < 10; x++) {
+            socks_server_run(sub_server, 0);
+            records_drain(fd, &count, &in_body, &expected);
+        }
+    }
+
+    check(half_seen, "header sent without its body");
+    check(count.intact && (in_body == false),
+          "v1 events arrive whole and in order");
+    check(count.received + socks_server_dropped(sub_server) ==
+          events_published, "every v1 event either arrives or is dropped");
+
+    close_nointr(fd);
+    socks_server_destroy(sub_server);
+}
+
+int main(void)
+{
+    int socket_fd;
+
+    snprintf(filename, sizeof(filename), "/tmp/test-socks.%d.sock",
+             (int) getpid());
+    socket_fd = socks_server_open(filename);
+
+    if (socket_fd < 0) {
+        perror("socks_server_open");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    alarm(30);
+    test_greedy(socket_fd);
+    test_backlog(socket_fd);
+    test_stalled(socket_fd);
+    test_pool_restart();
+    test_old_server(socket_fd);
+    test_pass_fds(socket_fd);
+    test_batch_items(socket_fd);
+    test_batch_malformed(socket_fd);
+    test_batch_size(socket_fd);
+    test_drop_oldest(socket_fd);
+    test_disconnect(socket_fd);
+    test_half_sent(socket_fd);
+
+    socks_server_close(socket_fd);
+    unlink(filename);
+
+    if (failures != 0) {
+        fprintf(stderr, "test-socks: %u failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("test-socks: OK\n");
+    return 0;
+}
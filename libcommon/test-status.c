@@ -0,0 +1,104 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libnointr.h"
+#include "libstatus.h"
+
+/* Checks status board reads, including a record that a writer left
+ * mid-update by dying. Exits with a non-zero status if anything fails. */
+
+static unsigned int failures = 0;
+
+static void check(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* Leaves the sequence number of 'slot' odd, the way a writer that died in
+ * the middle of status_board_publish() would. The header stores the record
+ * size at offset 12, and each record starts with its sequence number. */
+static int break_record(const char *filename, unsigned int slot)
+{
+    int fd = open_nointr(filename, O_RDWR | O_CLOEXEC);
+    uint32_t record_size;
+    uint32_t *sequence;
+    char *map;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    map = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close_nointr(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    memcpy(&record_size, map + 12, sizeof(record_size));
+    sequence = (uint32_t *)(void *)(map + 64 + (slot * record_size));
+    __atomic_fetch_add(sequence, 1, __ATOMIC_RELEASE);
+    munmap(map, 4096);
+    return 0;
+}
+
+int main(void)
+{
+    struct status_entry entry = {.pid = 42, .state = status_running};
+    struct status_entry copy;
+    struct status_board *writer;
+    struct status_board *reader;
+    char filename[64];
+
+    snprintf(filename, sizeof(filename), "/tmp/test-status.%d",
+             (int) getpid());
+    strcpy(entry.name, "svc");
+    writer = status_board_create(filename, 4);
+    reader = status_board_open(filename);
+
+    if ((writer == NULL) || (reader == NULL)) {
+        perror("status_board");
+        return 1;
+    }
+
+    check(status_board_publish(writer, 0, &entry) == 0, "publish");
+    check(status_board_publish(writer, 1, &entry) == 0, "publish");
+    check((status_board_read(reader, 0, &copy) == 0) && (copy.pid == 42) &&
+          (strcmp(copy.name, "svc") == 0), "read");
+
+    errno = 0;
+    check((status_board_read(reader, 4, &copy) < 0) && (errno == EINVAL),
+          "out of range slot");
+
+    check(break_record(filename, 0) == 0, "break record");
+    errno = 0;
+    check((status_board_read(reader, 0, &copy) < 0) && (errno == EAGAIN),
+          "record left mid-update");
+    check(status_board_read(reader, 1, &copy) == 0, "other records still read");
+
+    status_board_close(writer);
+    errno = 0;
+    check((status_board_read(reader, 1, &copy) < 0) && (errno == ESTALE),
+          "retired board");
+
+    status_board_close(reader);
+    unlink(filename);
+
+    if (failures != 0) {
+        fprintf(stderr, "test-status: %u failure(s)\n", failures);
+        return 1;
+    }
+
+    printf("test-status: OK\n");
+    return 0;
+}
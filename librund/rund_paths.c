@@ -19,6 +19,7 @@ static const char rcfile[] = ".rundrc";
 static const char conffile[] = "rund.conf";
 static const char sysconfdir[] = "etc";
 static const char runstatedir[] = "/var/run";
+static const char statusfile[] = "status";
 
 static int get_user(char *output, size_t maxlen)
 {
@@ -109,3 +110,15 @@ int rund_statedir_get(char *output, size_t maxlen, bool system_only)
 
     return default_statedir(output, maxlen);
 }
+
+int rund_statusfile_get(char *output, size_t maxlen, bool system_only)
+{
+    char statedir[PATH_MAX + 1];
+    int result = rund_statedir_get(statedir, sizeof(statedir), system_only);
+
+    if (result != 0) {
+        return result;
+    }
+
+    return path_join(output, statedir, statusfile, maxlen);
+}
@@ -8,4 +8,8 @@
 
 int rund_statedir_get(char *output, size_t maxlen, bool system_only);
 
+/* Gets the path of the status board (see libstatus.h) in the statedir. */
+
+int rund_statusfile_get(char *output, size_t maxlen, bool system_only);
+
 #endif